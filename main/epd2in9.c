@@ -1,6 +1,12 @@
 #include "epd2in9.h"
 #include "epdif.h"
 
+#include "esp_log.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
 // EPD2IN9 commands
 #define DRIVER_OUTPUT_CONTROL                       0x01
 #define BOOSTER_SOFT_START_CONTROL                  0x0C
@@ -24,6 +30,12 @@
 #define SET_RAM_Y_ADDRESS_COUNTER                   0x4F
 #define TERMINATE_FRAME_READ_WRITE                  0xFF
 
+/*
+ * look-up tables are 20 bytes of phase voltages followed by 10 bytes of
+ * phase lengths (one nibble per phase, in frames). the panel responds
+ * faster when warm, so the cold/warm variants only rescale the phase
+ * lengths of the room temperature tables (x1.5 cold, x0.75 warm).
+ */
 static const uint8_t lut_full_update[] =
 {
     0x02, 0x02, 0x01, 0x11, 0x12, 0x12, 0x22, 0x22, 
@@ -32,6 +44,22 @@ static const uint8_t lut_full_update[] =
     0x35, 0x51, 0x51, 0x19, 0x01, 0x00
 };
 
+static const uint8_t lut_full_update_cold[] =
+{
+    0x02, 0x02, 0x01, 0x11, 0x12, 0x12, 0x22, 0x22, 
+    0x66, 0x69, 0x69, 0x59, 0x58, 0x99, 0x99, 0x88, 
+    0x00, 0x00, 0x00, 0x00, 0xFC, 0xF6, 0x25, 0x82, 
+    0x58, 0x82, 0x82, 0x2E, 0x02, 0x00
+};
+
+static const uint8_t lut_full_update_warm[] =
+{
+    0x02, 0x02, 0x01, 0x11, 0x12, 0x12, 0x22, 0x22, 
+    0x66, 0x69, 0x69, 0x59, 0x58, 0x99, 0x99, 0x88, 
+    0x00, 0x00, 0x00, 0x00, 0xB6, 0x83, 0x12, 0x41, 
+    0x24, 0x41, 0x41, 0x17, 0x01, 0x00
+};
+
 static const uint8_t lut_partial_update[] =
 {
     0x10, 0x18, 0x18, 0x08, 0x18, 0x18, 0x08, 0x00, 
@@ -40,36 +68,111 @@ static const uint8_t lut_partial_update[] =
     0x00, 0x00, 0x00, 0x00, 0x00, 0x00
 };
 
-static void epd_set_lut(const uint8_t* lut) {
-    epdif_send_command(WRITE_LUT_REGISTER);
-    /* the length of look-up table is 30 bytes */
-    epdif_send_data(lut, 30);
+static const uint8_t lut_partial_update_cold[] =
+{
+    0x10, 0x18, 0x18, 0x08, 0x18, 0x18, 0x08, 0x00, 
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 
+    0x00, 0x00, 0x00, 0x00, 0x25, 0x26, 0x66, 0x23, 
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+static const uint8_t lut_partial_update_warm[] =
+{
+    0x10, 0x18, 0x18, 0x08, 0x18, 0x18, 0x08, 0x00, 
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 
+    0x00, 0x00, 0x00, 0x00, 0x12, 0x13, 0x33, 0x12, 
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+typedef struct epd_lut_band {
+    int min_temperature;        /* band is used from this temperature (celsius) up */
+    const uint8_t* lut_full;
+    const uint8_t* lut_partial;
+} epd_lut_band_t;
+
+/* sorted by descending min_temperature, last entry catches everything */
+static const epd_lut_band_t lut_bands[] =
+{
+    { EPD_TEMPERATURE_WARM, lut_full_update_warm, lut_partial_update_warm },
+    { EPD_TEMPERATURE_COLD, lut_full_update,      lut_partial_update      },
+    { -128,                 lut_full_update_cold, lut_partial_update_cold },
+};
+
+static int epd_temperature = EPD_TEMPERATURE_DEFAULT;
+
+static const char *TAG = "EPD-2IN9";
+
+/* SPI clock candidates for calibration, slowest (reference) first */
+static const int epd_spi_clocks[] = { 4*1000*1000, 8*1000*1000, 10*1000*1000, 16*1000*1000, 20*1000*1000, 26*1000*1000, 40*1000*1000 };
+#define EPD_CALIBRATE_ROUNDS 3
+#define EPD_CALIBRATE_TOLERANCE 8   // allowed refresh time deviation, 1/8 of the reference
+
+/* the length of look-up table is 30 bytes */
+#define EPD_LUT_SIZE 30
+
+/* (cmd, nparams, params...) scripts, see epdif_send_script() */
+static const uint8_t epd_init_script[] =
+{
+    DRIVER_OUTPUT_CONTROL, 3, (EPD_HEIGHT - 1) & 0xFF, ((EPD_HEIGHT - 1) >> 8) & 0xFF, 0x00,   // GD = 0; SM = 0; TB = 0;
+    BOOSTER_SOFT_START_CONTROL, 3, 0xD7, 0xD6, 0x9D,
+    WRITE_VCOM_REGISTER, 1, 0xA8,                   // VCOM 7C
+    SET_DUMMY_LINE_PERIOD, 1, 0x1A,                 // 4 dummy lines per gate
+    SET_GATE_TIME, 1, 0x08,                         // 2us per line
+    DATA_ENTRY_MODE_SETTING, 1, 0x03,               // X increment; Y increment
+};
+
+static const uint8_t epd_display_frame_script[] =
+{
+    DISPLAY_UPDATE_CONTROL_2, 1, 0xC4,
+    MASTER_ACTIVATION, 0,
+    TERMINATE_FRAME_READ_WRITE, 0,
+};
+
+static const epd_lut_band_t* epd_get_lut_band(int temperature) {
+    int i;
+    for (i = 0; i < sizeof(lut_bands) / sizeof(lut_bands[0]) - 1; i++) {
+        if (temperature >= lut_bands[i].min_temperature) {
+            break;
+        }
+    }
+    return &lut_bands[i];
+}
+
+void epd_set_temperature(int celsius) {
+    epd_temperature = celsius;
+}
+
+int epd_get_temperature() {
+    return epd_temperature;
 }
 
 void epd_init(int lut_update_mode) {
-    /* EPD hardware init start */
-    epdif_reset();
-    epdif_send_command(DRIVER_OUTPUT_CONTROL);
-    epdif_send_byte_data((EPD_HEIGHT - 1) & 0xFF);
-    epdif_send_byte_data(((EPD_HEIGHT - 1) >> 8) & 0xFF);
-    epdif_send_byte_data(0x00);                     // GD = 0; SM = 0; TB = 0;
-    epdif_send_command(BOOSTER_SOFT_START_CONTROL);
-    epdif_send_byte_data(0xD7);
-    epdif_send_byte_data(0xD6);
-    epdif_send_byte_data(0x9D);
-    epdif_send_command(WRITE_VCOM_REGISTER);
-    epdif_send_byte_data(0xA8);                     // VCOM 7C
-    epdif_send_command(SET_DUMMY_LINE_PERIOD);
-    epdif_send_byte_data(0x1A);                     // 4 dummy lines per gate
-    epdif_send_command(SET_GATE_TIME);
-    epdif_send_byte_data(0x08);                     // 2us per line
-    epdif_send_command(DATA_ENTRY_MODE_SETTING);
-    epdif_send_byte_data(0x03);                     // X increment; Y increment
+    const epd_lut_band_t* band = epd_get_lut_band(epd_temperature);
+    const uint8_t* lut = 0;
     if (lut_update_mode == EPD_2IN9_LUT_UPDATE_FULL) {
-        epd_set_lut(lut_full_update);
+        lut = band->lut_full;
     } else if (lut_update_mode == EPD_2IN9_LUT_UPDATE_PART) {
-        epd_set_lut(lut_partial_update);
+        lut = band->lut_partial;
     }
+
+    /* init script is copied to the stack, the LUT parameters go out by DMA */
+    uint8_t script[sizeof(epd_init_script) + 4 + 2 + EPD_LUT_SIZE];
+    int len = sizeof(epd_init_script);
+    memcpy(script, epd_init_script, sizeof(epd_init_script));
+    script[len++] = TEMPERATURE_SENSOR_CONTROL;
+    script[len++] = 2;
+    script[len++] = epd_temperature & 0xFF;         // A[11:4], integer degrees
+    script[len++] = 0x00;                           // A[3:0], 1/16 degrees
+    if (lut) {
+        script[len++] = WRITE_LUT_REGISTER;
+        script[len++] = EPD_LUT_SIZE;
+        memcpy(&script[len], lut, EPD_LUT_SIZE);
+        len += EPD_LUT_SIZE;
+    }
+
+    /* EPD hardware init start */
+    epdif_reset();
+    epdif_send_script(script, len);
     /* EPD hardware init end */
 }
 
@@ -79,25 +182,22 @@ void epd_sleep() {
 }
 
 void epd_set_memory_pointer(int x, int y) {
-    epdif_send_command(SET_RAM_X_ADDRESS_COUNTER);
     /* x point must be the multiple of 8 or the last 3 bits will be ignored */
-    epdif_send_byte_data((x >> 3) & 0xFF);
-    epdif_send_command(SET_RAM_Y_ADDRESS_COUNTER);
-    epdif_send_byte_data(y & 0xFF);
-    epdif_send_byte_data((y >> 8) & 0xFF);
+    const uint8_t script[] = {
+        SET_RAM_X_ADDRESS_COUNTER, 1, (x >> 3) & 0xFF,
+        SET_RAM_Y_ADDRESS_COUNTER, 2, y & 0xFF, (y >> 8) & 0xFF,
+    };
+    epdif_send_script(script, sizeof(script));
     epdif_wait_until_idle();
 }
 
 void epd_set_memory_area(int x_start, int y_start, int x_end, int y_end) {
-    epdif_send_command(SET_RAM_X_ADDRESS_START_END_POSITION);
     /* x point must be the multiple of 8 or the last 3 bits will be ignored */
-    epdif_send_byte_data((x_start >> 3) & 0xFF);
-    epdif_send_byte_data((x_end >> 3) & 0xFF);
-    epdif_send_command(SET_RAM_Y_ADDRESS_START_END_POSITION);
-    epdif_send_byte_data(y_start & 0xFF);
-    epdif_send_byte_data((y_start >> 8) & 0xFF);
-    epdif_send_byte_data(y_end & 0xFF);
-    epdif_send_byte_data((y_end >> 8) & 0xFF);
+    const uint8_t script[] = {
+        SET_RAM_X_ADDRESS_START_END_POSITION, 2, (x_start >> 3) & 0xFF, (x_end >> 3) & 0xFF,
+        SET_RAM_Y_ADDRESS_START_END_POSITION, 4, y_start & 0xFF, (y_start >> 8) & 0xFF, y_end & 0xFF, (y_end >> 8) & 0xFF,
+    };
+    epdif_send_script(script, sizeof(script));
 }
 
 void epd_set_image_memory(const uint8_t* image_buffer, int x, int y, int width, int height) {
@@ -127,10 +227,13 @@ void epd_set_image_memory(const uint8_t* image_buffer, int x, int y, int width,
     epd_set_memory_area(x, y, x_end, y_end);
     epd_set_memory_pointer(x, y);
     epdif_send_command(WRITE_RAM);
-    /* send the image data */
-    for (int j = 0; j < y_end - y + 1; j++) {
-        for (int i = 0; i < (x_end - x + 1) / 8; i++) {
-            epdif_send_byte_data(image_buffer[i + j * (width / 8)]);
+    /* send the image data, in one go unless rows are clipped */
+    int row_len = (x_end - x + 1) / 8;
+    if (row_len == width / 8) {
+        epdif_send_data(image_buffer, row_len * (y_end - y + 1));
+    } else {
+        for (int j = 0; j < y_end - y + 1; j++) {
+            epdif_send_data(&image_buffer[j * (width / 8)], row_len);
         }
     }
 }
@@ -147,9 +250,50 @@ void epd_set_frame_memory(const uint8_t* frame_buffer) {
 }
 
 void epd_display_frame() {
-    epdif_send_command(DISPLAY_UPDATE_CONTROL_2);
-    epdif_send_byte_data(0xC4);
-    epdif_send_command(MASTER_ACTIVATION);
-    epdif_send_command(TERMINATE_FRAME_READ_WRITE);
+    epdif_send_script(epd_display_frame_script, sizeof(epd_display_frame_script));
     epdif_wait_until_idle();
 }
+
+/*
+ * BUSY time of a partial refresh. it is set by the phase lengths of the LUT
+ * just sent, so it changes if any init or LUT byte got corrupted on the way.
+ */
+static int64_t epd_measure_refresh() {
+    epdif_stats_t before, after;
+    epd_init(EPD_2IN9_LUT_UPDATE_PART);
+    epdif_get_stats(&before);
+    epd_display_frame();
+    epdif_get_stats(&after);
+    return after.busy_us - before.busy_us;
+}
+
+int epd_calibrate_spi_clock() {
+    int best = epd_spi_clocks[0];
+    epdif_set_clock_speed(best);
+    int64_t reference = epd_measure_refresh();
+    if (reference <= 0) {
+        ESP_LOGE(TAG, "no BUSY pulse at %d kHz, keep %d kHz", best / 1000, epdif_get_clock_speed() / 1000);
+        return epdif_get_clock_speed();
+    }
+    ESP_LOGI(TAG, "reference refresh %d ms at %d kHz", (int)(reference / 1000), best / 1000);
+
+    for (int i = 1; i < sizeof(epd_spi_clocks) / sizeof(epd_spi_clocks[0]); i++) {
+        bool stable = true;
+        epdif_set_clock_speed(epd_spi_clocks[i]);
+        for (int round = 0; round < EPD_CALIBRATE_ROUNDS && stable; round++) {
+            int64_t refresh = epd_measure_refresh();
+            stable = llabs(refresh - reference) <= reference / EPD_CALIBRATE_TOLERANCE;
+            ESP_LOGI(TAG, "%d kHz: refresh %d ms", epd_spi_clocks[i] / 1000, (int)(refresh / 1000));
+        }
+        if (!stable) {
+            break;
+        }
+        best = epd_spi_clocks[i];
+    }
+
+    epdif_set_clock_speed(best);
+    epdif_save_clock_speed();
+    epd_sleep();
+    ESP_LOGI(TAG, "SPI clock calibrated to %d kHz", best / 1000);
+    return best;
+}
@@ -12,12 +12,23 @@
 #define EPD_2IN9_LUT_UPDATE_FULL 0
 #define EPD_2IN9_LUT_UPDATE_PART 1
 
+// Waveform temperature bands (celsius)
+#define EPD_TEMPERATURE_DEFAULT 25
+#define EPD_TEMPERATURE_COLD    10  // below: slower, longer waveforms
+#define EPD_TEMPERATURE_WARM    28  // from here on: shortened waveforms
+
+/* ambient temperature used to pick the waveform on the next epd_init() */
+void epd_set_temperature(int celsius);
+int epd_get_temperature();
 void epd_init(int lut_update_mode);
 void epd_sleep();
 void epd_set_image_memory(const uint8_t* image_buffer, int x, int y, int width, int height);
 void epd_set_frame_memory(const uint8_t* frame_buffer);
 void epd_display_frame();
 
+/* find the fastest SPI clock with reproducible refresh timing, saved to NVS */
+int epd_calibrate_spi_clock();
+
 #endif /* _EPD2IN9_H_ */
 
 /* END OF FILE */
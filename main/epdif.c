@@ -5,11 +5,81 @@
 #include "driver/gpio.h"
 #include "driver/spi_master.h"
 #include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "nvs.h"
 
 #include <string.h>
 
+#define EPDIF_QUEUE_SIZE 8          // transactions in flight while running a script
+#define EPDIF_CLOCK_SPEED_HZ (40*1000*1000)
+#define EPDIF_BUSY_POLL_MS 10
+#define EPDIF_NVS_NAMESPACE "epdif"
+#define EPDIF_NVS_CLOCK_KEY "spi_hz"
+#define EPDIF_DC_COMMAND ((void*)0)
+#define EPDIF_DC_DATA    ((void*)1)
+
+static const char *TAG = "EPD-IF";
+
 static epdif_pin_config_t epd_pin_cfg;
 static spi_device_handle_t epd_spi;
+static spi_device_interface_config_t epd_devcfg;
+static epdif_stats_t epd_stats;
+
+#ifdef CONFIG_EPDIF_TRACE
+// command trace: one line per command with the data bytes that followed it
+static int trace_cmd = -1;
+static uint32_t trace_data_len;
+
+static void epdif_trace_flush() {
+    if (trace_cmd >= 0) {
+        ESP_LOGI(TAG, "cmd 0x%02X + %d bytes", trace_cmd, (int)trace_data_len);
+    }
+    trace_cmd = -1;
+    trace_data_len = 0;
+}
+
+static void epdif_trace(void *dc, const uint8_t *data, uint32_t len) {
+    if (dc == EPDIF_DC_COMMAND) {
+        epdif_trace_flush();
+        trace_cmd = data[0];
+    } else {
+        trace_data_len += len;
+    }
+}
+#else
+#define epdif_trace_flush()
+#define epdif_trace(dc, data, len)
+#endif
+
+static void epdif_account(void *dc, const uint8_t *data, uint32_t len) {
+    epd_stats.bytes += len;
+    epd_stats.transactions++;
+    epdif_trace(dc, data, len);
+}
+
+static void epdif_transmit(spi_transaction_t *t) {
+    int64_t start = esp_timer_get_time();
+    esp_err_t ret=spi_device_polling_transmit(epd_spi, t);  //Transmit!
+    ESP_ERROR_CHECK(ret);
+    epd_stats.spi_us += esp_timer_get_time() - start;
+}
+
+// stored clock speed from a previous calibration, or the default
+static int epdif_load_clock_speed() {
+    nvs_handle nvs;
+    uint32_t hz = 0;
+    if (nvs_open(EPDIF_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        nvs_get_u32(nvs, EPDIF_NVS_CLOCK_KEY, &hz);
+        nvs_close(nvs);
+    }
+    return hz ? hz : EPDIF_CLOCK_SPEED_HZ;
+}
+
+// set D/C line from transaction user field right before it goes out
+static void IRAM_ATTR epdif_spi_pre_transfer_callback(spi_transaction_t *t) {
+    gpio_set_level(epd_pin_cfg.dc_io_num, (int)(intptr_t)t->user);
+}
 
 void epdif_init(epdif_pin_config_t *pin_cfg, uint32_t width, uint32_t height) {
     memcpy(&epd_pin_cfg, pin_cfg, sizeof(epdif_pin_config_t));
@@ -31,12 +101,14 @@ void epdif_init(epdif_pin_config_t *pin_cfg, uint32_t width, uint32_t height) {
     };
 
     spi_device_interface_config_t devcfg={
-        .clock_speed_hz = 40*1000*1000,           //Clock out at 40 MHz
+        .clock_speed_hz = epdif_load_clock_speed(), //Clock out at 40 MHz unless calibrated
         .mode = 0,                                //SPI mode 0
         .spics_io_num = epd_pin_cfg.cs_io_num,
         .flags = SPI_DEVICE_HALFDUPLEX,
-        .queue_size = 1,
+        .queue_size = EPDIF_QUEUE_SIZE,
+        .pre_cb = epdif_spi_pre_transfer_callback,
     };
+    epd_devcfg = devcfg;
 
     //Initialize the SPI bus
     ret=spi_bus_initialize(HSPI_HOST, &buscfg, 1);
@@ -44,10 +116,54 @@ void epdif_init(epdif_pin_config_t *pin_cfg, uint32_t width, uint32_t height) {
     //Attach the LCD to the SPI bus
     ret=spi_bus_add_device(HSPI_HOST, &devcfg, &epd_spi);
     ESP_ERROR_CHECK(ret);
-    printf("SPI: display device added to spi bus\r\n");
+    printf("SPI: display device added to spi bus, %d kHz\r\n", devcfg.clock_speed_hz / 1000);
+}
+
+int epdif_get_clock_speed() {
+    return epd_devcfg.clock_speed_hz;
+}
+
+esp_err_t epdif_set_clock_speed(int clock_speed_hz) {
+    esp_err_t ret;
+    ret=spi_bus_remove_device(epd_spi);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    epd_devcfg.clock_speed_hz = clock_speed_hz;
+    return spi_bus_add_device(HSPI_HOST, &epd_devcfg, &epd_spi);
+}
+
+esp_err_t epdif_save_clock_speed() {
+    nvs_handle nvs;
+    esp_err_t ret = nvs_open(EPDIF_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    ret = nvs_set_u32(nvs, EPDIF_NVS_CLOCK_KEY, epd_devcfg.clock_speed_hz);
+    if (ret == ESP_OK) {
+        ret = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return ret;
+}
+
+void epdif_get_stats(epdif_stats_t *stats) {
+    memcpy(stats, &epd_stats, sizeof(epdif_stats_t));
+}
+
+void epdif_reset_stats() {
+    memset(&epd_stats, 0, sizeof(epdif_stats_t));
+}
+
+void epdif_log_stats() {
+    ESP_LOGI(TAG, "spi: %d bytes, %d transactions, %d ms; busy: %d ms; clock %d kHz",
+             (int)epd_stats.bytes, (int)epd_stats.transactions,
+             (int)(epd_stats.spi_us / 1000), (int)(epd_stats.busy_us / 1000),
+             epd_devcfg.clock_speed_hz / 1000);
 }
 
 void epdif_reset() {
+    epdif_trace_flush();
     gpio_set_level(epd_pin_cfg.rst_io_num, 0);
     epdif_delay_ms(200);
     gpio_set_level(epd_pin_cfg.rst_io_num, 1);
@@ -59,46 +175,102 @@ void epdif_delay_ms(uint32_t delaytime) {
 }
 
 void epdif_wait_until_idle() {
+    epdif_trace_flush();
+    int64_t start = esp_timer_get_time();
     while(gpio_get_level(epd_pin_cfg.busy_io_num) == 1) {      //LOW: idle, HIGH: busy
-        epdif_delay_ms(100);
+        epdif_delay_ms(EPDIF_BUSY_POLL_MS);
     }
+    int64_t busy_us = esp_timer_get_time() - start;
+    epd_stats.busy_us += busy_us;
+#ifdef CONFIG_EPDIF_TRACE
+    ESP_LOGI(TAG, "busy %d ms", (int)(busy_us / 1000));
+#endif
 }
 
 void epdif_send_command(uint8_t cmd) {
-    gpio_set_level(epd_pin_cfg.dc_io_num, 0);
-
-    esp_err_t ret;
     spi_transaction_t t;
     memset(&t, 0, sizeof(t));       //Zero out the transaction
     t.length=8;                 //Len is in bytes, transaction length is in bits.
     t.tx_data[0]=cmd;               //Data
     t.flags=SPI_TRANS_USE_TXDATA;
-    ret=spi_device_polling_transmit(epd_spi, &t);  //Transmit!
-    ESP_ERROR_CHECK(ret);
+    t.user=EPDIF_DC_COMMAND;
+    epdif_account(t.user, &cmd, 1);
+    epdif_transmit(&t);
 }
 
 void epdif_send_byte_data(uint8_t data) {
-    gpio_set_level(epd_pin_cfg.dc_io_num, 1);
-
-    esp_err_t ret;
     spi_transaction_t t;
     memset(&t, 0, sizeof(t));       //Zero out the transaction
     t.length=8;                 //Len is in bytes, transaction length is in bits.
     t.tx_data[0]=data;               //Data
     t.flags=SPI_TRANS_USE_TXDATA;
-    ret=spi_device_polling_transmit(epd_spi, &t);  //Transmit!
-    ESP_ERROR_CHECK(ret);
+    t.user=EPDIF_DC_DATA;
+    epdif_account(t.user, &data, 1);
+    epdif_transmit(&t);
 }
 
 void epdif_send_data(const uint8_t *data, uint32_t len) {
-    gpio_set_level(epd_pin_cfg.dc_io_num, 1);
-
-    esp_err_t ret;
     spi_transaction_t t;
     if (len==0) return;             //no need to send anything
     memset(&t, 0, sizeof(t));       //Zero out the transaction
     t.length=len*8;                 //Len is in bytes, transaction length is in bits.
     t.tx_buffer=data;               //Data
-    ret=spi_device_polling_transmit(epd_spi, &t);  //Transmit!
+    t.user=EPDIF_DC_DATA;
+    epdif_account(t.user, data, len);
+    epdif_transmit(&t);
+}
+
+// queue one transaction into the ring, reusing the oldest slot once the queue is full
+static void epdif_queue_trans(spi_transaction_t *ring, int *queued, int *next, void *dc, const uint8_t *data, uint32_t len) {
+    esp_err_t ret;
+    spi_transaction_t *t;
+    if (*queued == EPDIF_QUEUE_SIZE) {
+        ret=spi_device_get_trans_result(epd_spi, &t, portMAX_DELAY);
+        ESP_ERROR_CHECK(ret);
+        (*queued)--;
+    }
+    t = &ring[*next];
+    memset(t, 0, sizeof(*t));
+    t->length=len*8;
+    t->user=dc;
+    if (len <= 4) {
+        memcpy(t->tx_data, data, len);
+        t->flags=SPI_TRANS_USE_TXDATA;
+    } else {
+        t->tx_buffer=data;
+    }
+    epdif_account(dc, data, len);
+    ret=spi_device_queue_trans(epd_spi, t, portMAX_DELAY);
     ESP_ERROR_CHECK(ret);
+    (*queued)++;
+    *next = (*next + 1) % EPDIF_QUEUE_SIZE;
+}
+
+void epdif_send_script(const uint8_t *script, uint32_t len) {
+    spi_transaction_t ring[EPDIF_QUEUE_SIZE];
+    spi_transaction_t *t;
+    int queued = 0;
+    int next = 0;
+    uint32_t pos = 0;
+    int64_t start = esp_timer_get_time();
+
+    while (pos + 2 <= len) {
+        uint8_t nparams = script[pos + 1];
+        if (pos + 2 + nparams > len) {
+            ESP_LOGE(TAG, "truncated script at %d", (int)pos);
+            break;
+        }
+        epdif_queue_trans(ring, &queued, &next, EPDIF_DC_COMMAND, &script[pos], 1);
+        if (nparams) {
+            epdif_queue_trans(ring, &queued, &next, EPDIF_DC_DATA, &script[pos + 2], nparams);
+        }
+        pos += 2 + nparams;
+    }
+
+    // wait for the rest, ring must not go out of scope with transactions in flight
+    while (queued > 0) {
+        ESP_ERROR_CHECK(spi_device_get_trans_result(epd_spi, &t, portMAX_DELAY));
+        queued--;
+    }
+    epd_stats.spi_us += esp_timer_get_time() - start;
 }
\ No newline at end of file
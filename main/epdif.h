@@ -2,6 +2,7 @@
 #define _EPDIF_H_
 
 #include <stdint.h>
+#include "esp_err.h"
 
 typedef struct epdif_pin_config {
     int mosi_io_num;
@@ -13,6 +14,13 @@ typedef struct epdif_pin_config {
     int vcc_io_num;
 } epdif_pin_config_t;
 
+typedef struct epdif_stats {
+    uint32_t bytes;             // bytes sent, commands and data
+    uint32_t transactions;      // SPI transactions
+    int64_t spi_us;             // time spent sending
+    int64_t busy_us;            // time spent waiting for BUSY to clear
+} epdif_stats_t;
+
 void epdif_init(epdif_pin_config_t* pin_cfg, uint32_t width, uint32_t height);
 void epdif_reset();
 void epdif_delay_ms(uint32_t delaytime);
@@ -21,4 +29,21 @@ void epdif_send_command(uint8_t cmd);
 void epdif_send_byte_data(uint8_t data);
 void epdif_send_data(const uint8_t* data, uint32_t len);
 
+/*
+ * command script: a sequence of (cmd, nparams, params...) entries sent as
+ * queued transactions, D/C is switched in the pre-transaction callback.
+ * params longer than 4 bytes are sent by DMA straight out of the script,
+ * so such scripts must not live in flash (use the stack or DRAM_ATTR).
+ */
+void epdif_send_script(const uint8_t* script, uint32_t len);
+
+/* clock speed is loaded from NVS on init if it was calibrated and saved */
+int epdif_get_clock_speed();
+esp_err_t epdif_set_clock_speed(int clock_speed_hz);
+esp_err_t epdif_save_clock_speed();
+
+void epdif_get_stats(epdif_stats_t* stats);
+void epdif_reset_stats();
+void epdif_log_stats();
+
 #endif
@@ -2,10 +2,13 @@
 #include "epd2in9.h"
 #include "esp-ui.h"
 #include "ws_client.h"
+#include "json_scan.h"
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
+#include "freertos/timers.h"
+#include "freertos/semphr.h"
 #include "esp_heap_caps.h"
 #include "esp_spiffs.h"
 #include "esp_system.h"
@@ -17,7 +20,6 @@
 #include "lwip/err.h"
 #include "lwip/sys.h"
 #include "lwip/apps/sntp.h"
-#include "cJSON.h"
 
 #include <string.h>
 #include <time.h>
@@ -38,7 +40,31 @@ static void ui_task(void *pvParameter);
 static esp_err_t spiffs_init();
 
 static esp_err_t ws_handler(ws_event_t *event);
-static void pushbullet_mirror_msg(char *json);
+static void pushbullet_mirror_msg(const char *json, int len);
+
+// PushBullet sends a "nop" every 30s, reconnect when we miss two of them
+#define PUSHBULLET_NOP_TIMEOUT_MS   (65*1000)
+// WebSocket buffers: pushes are a few hundred bytes, some go up to 1KB
+#define WS_BUFFER_SIZE              (5*1024)
+#define WS_PUSH_SIZE                1024
+#define WS_DISPATCH_QUEUE_SIZE      2
+#define WS_POOL_BLOCK_SIZE          512
+#define WS_POOL_BLOCKS(len)         (((len) + WS_POOL_BLOCK_SIZE - 1) / WS_POOL_BLOCK_SIZE)
+static ws_client_handle_t s_ws_client;
+static ws_client_handle_t s_ws_relay;
+static SemaphoreHandle_t s_msg_lock;    // PushBullet and relay pushes are parsed in different tasks
+static TickType_t s_ws_last_msg;
+static uint32_t s_pb_nops;              // liveness messages seen from PushBullet
+static uint32_t s_pb_tickles;
+static uint32_t s_ws_too_big;           // messages over buffer_size, streamed in chunks and dropped
+static void pushbullet_watchdog(TimerHandle_t timer);
+
+typedef enum {
+    PB_MSG_OTHER,
+    PB_MSG_NOP,
+    PB_MSG_TICKLE,
+} pb_msg_type_t;
+static pb_msg_type_t pushbullet_classify(const char *msg, int len);
 
 void app_main() {
     s_event_group = xEventGroupCreate();
@@ -70,6 +96,9 @@ void app_main() {
         .vcc_io_num = 0,
     };
     epdif_init(&epd_pin_cfg, EPD_WIDTH, EPD_HEIGHT);
+#ifdef CONFIG_EPD_SPI_CALIBRATE
+    epd_calibrate_spi_clock();
+#endif
 
     // init spiffs
     spiffs_init();
@@ -82,15 +111,45 @@ void app_main() {
     xTaskCreate(&ui_task, "ui_task", 1024*5, NULL, tskIDLE_PRIORITY + 1, NULL);
 
     xEventGroupWaitBits(s_event_group, WIFI_CONNECTED_BIT, false, true, portMAX_DELAY);
+    // one task and one buffer pool for all WebSocket sources. The pool holds the working
+    // set: a message of up to buffer_size being read (and inflated) per source, and the
+    // pushes queued to the PushBullet handler plus the one it is on, trimmed to their size
+    int ws_sources = strlen(CONFIG_WS_RELAY_URI) > 0 ? 2 : 1;
+    ws_client_group_config_t group_cfg = {
+        .pool_block_size = WS_POOL_BLOCK_SIZE,
+        .pool_block_count = ws_sources * WS_POOL_BLOCKS(WS_BUFFER_SIZE)
+                            + (WS_DISPATCH_QUEUE_SIZE + 1) * WS_POOL_BLOCKS(WS_PUSH_SIZE),
+    };
+    ws_client_group_handle_t ws_group = ws_client_group_init(&group_cfg);
+    s_msg_lock = xSemaphoreCreateMutex();
     ws_client_config_t ws_cfg = {
         .uri = "wss://stream.pushbullet.com/websocket/"CONFIG_PUSHBULLET_TOKEN,
         .event_handle = ws_handler,
-        .out_buffer = calloc(1, 5*1024),
-        .out_buffer_size = 5*1024,
+        .buffer_size = WS_BUFFER_SIZE,
+        .stream_large_messages = true,
+        .permessage_deflate = true,
+        .dispatch_queue_size = WS_DISPATCH_QUEUE_SIZE,  // parse pushes off the network task
+        .group = ws_group,
     };
-    ws_client_handle_t ws_client = ws_client_init(&ws_cfg);
-    ret = ws_client_start(ws_client);
+    s_ws_client = ws_client_init(&ws_cfg);
+    s_ws_last_msg = xTaskGetTickCount();
+    ret = ws_client_start(s_ws_client);
     ESP_ERROR_CHECK(ret);
+
+    if (strlen(CONFIG_WS_RELAY_URI) > 0) {
+        ws_client_config_t relay_cfg = {
+            .uri = CONFIG_WS_RELAY_URI,
+            .event_handle = ws_handler,
+            .buffer_size = WS_BUFFER_SIZE,
+            .group = ws_group,
+        };
+        s_ws_relay = ws_client_init(&relay_cfg);
+        ret = ws_client_start(s_ws_relay);
+        ESP_ERROR_CHECK(ret);
+    }
+
+    TimerHandle_t watchdog = xTimerCreate("pb_watchdog", 5*1000 / portTICK_PERIOD_MS, pdTRUE, NULL, pushbullet_watchdog);
+    xTimerStart(watchdog, portMAX_DELAY);
 }
 
 static esp_err_t wifi_event_handler(void *ctx, system_event_t *event)
@@ -104,6 +163,13 @@ static esp_err_t wifi_event_handler(void *ctx, system_event_t *event)
                  ip4addr_ntoa(&event->event_info.got_ip.ip_info.ip));
         s_wifi_retry_num = 0;
         xEventGroupSetBits(s_event_group, WIFI_CONNECTED_BIT);
+        // don't wait out the ws reconnect backoff now that the network is back
+        if (s_ws_client) {
+            ws_client_wakeup(s_ws_client);
+        }
+        if (s_ws_relay) {
+            ws_client_wakeup(s_ws_relay);
+        }
         break;
     case SYSTEM_EVENT_STA_DISCONNECTED:
         {
@@ -194,17 +260,53 @@ static esp_err_t ws_handler(ws_event_t *event) {
             ESP_LOGE(TAG, "WS_EVENT_ERROR");
             break;
         case WS_EVENT_CONNECTED:
-            ESP_LOGI(TAG, "WS_EVENT_CONNECTED");
+            ESP_LOGI(TAG, "WS_EVENT_CONNECTED, PushBullet nops %d tickles %d", (int)s_pb_nops, (int)s_pb_tickles);
+            if (event->client == s_ws_client) {
+                s_ws_last_msg = xTaskGetTickCount();
+            }
+            ws_client_log_stats(event->client);
             break;
         case WS_EVENT_DISCONNECTED:
-            ESP_LOGW(TAG, "WS_EVENT_DISCONNECTED");
+            ESP_LOGW(TAG, "WS_EVENT_DISCONNECTED, close code %d %.*s", event->close_code, event->data_len, event->data ? (char *)event->data : "");
+#ifdef CONFIG_WS_CLIENT_TRACE
+            ws_client_dump_trace(event->client);
+#endif
+            break;
+        case WS_EVENT_DATA:
+            // a message too big for buffer_size (stream_large_messages) comes in chunks. It
+            // wouldn't fit the screen anyway: count it on its first chunk, let the rest go by
+            if (event->client == s_ws_client) {
+                s_ws_last_msg = xTaskGetTickCount();
+            }
+            if (event->payload_offset == 0 && event->ws_header && event->ws_header->opcode != 0) {
+                s_ws_too_big++;
+                ESP_LOGW(TAG, "message too big, dropped (frame of %d bytes, %d so far)", (int)event->payload_len, (int)s_ws_too_big);
+            }
             break;
         case WS_EVENT_DATA_FIN:
-            ESP_LOGI(TAG, "WS_EVENT_DATA_FIN");
-            //print_bytes(event->data, event->data_len);
-            ESP_LOGI(TAG, "TEXT LEN: %d", event->data_len);
-            ESP_LOGI(TAG, "TEXT: %.*s", event->data_len, event->data);
-            pushbullet_mirror_msg((char *)event->data);
+            // only PushBullet promises a nop every 30s
+            if (event->client == s_ws_client) {
+                s_ws_last_msg = xTaskGetTickCount();
+            }
+            // nop and tickle carry nothing to show, skip the log and the parse
+            switch (pushbullet_classify((char *)event->data, event->data_len)) {
+                case PB_MSG_NOP:
+                    if (event->client == s_ws_client) s_pb_nops++;
+                    return ESP_OK;
+                case PB_MSG_TICKLE:
+                    if (event->client == s_ws_client) s_pb_tickles++;
+                    return ESP_OK;
+                default:
+                    break;
+            }
+            ESP_LOGD(TAG, "WS_EVENT_DATA_FIN %d bytes: %.*s", event->data_len, event->data_len, event->data);
+            if (event->truncated) {
+                ESP_LOGW(TAG, "message truncated, not parsing it");
+                break;
+            }
+            xSemaphoreTake(s_msg_lock, portMAX_DELAY);
+            pushbullet_mirror_msg((char *)event->data, event->data_len);
+            xSemaphoreGive(s_msg_lock);
             break;
         default:
             break;
@@ -212,28 +314,54 @@ static esp_err_t ws_handler(ws_event_t *event) {
     return ESP_OK;
 }
 
-static void pushbullet_mirror_msg(char *json) {
-    cJSON *root = cJSON_Parse(json);
-    if (!root) return;
-    cJSON *root_type = cJSON_GetObjectItemCaseSensitive(root, "type");
-    if (!root_type || strncmp(root_type->valuestring, "push", 4) != 0) {cJSON_Delete(root); return;}
+static void pushbullet_watchdog(TimerHandle_t timer) {
+    TickType_t idle = xTaskGetTickCount() - s_ws_last_msg;
+    if (idle < PUSHBULLET_NOP_TIMEOUT_MS / portTICK_PERIOD_MS) return;
 
-    cJSON *push = cJSON_GetObjectItemCaseSensitive(root, "push");
-    if (!push) {cJSON_Delete(root); return;}
+    ESP_LOGW(TAG, "no message from PushBullet for %d ms (%d nops so far), reconnecting", (int)(idle * portTICK_PERIOD_MS), (int)s_pb_nops);
+    s_ws_last_msg = xTaskGetTickCount();
+    ws_client_reconnect(s_ws_client);
+}
+
+static bool pushbullet_expect(const char **p, const char *end, const char *lit) {
+    while (*p < end && (**p == ' ' || **p == '\t' || **p == '\r' || **p == '\n')) (*p)++;
+    int len = strlen(lit);
+    if (end - *p < len || memcmp(*p, lit, len) != 0) return false;
+    *p += len;
+    return true;
+}
 
-    cJSON *push_type = cJSON_GetObjectItemCaseSensitive(push, "type");
-    if (push_type && strncmp(push_type->valuestring ,"dismissal", 9) == 0) {
+// PushBullet puts "type" first: {"type": "nop"}, {"type": "tickle", "subtype": "push"}.
+// Anything else, including a reordered nop, is left to the full parse.
+static pb_msg_type_t pushbullet_classify(const char *msg, int len) {
+    const char *p = msg, *end = msg + len;
+    if (!pushbullet_expect(&p, end, "{") || !pushbullet_expect(&p, end, "\"type\"") ||
+        !pushbullet_expect(&p, end, ":") || !pushbullet_expect(&p, end, "\"")) {
+        return PB_MSG_OTHER;
+    }
+    if (end - p >= 4 && memcmp(p, "nop\"", 4) == 0) return PB_MSG_NOP;
+    if (end - p >= 7 && memcmp(p, "tickle\"", 7) == 0) return PB_MSG_TICKLE;
+    return PB_MSG_OTHER;
+}
+
+static void pushbullet_mirror_msg(const char *json, int len) {
+    enum { TYPE, PUSH_TYPE, PUSH_BODY };
+    json_scan_field_t fields[] = {
+        [TYPE] = { .path = "type" },
+        [PUSH_TYPE] = { .path = "push.type" },
+        [PUSH_BODY] = { .path = "push.body" },
+    };
+    if (json_scan(json, len, fields, sizeof(fields) / sizeof(fields[0])) < 0) return;
+    if (!json_scan_equals(&fields[TYPE], "push")) return;
+
+    if (json_scan_equals(&fields[PUSH_TYPE], "dismissal")) {
         ui_data.message[0] = 0;
         xEventGroupSetBits(s_event_group, PUSHBULLET_MSG_BIT);
-        cJSON_Delete(root); return;
+        return;
     }
-    if (!push_type || strncmp(push_type->valuestring ,"mirror", 6) != 0) {cJSON_Delete(root); return;}
-
-    cJSON *body = cJSON_GetObjectItemCaseSensitive(push, "body");
-    if (!body || body->type != cJSON_String) {cJSON_Delete(root); return;}
+    if (!json_scan_equals(&fields[PUSH_TYPE], "mirror")) return;
+    if (!fields[PUSH_BODY].is_string) return;
 
-    //printf(body->valuestring);
-    strncpy(ui_data.message, body->valuestring, 128*3);
+    json_unescape(fields[PUSH_BODY].value, fields[PUSH_BODY].len, ui_data.message, sizeof(ui_data.message));
     xEventGroupSetBits(s_event_group, PUSHBULLET_MSG_BIT);
-    cJSON_Delete(root); return;
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include "esp-ui.h"
 #include "epdpaint.h"
 #include "epd2in9.h"
+#include "epdif.h"
 #include "epdfont.h"
 
 #include "esp_log.h"
@@ -13,8 +14,18 @@
 #define ROTATE ROTATE_270
 static const char *TAG = "ESP-UI";
 
+// partial refresh ghosting budget, the time window is tracked per character cell
+#define TIME_CHARS              5       // "HH:MM"
+#define GHOST_TOGGLES_PER_PIXEL 4       // average partial toggles per pixel before a full refresh
+
 ui_data_t ui_data;
 static epd_font_t hzk;
+static esp_painter_handle_t time_painter;   // time window as currently shown on the panel
+static int ghost_toggles[TIME_CHARS];
+
+static esp_painter_handle_t esp_ui_paint_time_window(epd_font_t *time_fnt);
+static void esp_ui_update_temperature();
+static int esp_ui_count_toggles(esp_painter_handle_t prev, esp_painter_handle_t next, int *cells, int cell_rows);
 
 int esp_ui_init() {
     // init hzk chinese gb2312 font
@@ -33,6 +44,7 @@ int esp_ui_init() {
 void esp_ui_full_paint() {
     ui_data.refresh_counter++;
     // init display
+    esp_ui_update_temperature();
     epd_init(EPD_2IN9_LUT_UPDATE_FULL);
 
     // create painter
@@ -64,30 +76,93 @@ void esp_ui_full_paint() {
     epd_display_frame();
     epd_set_frame_memory(painter->buffer);
     epd_sleep();
+    epdif_log_stats();
+    epdif_reset_stats();
 
     epdpaint_destroy(painter);
 
+    // full refresh clears ghosting, keep the painted time as baseline for partial refresh
+    memset(ghost_toggles, 0, sizeof(ghost_toggles));
+    if (time_painter) {
+        epdpaint_destroy(time_painter);
+    }
+    time_painter = esp_ui_paint_time_window(&epd_font_asc_16);
+
     return;
 }
 
 // partial display format: 23:23
 void esp_ui_paint_time() {
+    epd_font_t *time_fnt = &epd_font_asc_16;
+
+    // create painter
+    esp_painter_handle_t painter = esp_ui_paint_time_window(time_fnt);
+    if (!painter) {
+        ESP_LOGE(TAG, "no memory for painter");
+        return;
+    }
+
     // check refresh mode
-    ESP_LOGI(TAG, "refresh_counter(%d)", ui_data.refresh_counter);
-    if (ui_data.refresh_counter % 10 == 0) {
+    if (!time_painter) {
+        epdpaint_destroy(painter);
         return esp_ui_full_paint();
     }
+    int toggles[TIME_CHARS] = { 0 };
+    int total = esp_ui_count_toggles(time_painter, painter, toggles, time_fnt->width);
+    if (total == 0) {
+        epdpaint_destroy(painter);
+        return;
+    }
+    int budget = GHOST_TOGGLES_PER_PIXEL * time_fnt->width * time_fnt->height;
+    for (int i = 0; i < TIME_CHARS; i++) {
+        ghost_toggles[i] += toggles[i];
+        if (ghost_toggles[i] > budget) {
+            ESP_LOGI(TAG, "ghosting budget exceeded at char %d (%d > %d)", i, ghost_toggles[i], budget);
+            epdpaint_destroy(painter);
+            return esp_ui_full_paint();
+        }
+    }
+    ESP_LOGI(TAG, "refresh_counter(%d), toggled pixels(%d)", ui_data.refresh_counter, total);
     ui_data.refresh_counter++;
+    esp_ui_update_temperature();
     epd_init(EPD_2IN9_LUT_UPDATE_PART);
 
-    epd_font_t *time_fnt = &epd_font_asc_16;
+    epd_set_image_memory(painter->buffer, painter->abs_x, painter->abs_y, painter->abs_width, painter->abs_height);
+    epd_display_frame();
+    epd_sleep();
+    epdif_log_stats();
+    epdif_reset_stats();
 
-    // create painter
-    esp_painter_handle_t painter = epdpaint_init(ROTATE, EPD_HEIGHT-5*time_fnt->width, EPD_WIDTH-time_fnt->height, (time_fnt->width*5), time_fnt->height);
-    if (!painter) {
-        ESP_LOGE(TAG, "no memory for painter");
+    epdpaint_destroy(time_painter);
+    time_painter = painter;
+}
+
+#ifdef CONFIG_EPD_TEMPERATURE_SENSOR
+// internal sensor, no header for it in this IDF. Fahrenheit, 128 while it isn't powered
+uint8_t temprature_sens_read();
+#endif
+
+// the waveform for the next epd_init() follows the ambient temperature
+static void esp_ui_update_temperature() {
+#ifdef CONFIG_EPD_TEMPERATURE_SENSOR
+    uint8_t fahrenheit = temprature_sens_read();
+    if (fahrenheit == 128) {
         return;
     }
+    int celsius = (fahrenheit - 32) * 5 / 9 - CONFIG_EPD_TEMPERATURE_OFFSET;
+    if (celsius != epd_get_temperature()) {
+        ESP_LOGI(TAG, "temperature %d C", celsius);
+        epd_set_temperature(celsius);
+    }
+#endif
+}
+
+// render current time into a painter covering the partial refresh window
+static esp_painter_handle_t esp_ui_paint_time_window(epd_font_t *time_fnt) {
+    esp_painter_handle_t painter = epdpaint_init(ROTATE, EPD_HEIGHT-TIME_CHARS*time_fnt->width, EPD_WIDTH-time_fnt->height, (time_fnt->width*TIME_CHARS), time_fnt->height);
+    if (!painter) {
+        return 0;
+    }
 
     // start paint
     epdpaint_clear(painter, WHITE);
@@ -97,17 +172,29 @@ void esp_ui_paint_time() {
     time(&now);
     struct tm timeinfo = { 0 };
     localtime_r(&now, &timeinfo);
-    char strftime_buf[6];
-    strftime(strftime_buf, 6, "%H:%M", &timeinfo);
+    char strftime_buf[TIME_CHARS+1];
+    strftime(strftime_buf, sizeof(strftime_buf), "%H:%M", &timeinfo);
     epdpaint_draw_utf8_string(painter, 0, 0,
-                              5*time_fnt->width,
+                              TIME_CHARS*time_fnt->width,
                               time_fnt->height,
                               strftime_buf,
                               time_fnt, 0, BLACK);
+    return painter;
+}
 
-    epd_set_image_memory(painter->buffer, painter->abs_x, painter->abs_y, painter->abs_width, painter->abs_height);
-    epd_display_frame();
-    epd_sleep();
-
-    epdpaint_destroy(painter);
-}
\ No newline at end of file
+// count pixels that differ between two same sized painters, per cell of cell_rows buffer rows
+static int esp_ui_count_toggles(esp_painter_handle_t prev, esp_painter_handle_t next, int *cells, int cell_rows) {
+    int row_bytes = next->abs_width / 8;
+    int total = 0;
+    for (int y = 0; y < next->abs_height; y++) {
+        int cell = y / cell_rows;
+        for (int x = 0; x < row_bytes; x++) {
+            int n = __builtin_popcount(prev->buffer[y * row_bytes + x] ^ next->buffer[y * row_bytes + x]);
+            if (cell < TIME_CHARS) {
+                cells[cell] += n;
+            }
+            total += n;
+        }
+    }
+    return total;
+}
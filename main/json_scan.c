@@ -0,0 +1,263 @@
+#include "json_scan.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define JSON_SCAN_MAX_DEPTH 16
+
+typedef struct
+{
+    const char *p;
+    const char *end;
+    json_scan_field_t *fields;
+    int count;
+    int found;
+    int depth;
+    const char *keys[JSON_SCAN_MAX_DEPTH];  /* NULL for array elements */
+    int key_lens[JSON_SCAN_MAX_DEPTH];
+} json_scanner_t;
+
+static int scan_value(json_scanner_t *s);
+
+static void skip_ws(json_scanner_t *s)
+{
+    while (s->p < s->end && (*s->p == ' ' || *s->p == '\t' || *s->p == '\n' || *s->p == '\r')) s->p++;
+}
+
+/* s->p on the opening quote, leaves it after the closing one */
+static int scan_string(json_scanner_t *s, const char **str, int *len)
+{
+    const char *start = ++s->p;
+    while (s->p < s->end && *s->p != '"') {
+        if (*s->p == '\\') s->p++;
+        s->p++;
+    }
+    if (s->p >= s->end) return -1;
+    *str = start;
+    *len = s->p - start;
+    s->p++;
+    return 0;
+}
+
+static bool path_matches(json_scanner_t *s, const char *path)
+{
+    if (s->depth == 0) return false;
+    for (int i = 0; i < s->depth; i++) {
+        int len = s->key_lens[i];
+        if (!s->keys[i] || strncmp(path, s->keys[i], len) != 0) return false;
+        path += len;
+        if (*path != (i == s->depth - 1 ? '\0' : '.')) return false;
+        path++;
+    }
+    return true;
+}
+
+static void match(json_scanner_t *s, const char *value, int len, bool is_string)
+{
+    for (int i = 0; i < s->count; i++) {
+        json_scan_field_t *field = &s->fields[i];
+        if (field->value || !path_matches(s, field->path)) continue;
+        field->value = value;
+        field->len = len;
+        field->is_string = is_string;
+        s->found++;
+    }
+}
+
+/* members or elements until the closing bracket; 1 once every field is found */
+static int scan_container(json_scanner_t *s, char close)
+{
+    if (s->depth >= JSON_SCAN_MAX_DEPTH) return -1;
+    int depth = s->depth++;
+    s->p++;
+    skip_ws(s);
+    if (s->p < s->end && *s->p == close) {
+        s->p++;
+        s->depth = depth;
+        return 0;
+    }
+
+    for (;;) {
+        skip_ws(s);
+        if (close == '}') {
+            if (s->p >= s->end || *s->p != '"') return -1;
+            if (scan_string(s, &s->keys[depth], &s->key_lens[depth]) < 0) return -1;
+            skip_ws(s);
+            if (s->p >= s->end || *s->p != ':') return -1;
+            s->p++;
+        } else {
+            s->keys[depth] = NULL;
+        }
+
+        int ret = scan_value(s);
+        if (ret != 0) return ret;
+
+        skip_ws(s);
+        if (s->p >= s->end) return -1;
+        if (*s->p == ',') {
+            s->p++;
+            continue;
+        }
+        if (*s->p != close) return -1;
+        s->p++;
+        s->depth = depth;
+        return 0;
+    }
+}
+
+static int scan_value(json_scanner_t *s)
+{
+    skip_ws(s);
+    if (s->p >= s->end) return -1;
+
+    const char *start = s->p;
+    int ret = 0;
+    switch (*s->p) {
+        case '"': {
+            const char *str;
+            int len;
+            if (scan_string(s, &str, &len) < 0) return -1;
+            match(s, str, len, true);
+            return s->found == s->count;
+        }
+        case '{':
+            ret = scan_container(s, '}');
+            break;
+        case '[':
+            ret = scan_container(s, ']');
+            break;
+        default:
+            /* number, true, false or null, not checked any further */
+            while (s->p < s->end && (*s->p == '-' || *s->p == '+' || *s->p == '.' ||
+                   (*s->p >= '0' && *s->p <= '9') || (*s->p >= 'a' && *s->p <= 'z') || *s->p == 'E')) {
+                s->p++;
+            }
+            if (s->p == start) return -1;
+            break;
+    }
+    if (ret != 0) return ret;
+
+    match(s, start, s->p - start, false);
+    return s->found == s->count;
+}
+
+int json_scan(const char *json, int len, json_scan_field_t *fields, int count)
+{
+    json_scanner_t s = {
+        .p = json,
+        .end = json + len,
+        .fields = fields,
+        .count = count,
+    };
+    for (int i = 0; i < count; i++) {
+        fields[i].value = NULL;
+        fields[i].len = 0;
+        fields[i].is_string = false;
+    }
+    return scan_value(&s) < 0 ? -1 : 0;
+}
+
+bool json_scan_equals(const json_scan_field_t *field, const char *str)
+{
+    return field->value && field->is_string && (int)strlen(str) == field->len &&
+           memcmp(field->value, str, field->len) == 0;
+}
+
+static int hex4(const char *p, uint32_t *out)
+{
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = p[i];
+        v <<= 4;
+        if (c >= '0' && c <= '9') v |= c - '0';
+        else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+        else return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+static int utf8_encode(uint32_t cp, char *out)
+{
+    if (cp < 0x80) {
+        out[0] = cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = 0xC0 | (cp >> 6);
+        out[1] = 0x80 | (cp & 0x3F);
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = 0xE0 | (cp >> 12);
+        out[1] = 0x80 | ((cp >> 6) & 0x3F);
+        out[2] = 0x80 | (cp & 0x3F);
+        return 3;
+    }
+    out[0] = 0xF0 | (cp >> 18);
+    out[1] = 0x80 | ((cp >> 12) & 0x3F);
+    out[2] = 0x80 | ((cp >> 6) & 0x3F);
+    out[3] = 0x80 | (cp & 0x3F);
+    return 4;
+}
+
+int json_unescape(const char *src, int len, char *dst, int dst_size)
+{
+    const char *end = src + len;
+    int out = 0;
+    if (dst_size <= 0) return 0;
+
+    while (src < end) {
+        char seq[4];
+        int n;
+        int used;
+        unsigned char c = *src;
+
+        if (c != '\\') {
+            /* copy a whole UTF-8 sequence so a cut never splits one */
+            n = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+            if (n > end - src) n = end - src;
+            if (out + n > dst_size - 1) break;
+            memmove(dst + out, src, n);
+            out += n;
+            src += n;
+            continue;
+        }
+
+        if (end - src < 2) break;
+        used = 2;
+        n = 1;
+        switch (src[1]) {
+            case 'b': seq[0] = '\b'; break;
+            case 'f': seq[0] = '\f'; break;
+            case 'n': seq[0] = '\n'; break;
+            case 'r': seq[0] = '\r'; break;
+            case 't': seq[0] = '\t'; break;
+            case 'u': {
+                uint32_t cp, lo;
+                if (end - src < 6 || hex4(src + 2, &cp) < 0) {
+                    seq[0] = 'u';
+                    break;
+                }
+                used = 6;
+                if (cp >= 0xD800 && cp <= 0xDBFF && end - src >= 12 && src[6] == '\\' && src[7] == 'u' &&
+                    hex4(src + 8, &lo) == 0 && lo >= 0xDC00 && lo <= 0xDFFF) {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                    used = 12;
+                } else if (cp >= 0xD800 && cp <= 0xDFFF) {
+                    cp = 0xFFFD;    // lone surrogate
+                }
+                n = utf8_encode(cp, seq);
+                break;
+            }
+            default: seq[0] = src[1]; break;   // \" \\ \/
+        }
+        if (out + n > dst_size - 1) break;
+        memcpy(dst + out, seq, n);
+        out += n;
+        src += used;
+    }
+    dst[out] = '\0';
+    return out;
+}
@@ -0,0 +1,32 @@
+#ifndef _JSON_SCAN_H_
+#define _JSON_SCAN_H_
+
+#include <stdbool.h>
+
+/* one value to pick out of a JSON document */
+typedef struct json_scan_field
+{
+    const char *path;       /* keys from the root, dot separated: "push.body" */
+    const char *value;      /* set when found, points into the document. Strings without quotes, still escaped */
+    int len;
+    bool is_string;
+} json_scan_field_t;
+
+/*
+ * Single pass over the document, no allocation: fills in the fields whose path is found
+ * and stops as soon as all of them are. Values inside arrays are never matched.
+ * Returns 0, or -1 if the document is malformed before that point.
+ */
+int json_scan(const char *json, int len, json_scan_field_t *fields, int count);
+
+/* field is a string equal to str */
+bool json_scan_equals(const json_scan_field_t *field, const char *str);
+
+/*
+ * Unescape a string value into dst, which may be where the value is (in place). Cut at
+ * dst_size - 1 bytes without splitting a UTF-8 sequence, NUL terminated. A bad \u escape
+ * is kept as plain text. Returns the unescaped length.
+ */
+int json_unescape(const char *src, int len, char *dst, int dst_size);
+
+#endif
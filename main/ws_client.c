@@ -1,38 +1,121 @@
+#include "sdkconfig.h"
+#ifdef CONFIG_WS_CLIENT_LOG_LEVEL
+#define LOG_LOCAL_LEVEL CONFIG_WS_CLIENT_LOG_LEVEL
+#endif
 #include "ws_client.h"
+#include "ws_pool.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
 #include <sys/random.h>
-#include <arpa/inet.h>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
 #include "mbedtls/base64.h"
 #include "mbedtls/sha1.h"
+#include "rom/miniz.h"
+#include "lwip/sockets.h"
 
 #include "esp_transport.h"
-#include "esp_transport_tcp.h"
-#ifdef WS_CLIENT_ENABLE_WSS
-#include "esp_transport_ssl.h"
-#endif
+#include "ws_transport_ssl.h"
 
 /* using uri parser */
 #include "http_parser.h"
 
+#define WS_CTRL_PAYLOAD_MAX         125
+#define WS_MAX_HEADER_LEN           14      /* 2 bytes + 8 bytes extended length + 4 bytes mask */
+#define WS_DEFLATE_WINDOW_BITS      10      /* 1KB window, zlib can't go below 9 */
+#define WS_GROUP_MAX_CLIENTS        4
+#define WS_GROUP_POOL_BLOCKS        20
+#define WS_GROUP_POLL_MS            1000    /* longest select(), picks up started clients and wakeups */
+#define WS_GROUP_DEFER_MS           20      /* retry of a client waiting for pool blocks, the pool can't be selected on */
+
+/* frame parser states, each one reads straight into its destination */
+typedef enum {
+    WS_PARSE_HEADER = 0,        /* 2 bytes minimal header */
+    WS_PARSE_EXT_LEN,           /* 2 or 8 bytes extended payload length */
+    WS_PARSE_MASK,              /* 4 bytes masking key, servers should not send one */
+    WS_PARSE_PAYLOAD,
+    WS_PARSE_WAIT_BUFF,         /* group task: payload waits for pool blocks or dispatch queue room, retried after select() */
+} ws_parse_state_t;
+
+typedef struct ws_parser
+{
+    ws_parse_state_t state;
+    int need;                   /* header states: bytes needed to complete the state */
+    int got;                    /* header states: bytes received, payload: bytes stored at payload */
+    uint8_t mask[4];
+    uint64_t payload_len;       /* payload length announced in the header */
+    uint64_t payload_left;      /* payload bytes still to read */
+    uint64_t payload_offset;    /* frame offset of payload[0], moves on as chunks are streamed out */
+    uint8_t *payload;           /* where the payload goes */
+    int keep_len;               /* payload bytes that fit there, the rest is drained */
+    bool streaming;             /* payload is handed out in chunks of up to rcv_buff_len - 1 bytes */
+} ws_parser_t;
+
+/* permessage-deflate receive side, raw deflate stream of the whole connection */
+typedef struct ws_inflate
+{
+    tinfl_decompressor decomp;
+    uint8_t *dict;              /* LZ77 window, tinfl writes its output here as a ring */
+    int dict_size;              /* 1 << window bits, the server promised not to look further back */
+    int dict_ofs;
+    bool no_context_takeover;   /* server starts every message with an empty window */
+} ws_inflate_t;
+
 typedef struct ws_data
 {
     ws_header_t ws_header;
-    uint8_t *rcv_buff;
+    ws_parser_t parser;
+    uint8_t *rcv_buff;          /* run of pool blocks, messages are assembled here in place, fragment after fragment.
+                                   NULL in a group whose pool was empty when the last one went to the dispatch task */
     int rcv_buff_len;
-    uint8_t *out_buff;
-    int out_buff_len;
-    int out_buff_cur;
+    ws_pool_handle_t pool;
+    int buff_limit;             /* largest run a message may take, buffer_size */
+    int64_t buff_wait_until_ms; /* group task: give up waiting for pool blocks or queue room then, 0 if not waiting */
+    int msg_len;                /* bytes of the current message received so far */
+    uint8_t msg_opcode;         /* TEXT or BINARY of the message in progress, 0 between messages */
+    bool msg_truncated;         /* frames of the current message didn't fit and were cut short */
+    bool msg_streaming;         /* current message is too big to assemble, its frames are streamed */
+    bool stream_large_messages;
+    uint8_t ctrl_buff[WS_CTRL_PAYLOAD_MAX];  /* control frame payload, may arrive between fragments */
+    uint8_t *pending;           /* frame data that came in behind the upgrade response, in rcv_buff */
+    int pending_len;
+    ws_inflate_t *inflate;      /* set when permessage-deflate is offered */
+    bool deflate;               /* permessage-deflate negotiated on this connection */
+    bool msg_compressed;        /* current message has RSV1 set */
+    bool close_sent;            /* we sent CLOSE, the server's CLOSE is the answer */
+    int fail_code;              /* status code of our CLOSE when the parser fails, 0 for WS_CLOSE_PROTOCOL_ERROR */
+    bool closed;                /* server sent CLOSE, the connection is done */
+    int close_code;             /* status code of the server's CLOSE */
+    uint8_t close_reason[WS_CTRL_PAYLOAD_MAX - 2];
+    int close_reason_len;
 } ws_data_t;
 
+/* what the upgrade response told us, collected by the http_parser callbacks */
+typedef struct {
+    const char *field;          /* header being parsed, points into rcv_buff */
+    size_t field_len;
+    const char *value;
+    size_t value_len;
+    bool in_value;
+    bool headers_complete;
+    bool upgrade_websocket;     /* Upgrade: websocket */
+    bool connection_upgrade;    /* Connection: Upgrade */
+    const char *accept;         /* Sec-WebSocket-Accept */
+    size_t accept_len;
+    const char *extensions;     /* Sec-WebSocket-Extensions */
+    size_t extensions_len;
+} ws_upgrade_t;
+
 typedef struct {
     char *host;
     char *path;
@@ -40,10 +123,63 @@ typedef struct {
     int port;
     bool auto_reconnect;
     int network_timeout_ms;
+    int ping_interval_ms;
+    int pong_timeout_ms;
     esp_transport_list_handle_t transport_list;
     esp_transport_handle_t transport;
 } ws_connection_info_t;
 
+/* an event on its way to the dispatch task, owns buff if the event data is in it */
+typedef struct {
+    ws_event_t event;
+    ws_header_t ws_header;
+    uint8_t *buff;              /* run of pool blocks to give back once handled */
+    int buff_len;
+    uint8_t close_reason[WS_CTRL_PAYLOAD_MAX - 2];  /* DISCONNECTED data, ws_data's copy is reused */
+    bool stop;                  /* ends the dispatch task */
+} ws_dispatch_msg_t;
+
+/* optional dispatch task: the ws task hands full receive buffers over and carries on with new ones */
+typedef struct {
+    QueueHandle_t queue;        /* ws_dispatch_msg_t for the dispatch task */
+    bool task_running;
+} ws_dispatch_t;
+
+#ifdef CONFIG_WS_CLIENT_TRACE
+typedef enum {
+    WS_TRACE_FRAME = 0,         /* b0, b1: first two header bytes, arg: payload length */
+    WS_TRACE_CHUNK,             /* b0: opcode, arg: bytes of a streamed message handed out */
+    WS_TRACE_MESSAGE,           /* b0: opcode, b1: truncated, arg: message length */
+    WS_TRACE_PING,              /* arg: payload length */
+    WS_TRACE_PONG,              /* arg: ms since our PING */
+    WS_TRACE_CLOSE,             /* b0: sent by us, arg: status code */
+    WS_TRACE_CONNECTED,         /* arg: attempts it took */
+    WS_TRACE_DISCONNECTED,      /* arg: close code */
+} ws_trace_type_t;
+
+typedef struct {
+    uint32_t time_us;
+    uint8_t type;
+    uint8_t b0;
+    uint8_t b1;
+    uint32_t arg;
+} ws_trace_entry_t;
+#endif
+
+/*
+ * Outbound queue: senders build masked frames back to back in fill, the ws task swaps fill
+ * and drain and writes everything queued with one transport write. Only the ws task
+ * touches the transport, so sending can't race receiving.
+ */
+typedef struct {
+    uint8_t *fill;
+    int fill_len;
+    uint8_t *drain;
+    int size;                   /* of each buffer, bounds what can be queued */
+    SemaphoreHandle_t lock;
+    SemaphoreHandle_t drained;  /* given whenever the ws task emptied fill */
+} ws_send_queue_t;
+
 typedef enum {
     WS_STATE_ERROR = -1,
     WS_STATE_UNKNOWN = 0,
@@ -52,26 +188,73 @@ typedef enum {
     WS_STATE_WAIT_TIMEOUT,
 } ws_client_state_t;
 
+/* liveness of the current connection */
+typedef struct {
+    int64_t last_rx_ms;         /* last time anything arrived from the server */
+    bool ping_pending;          /* PING sent, waiting for the server to answer */
+    int64_t ping_sent_ms;
+} ws_keepalive_t;
+
+/* several clients serviced by one task, waiting in select() on all their sockets */
+typedef struct ws_client_group {
+    ws_client_handle_t clients[WS_GROUP_MAX_CLIENTS];
+    int client_count;
+    ws_pool_handle_t pool;      /* receive buffers of all the clients */
+    esp_transport_handle_t wake;    /* never connected, owns the wake socket all the clients share */
+    SemaphoreHandle_t lock;     /* clients[], held by the group task while it steps them */
+    EventGroupHandle_t status_bits;
+    bool run;
+    bool task_running;
+    TaskHandle_t task;
+} ws_client_group_t;
+
 typedef struct ws_client {
     ws_connection_info_t connection_info;
     ws_data_t  ws_data;
+    ws_keepalive_t keepalive;
     ws_client_state_t state;
+    ws_client_stats_t stats;
+    ws_dispatch_t *dispatch;    /* NULL: events are handled in the ws task */
+    ws_send_queue_t send_queue;
+    TaskHandle_t task;          /* ws task, when not in a group */
+    int64_t disconnected_us;    /* when the last connection was lost, 0 if never connected */
     void *user_context;
     ws_event_t event;
     ws_event_callback_t event_handle;
     int task_stack;
     int task_prio;
     bool run;
+    bool reconnect;             /* drop the connection and reconnect without waiting */
+    SemaphoreHandle_t lock;     /* reconnect_attempts and WAKEUP_BIT, ws_client_wakeup() comes from other tasks */
+    int reconnect_attempts;     /* failed attempts since the last connection, drives the backoff */
+    bool reconnect_waiting;     /* reconnect_at_ms is set for the current wait */
+    int64_t reconnect_at_ms;
+    int64_t finish_until_ms;    /* stopped, waiting for the server's CLOSE until then */
+    ws_client_group_handle_t group;     /* NULL: the client has a task and a pool of its own */
     EventGroupHandle_t status_bits;
+#ifdef CONFIG_WS_CLIENT_TRACE
+    ws_trace_entry_t trace[CONFIG_WS_CLIENT_TRACE_ENTRIES];
+    uint32_t trace_head;        /* entries ever recorded, the ring holds the last ones */
+#endif
 } ws_client_t;
 const static int STOPPED_BIT = BIT0;
+const static int WAKEUP_BIT = BIT1;     /* cut the reconnect wait short */
+const static int DISPATCH_STOPPED_BIT = BIT2;
 static const char *TAG = "WS_CLIENT";
 
 #define WS_TASK_PRIORITY            5
 #define WS_TASK_STACK               (4*1024)
 #define WS_NETWORK_TIMEOUT_MS       (10*1000)
 #define WS_RECONNECT_TIMEOUT_MS     (10*1000)
+#define WS_RECONNECT_MIN_MS         500
+#define WS_RECONNECT_MAX_MS         (60*1000)
+#define WS_PING_INTERVAL_MS         (10*1000)
+#define WS_PONG_TIMEOUT_MS          (5*1000)
 #define WS_BUFFER_SIZE_BYTE         5*1024
+#define WS_TX_BUFFER_SIZE_BYTE      1024
+#define WS_POOL_BLOCK_SIZE          512
+#define WS_HANDSHAKE_BUFFER_SIZE    2048
+#define WS_CLOSE_TIMEOUT_MS         1000    /* ws_client_stop() waits this long for the server's CLOSE */
 #define WS_DEFAULT_PORT             80
 #define WSS_DEFAULT_PORT            443
 
@@ -80,14 +263,69 @@ static const char *TAG = "WS_CLIENT";
         action;                                                                               \
         }
 
+#ifdef CONFIG_WS_CLIENT_TRACE
+// binary trace ring, formatting is left to ws_client_dump_trace()
+static void ws_trace(ws_client_handle_t client, ws_trace_type_t type, uint8_t b0, uint8_t b1, uint32_t arg)
+{
+    ws_trace_entry_t *entry = &client->trace[client->trace_head++ % CONFIG_WS_CLIENT_TRACE_ENTRIES];
+    entry->time_us = (uint32_t)esp_timer_get_time();
+    entry->type = type;
+    entry->b0 = b0;
+    entry->b1 = b1;
+    entry->arg = arg;
+}
+#else
+#define ws_trace(client, type, b0, b1, arg) do { (void)(arg); } while (0)
+#endif
+
 static char *create_string(const char *ptr, int len);
 static esp_err_t ws_abort_connection(ws_client_handle_t client);
 static esp_err_t ws_dispatch_event(ws_client_handle_t client);
+static esp_err_t ws_dispatch_buffer(ws_client_handle_t client);
+static esp_err_t ws_dispatch_wait(ws_client_handle_t client);
+static esp_err_t ws_dispatch_init(ws_client_handle_t client, int queue_size);
+static esp_err_t ws_buff_reserve(ws_client_handle_t client, int len, bool wait);
+static void ws_buff_shrink(ws_client_handle_t client);
+static void ws_dispatch_task(void *pv);
 static esp_err_t ws_connect(ws_client_handle_t client);
-static esp_err_t ws_process_receive_frame(ws_client_handle_t client);
-static char *get_http_header(const char *buffer, const char *key);
-static char *trimwhitespace(const char *str);
+static esp_err_t ws_process_receive(ws_client_handle_t client, int timeout_ms);
+static int ws_read(ws_client_handle_t client, char *buffer, int len, int timeout_ms);
+static void ws_parser_reset(ws_parser_t *parser);
+static esp_err_t ws_parser_advance(ws_client_handle_t client, int len);
+static esp_err_t ws_parser_start_payload(ws_client_handle_t client);
+static esp_err_t ws_parser_next_chunk(ws_client_handle_t client);
+static esp_err_t ws_handle_frame(ws_client_handle_t client);
+static void ws_parser_unmask(ws_parser_t *parser);
+static esp_err_t ws_inflate_init(ws_client_handle_t client, int window_bits);
+static void ws_inflate_reset(ws_inflate_t *inflate);
+static esp_err_t ws_inflate_accept(ws_client_handle_t client, const char *extensions, size_t len);
+static esp_err_t ws_inflate_message(ws_client_handle_t client, int *len);
+static int64_t ws_now_ms();
+static int ws_reconnect_delay(ws_client_handle_t client);
+static int ws_keepalive_timeout(ws_client_handle_t client);
+static esp_err_t ws_keepalive(ws_client_handle_t client);
+static esp_err_t ws_write_frame(ws_client_handle_t client, int opcode, const uint8_t *data, int len, uint8_t *scratch, int scratch_len);
+static esp_err_t ws_write_all(ws_client_handle_t client, const uint8_t *buff, int len);
+static esp_err_t ws_send_close(ws_client_handle_t client, int code);
+static esp_err_t ws_send_queue_init(ws_client_handle_t client, int size);
+static esp_err_t ws_send_queue_add(ws_client_handle_t client, int opcode, const uint8_t *data, int len, int timeout_ms);
+static esp_err_t ws_send_queue_drain(ws_client_handle_t client);
+static void ws_send_queue_flush(ws_client_handle_t client);
+static bool ws_on_network_task(ws_client_handle_t client);
+static int ws_frame_header(uint8_t *dst, int opcode, int len, const uint8_t mask[4]);
+static bool ws_client_finish(ws_client_handle_t client, bool wait);
+static void ws_handle_close(ws_client_handle_t client, const uint8_t *payload, int len);
+static bool ws_close_code_valid(int code);
+static void ws_mask_copy(uint8_t *dst, const uint8_t *src, int len, const uint8_t mask[4], int offset);
+static int ws_upgrade_on_header_field(http_parser *parser, const char *at, size_t length);
+static int ws_upgrade_on_header_value(http_parser *parser, const char *at, size_t length);
+static int ws_upgrade_on_headers_complete(http_parser *parser);
+static void ws_upgrade_header_done(ws_upgrade_t *upgrade);
+static bool ws_token_in_list(const char *list, size_t list_len, const char *token);
+static size_t trimwhitespace_len(const char *str, size_t len);
 static void ws_task(void *pv);
+static void ws_group_task(void *pv);
+static void ws_client_step(ws_client_handle_t client, bool wait);
 
 ws_client_handle_t ws_client_init(const ws_client_config_t *config) {
     ws_client_handle_t client = calloc(1, sizeof(ws_client_t));
@@ -110,6 +348,14 @@ ws_client_handle_t ws_client_init(const ws_client_config_t *config) {
         client->connection_info.auto_reconnect = false;
     }
     client->connection_info.network_timeout_ms = WS_NETWORK_TIMEOUT_MS;
+    client->connection_info.ping_interval_ms = config->ping_interval_ms;
+    if (client->connection_info.ping_interval_ms == 0) {
+        client->connection_info.ping_interval_ms = WS_PING_INTERVAL_MS;
+    }
+    client->connection_info.pong_timeout_ms = config->pong_timeout_ms;
+    if (client->connection_info.pong_timeout_ms <= 0) {
+        client->connection_info.pong_timeout_ms = WS_PONG_TIMEOUT_MS;
+    }
 
     struct http_parser_url puri;
     http_parser_url_init(&puri);
@@ -129,16 +375,17 @@ ws_client_handle_t ws_client_init(const ws_client_config_t *config) {
 
     if (strncmp(client->connection_info.scheme, "wss", 3) == 0) {
 #if WS_CLIENT_ENABLE_WSS
-        esp_transport_handle_t ssl = esp_transport_ssl_init();
+        // own ssl transport, it resumes the previous TLS session on reconnect
+        esp_transport_handle_t ssl = ws_transport_ssl_init();
         WS_MEM_CHECK(TAG, ssl, goto _ws_init_failed);
         if (config->cert_pem) {
-            esp_transport_ssl_set_cert_data(ssl, config->cert_pem, strlen(config->cert_pem));
+            ws_transport_ssl_set_cert_data(ssl, config->cert_pem, strlen(config->cert_pem));
         }
         if (config->client_cert_pem) {
-            esp_transport_ssl_set_client_cert_data(ssl, config->client_cert_pem, strlen(config->client_cert_pem));
+            ws_transport_ssl_set_client_cert_data(ssl, config->client_cert_pem, strlen(config->client_cert_pem));
         }
         if (config->client_key_pem) {
-            esp_transport_ssl_set_client_key_data(ssl, config->client_key_pem, strlen(config->client_key_pem));
+            ws_transport_ssl_set_client_key_data(ssl, config->client_key_pem, strlen(config->client_key_pem));
         }
         esp_transport_list_add(client->connection_info.transport_list, ssl, "ssl");
         esp_transport_set_default_port(ssl, WSS_DEFAULT_PORT);
@@ -148,7 +395,8 @@ ws_client_handle_t ws_client_init(const ws_client_config_t *config) {
         }
 #endif
     } else {
-        esp_transport_handle_t tcp = esp_transport_tcp_init();
+        // own tcp transport too, ws_client_stop() can shut its socket down
+        esp_transport_handle_t tcp = ws_transport_tcp_init();
         WS_MEM_CHECK(TAG, tcp, goto _ws_init_failed);
         esp_transport_list_add(client->connection_info.transport_list, tcp, "tcp");
         esp_transport_set_default_port(tcp, WS_DEFAULT_PORT);
@@ -157,20 +405,80 @@ ws_client_handle_t ws_client_init(const ws_client_config_t *config) {
             client->connection_info.port = WS_DEFAULT_PORT;
         }
     }
+    if (config->group && client->connection_info.transport) {
+        // one wake socket for the group task to select() on, not one per client
+        ws_transport_share_wake(client->connection_info.transport, config->group->wake);
+    }
 
     // init buffers
-    client->ws_data.out_buff = config->out_buffer;
-    client->ws_data.out_buff_len = config->out_buffer_size;
     int buffer_size = config->buffer_size;
     if (buffer_size <= 0) {
         buffer_size = WS_BUFFER_SIZE_BYTE;
     }
-    client->ws_data.rcv_buff = (uint8_t *)malloc(buffer_size);
+    if (config->group) {
+        client->ws_data.pool = config->group->pool;
+    } else {
+        int block_size = config->pool_block_size;
+        if (block_size <= 0) {
+            block_size = WS_POOL_BLOCK_SIZE;
+        }
+        int block_count = config->pool_block_count;
+        if (block_count <= 0) {
+            // a full size message for every buffer that can be in flight
+            block_count = (buffer_size + block_size - 1) / block_size * (config->dispatch_queue_size > 0 ? config->dispatch_queue_size + 1 : 1);
+        }
+        client->ws_data.pool = ws_pool_init(block_size, block_count, config->pool_in_psram);
+        WS_MEM_CHECK(TAG, client->ws_data.pool, goto _ws_init_failed);
+    }
+    client->ws_data.buff_limit = buffer_size < ws_pool_size(client->ws_data.pool) ? buffer_size : ws_pool_size(client->ws_data.pool);
+    client->ws_data.rcv_buff = ws_pool_alloc(client->ws_data.pool, 1, &client->ws_data.rcv_buff_len);
     WS_MEM_CHECK(TAG, client->ws_data.rcv_buff, goto _ws_init_failed);
-    client->ws_data.rcv_buff_len = buffer_size;
+    if (config->dispatch_queue_size > 0) {
+        WS_MEM_CHECK(TAG, ws_dispatch_init(client, config->dispatch_queue_size) == ESP_OK, goto _ws_init_failed);
+    }
+    int send_queue_size = config->send_queue_size;
+    if (send_queue_size <= 0) {
+        send_queue_size = WS_TX_BUFFER_SIZE_BYTE;
+    }
+    WS_MEM_CHECK(TAG, ws_send_queue_init(client, send_queue_size) == ESP_OK, goto _ws_init_failed);
+    client->ws_data.stream_large_messages = config->stream_large_messages;
+    if (config->permessage_deflate) {
+        int window_bits = config->deflate_window_bits;
+        if (window_bits == 0) {
+            window_bits = WS_DEFLATE_WINDOW_BITS;
+        }
+        if (window_bits < 9 || window_bits > 15) {
+            ESP_LOGE(TAG, "deflate_window_bits(%d) not in 9..15", window_bits);
+            goto _ws_init_failed;
+        }
+        WS_MEM_CHECK(TAG, ws_inflate_init(client, window_bits) == ESP_OK, goto _ws_init_failed);
+    }
+    ws_parser_reset(&client->ws_data.parser);
+    ws_client_reset_stats(client);
 
     client->status_bits = xEventGroupCreate();
     WS_MEM_CHECK(TAG, client->status_bits, goto _ws_init_failed);
+    client->lock = xSemaphoreCreateMutex();
+    WS_MEM_CHECK(TAG, client->lock, goto _ws_init_failed);
+    if (client->dispatch) {
+        if (xTaskCreate(ws_dispatch_task, "ws_dispatch", client->task_stack, client, client->task_prio, NULL) != pdTRUE) {
+            ESP_LOGE(TAG, "Error create ws dispatch task");
+            goto _ws_init_failed;
+        }
+        client->dispatch->task_running = true;
+    }
+    if (config->group) {
+        xSemaphoreTake(config->group->lock, portMAX_DELAY);
+        if (config->group->client_count < WS_GROUP_MAX_CLIENTS) {
+            config->group->clients[config->group->client_count++] = client;
+            client->group = config->group;
+        }
+        xSemaphoreGive(config->group->lock);
+        if (client->group == NULL) {
+            ESP_LOGE(TAG, "Group is full, %d clients", WS_GROUP_MAX_CLIENTS);
+            goto _ws_init_failed;
+        }
+    }
     return client;
 _ws_init_failed:
     ws_client_destroy(client);
@@ -182,6 +490,17 @@ esp_err_t ws_client_start(ws_client_handle_t client) {
         ESP_LOGE(TAG, "Client has started");
         return ESP_FAIL;
     }
+    client->reconnect_waiting = false;
+    client->ws_data.buff_wait_until_ms = 0;
+    client->finish_until_ms = 0;
+
+    if (client->group) {
+        // the group task picks it up on its next turn, run goes first so it isn't taken for stopped
+        xEventGroupClearBits(client->status_bits, STOPPED_BIT | WAKEUP_BIT);
+        client->run = true;
+        client->state = WS_STATE_INIT;
+        return ESP_OK;
+    }
 
     if (xTaskCreate(ws_task, "ws_task", client->task_stack, client, client->task_prio, NULL) != pdTRUE) {
         ESP_LOGE(TAG, "Error create ws task");
@@ -193,201 +512,640 @@ esp_err_t ws_client_start(ws_client_handle_t client) {
 
 static void ws_task(void *pv) {
     ws_client_handle_t client = (ws_client_handle_t)pv;
+    client->task = xTaskGetCurrentTaskHandle();
     client->run = true;
     client->state = WS_STATE_INIT;
-    xEventGroupClearBits(client->status_bits, STOPPED_BIT);
+    xEventGroupClearBits(client->status_bits, STOPPED_BIT | WAKEUP_BIT);
     while (client->run) {
+        ws_client_step(client, true);
+    }
+    ws_client_finish(client, true);
+    esp_transport_close(client->connection_info.transport);
+    xEventGroupSetBits(client->status_bits, STOPPED_BIT);
 
-        switch ((int)client->state) {
-            case WS_STATE_INIT:
-                if (client->connection_info.transport == NULL) {
-                    ESP_LOGE(TAG, "There are no transport");
-                    client->run = false;
-                    break;
-                }
+    vTaskDelete(NULL);
+}
 
-                if (ws_connect(client) < 0) {
-                    ESP_LOGE(TAG, "Error ws_connect");
-                    ws_abort_connection(client);
-                    break;
-                }
-                ESP_LOGD(TAG, "Transport connected to %s://%s:%d", client->connection_info.scheme, client->connection_info.host, client->connection_info.port);
+/*
+ * One turn of the client state machine. With wait the client has a task of its own that
+ * blocks here for data and the reconnect delay, a group task only ever waits in select().
+ */
+static void ws_client_step(ws_client_handle_t client, bool wait)
+{
+    switch ((int)client->state) {
+        case WS_STATE_INIT:
+            if (client->connection_info.transport == NULL) {
+                ESP_LOGE(TAG, "There are no transport");
+                client->run = false;
+                break;
+            }
 
-                client->event.event_id = WS_EVENT_CONNECTED;
-                client->state = WS_STATE_CONNECTED;
-                ws_dispatch_event(client);
+            int buff_len = WS_HANDSHAKE_BUFFER_SIZE < client->ws_data.buff_limit ? WS_HANDSHAKE_BUFFER_SIZE : client->ws_data.buff_limit;
+            esp_err_t ret = ws_buff_reserve(client, buff_len, true);
+            if (ret == ESP_ERR_TIMEOUT) {
+                break;  // group task: the pool is short, try again after select()
+            }
+            if (ret != ESP_OK) {
+                ESP_LOGE(TAG, "No buffer for the handshake");
+                ws_abort_connection(client);
+                break;
+            }
+            if (ws_connect(client) < 0) {
+                ESP_LOGE(TAG, "Error ws_connect");
+                ws_abort_connection(client);
                 break;
-            case WS_STATE_CONNECTED:
-                // receive and process data
-                if (ws_process_receive_frame(client) == ESP_FAIL) {
-                    ws_abort_connection(client);
-                    break;
+            }
+            ESP_LOGD(TAG, "Transport connected to %s://%s:%d", client->connection_info.scheme, client->connection_info.host, client->connection_info.port);
+
+            client->keepalive.last_rx_ms = ws_now_ms();
+            client->keepalive.ping_pending = false;
+            client->reconnect = false;
+            xSemaphoreTake(client->lock, portMAX_DELAY);
+            int attempts = client->reconnect_attempts + 1;
+            client->reconnect_attempts = 0;
+            xEventGroupClearBits(client->status_bits, WAKEUP_BIT);
+            xSemaphoreGive(client->lock);
+            if (client->disconnected_us) {
+                int64_t reconnect_us = esp_timer_get_time() - client->disconnected_us;
+                client->stats.reconnects++;
+                client->stats.reconnect_us += reconnect_us;
+                client->stats.last_reconnect_us = reconnect_us;
+                if (reconnect_us > client->stats.max_reconnect_us) {
+                    client->stats.max_reconnect_us = reconnect_us;
                 }
+            }
+            ws_trace(client, WS_TRACE_CONNECTED, 0, 0, attempts);
+            client->event.event_id = WS_EVENT_CONNECTED;
+            client->state = WS_STATE_CONNECTED;
+            ws_dispatch_event(client);
+            break;
+        case WS_STATE_CONNECTED:
+            // receive and process data
+            if (ws_process_receive(client, wait ? ws_keepalive_timeout(client) : 0) == ESP_FAIL) {
+                ws_abort_connection(client);
+                break;
+            }
+            // what the handler or other tasks queued meanwhile, all in one write
+            if (ws_send_queue_drain(client) != ESP_OK) {
+                ws_abort_connection(client);
+                break;
+            }
+            if (client->reconnect || ws_keepalive(client) == ESP_FAIL) {
+                ws_abort_connection(client);
+                break;
+            }
 
+            break;
+        case WS_STATE_WAIT_TIMEOUT:
+            if (!client->connection_info.auto_reconnect) {
+                client->run = false;
                 break;
-            case WS_STATE_WAIT_TIMEOUT:
-                if (!client->connection_info.auto_reconnect) {
-                    client->run = false;
-                    break;
+            }
+
+            if (!client->reconnect_waiting) {
+                xSemaphoreTake(client->lock, portMAX_DELAY);
+                int attempt = client->reconnect_attempts + 1;
+                int delay_ms = ws_reconnect_delay(client);
+                xSemaphoreGive(client->lock);
+                ESP_LOGI(TAG, "Reconnect after %d ms, attempt %d", delay_ms, attempt);
+                client->reconnect_at_ms = ws_now_ms() + delay_ms;
+                client->reconnect_waiting = true;
+            }
+            // ws_client_wakeup() or ws_client_stop() end the wait early
+            int64_t left_ms = client->reconnect_at_ms - ws_now_ms();
+            if (left_ms > 0) {
+                EventBits_t bits = xEventGroupWaitBits(client->status_bits, WAKEUP_BIT, pdTRUE, pdTRUE, wait ? left_ms / portTICK_RATE_MS : 0);
+                if (!wait && !(bits & WAKEUP_BIT)) {
+                    break;  // the group task comes back when it's due
+                }
+            }
+            client->reconnect_waiting = false;
+            // a wakeup that came in meanwhile is served by this attempt
+            xSemaphoreTake(client->lock, portMAX_DELAY);
+            client->reconnect_attempts++;
+            xEventGroupClearBits(client->status_bits, WAKEUP_BIT);
+            xSemaphoreGive(client->lock);
+            client->state = WS_STATE_INIT;
+            ESP_LOGD(TAG, "Reconnecting...");
+            break;
+    }
+}
+
+/*
+ * Group task: steps every started client without blocking, then sleeps in select() on the
+ * sockets of the connected ones, and the wake socket they share, until data arrives, a
+ * frame is queued or the next keep-alive or reconnect is due. A client that has to wait for pool blocks or for the server's CLOSE is put off to
+ * a later turn instead. A connect still blocks the other clients for up to
+ * network_timeout_ms.
+ */
+static void ws_group_task(void *pv)
+{
+    ws_client_group_handle_t group = (ws_client_group_handle_t)pv;
+    struct timeval tv;
+    fd_set readset;
+
+    group->task = xTaskGetCurrentTaskHandle();
+    while (group->run) {
+        int timeout_ms = WS_GROUP_POLL_MS;
+        int max_fd = -1;
+        // shared by the clients, readable when one has frames queued or is stopped
+        int wake_fd = ws_transport_get_wake_fd(group->wake);
+
+        FD_ZERO(&readset);
+        if (wake_fd >= 0) {
+            FD_SET(wake_fd, &readset);
+            max_fd = wake_fd;
+        }
+        xSemaphoreTake(group->lock, portMAX_DELAY);
+        for (int i = 0; i < group->client_count; i++) {
+            ws_client_handle_t client = group->clients[i];
+            if (client->run) {
+                ws_client_step(client, false);
+            }
+            int client_timeout_ms = 0;
+            if (!client->run) {
+                // stopped or done reconnecting, close it once as ws_task would on its way out
+                if (client->state == WS_STATE_UNKNOWN || (xEventGroupGetBits(client->status_bits) & STOPPED_BIT)) {
+                    continue;
+                }
+                if (ws_client_finish(client, false)) {
+                    esp_transport_close(client->connection_info.transport);
+                    xEventGroupSetBits(client->status_bits, STOPPED_BIT);
+                    continue;
+                }
+                // the server's CLOSE is still to come
+                int fd = ws_transport_get_fd(client->connection_info.transport);
+                int64_t left_ms = client->finish_until_ms - ws_now_ms();
+                client_timeout_ms = left_ms > 0 ? (int)left_ms : 0;
+                if (client->ws_data.parser.state == WS_PARSE_WAIT_BUFF) {
+                    client_timeout_ms = client_timeout_ms < WS_GROUP_DEFER_MS ? client_timeout_ms : WS_GROUP_DEFER_MS;
+                } else if (fd >= 0) {
+                    FD_SET(fd, &readset);
+                    max_fd = fd > max_fd ? fd : max_fd;
                 }
+            } else if (client->state == WS_STATE_INIT
+                       || (client->state == WS_STATE_CONNECTED && client->ws_data.parser.state == WS_PARSE_WAIT_BUFF)) {
+                // waiting for pool blocks or its handler, its socket would only wake us up for nothing
+                client_timeout_ms = WS_GROUP_DEFER_MS;
+            } else if (client->state == WS_STATE_CONNECTED) {
+                int fd = ws_transport_get_fd(client->connection_info.transport);
+                if (fd >= 0) {
+                    FD_SET(fd, &readset);
+                    max_fd = fd > max_fd ? fd : max_fd;
+                }
+                client_timeout_ms = ws_keepalive_timeout(client);
+            } else if (client->state == WS_STATE_WAIT_TIMEOUT && client->reconnect_waiting) {
+                int64_t left_ms = client->reconnect_at_ms - ws_now_ms();
+                client_timeout_ms = left_ms > 0 ? (int)left_ms : 0;
+            }
+            if (client_timeout_ms < timeout_ms) {
+                timeout_ms = client_timeout_ms;
+            }
+        }
+        xSemaphoreGive(group->lock);
 
-                vTaskDelay(client->connection_info.network_timeout_ms / portTICK_RATE_MS);
-                client->state = WS_STATE_INIT;
-                ESP_LOGD(TAG, "Reconnecting...");
-                break;
+        if (timeout_ms <= 0) {
+            continue;
+        }
+        if (max_fd < 0) {
+            vTaskDelay(timeout_ms / portTICK_PERIOD_MS);
+            continue;
+        }
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+        if (select(max_fd + 1, &readset, NULL, NULL, &tv) > 0 && wake_fd >= 0 && FD_ISSET(wake_fd, &readset)) {
+            char drain[8];
+            while (recv(wake_fd, drain, sizeof(drain), MSG_DONTWAIT) > 0) {
+            }
         }
     }
-    esp_transport_close(client->connection_info.transport);
-    xEventGroupSetBits(client->status_bits, STOPPED_BIT);
+    xEventGroupSetBits(group->status_bits, STOPPED_BIT);
 
     vTaskDelete(NULL);
 }
 
-void print_bytes(void *ptr, int size) 
+/*
+ * Read whatever the transport has and feed it to the frame parser. The first read waits
+ * up to timeout_ms, then we keep going without waiting while data is buffered
+ * (e.g. the rest of a TLS record). A partial frame is simply resumed on the next call.
+ */
+static esp_err_t ws_process_receive(ws_client_handle_t client, int timeout_ms)
 {
-    unsigned char *p = ptr;
-    int i;
-    for (i=0; i<size; i++) {
-        printf("%02hhX ", p[i]);
+    ws_parser_t *parser = &client->ws_data.parser;
+    char discard[64];
+    char *dst;
+    int rlen;
+
+    // after ws_client_stop() only to wait for the server's CLOSE
+    while (client->run || client->ws_data.close_sent) {
+        if (parser->state == WS_PARSE_WAIT_BUFF) {
+            // group task: see whether the pool has blocks and the queue room for the frame by now
+            esp_err_t ret = parser->streaming ? ws_parser_next_chunk(client) : ws_parser_start_payload(client);
+            if (ret != ESP_OK) {
+                return ESP_FAIL;
+            }
+            if (parser->state == WS_PARSE_WAIT_BUFF) {
+                return ESP_OK;
+            }
+            continue;
+        }
+        int want = parser->need - parser->got;
+        switch (parser->state) {
+            case WS_PARSE_HEADER:
+                dst = (char *)&client->ws_data.ws_header + parser->got;
+                break;
+            case WS_PARSE_EXT_LEN:
+                dst = (char *)client->ws_data.ws_header.ext_payload_len + parser->got;
+                break;
+            case WS_PARSE_MASK:
+                dst = (char *)parser->mask + parser->got;
+                break;
+            case WS_PARSE_PAYLOAD:
+            default:
+                if (parser->got < parser->keep_len) {
+                    dst = (char *)parser->payload + parser->got;
+                    want = parser->keep_len - parser->got;
+                } else {
+                    dst = discard;
+                    want = parser->payload_left < sizeof(discard) ? parser->payload_left : sizeof(discard);
+                }
+                break;
+        }
+
+        rlen = ws_read(client, dst, want, timeout_ms);
+        if (rlen < 0) {
+            ESP_LOGE(TAG, "Read error or end of stream");
+            return ESP_FAIL;
+        }
+        if (rlen == 0) {
+            return ESP_OK;  // nothing more for now, continue main loop.
+        }
+        // any traffic shows the connection is alive
+        client->keepalive.last_rx_ms = ws_now_ms();
+        client->keepalive.ping_pending = false;
+        if (ws_parser_advance(client, rlen) != ESP_OK) {
+            // tell the server why before dropping the connection
+            if (!client->ws_data.close_sent) {
+                ws_send_close(client, client->ws_data.fail_code ? client->ws_data.fail_code : WS_CLOSE_PROTOCOL_ERROR);
+            }
+            client->ws_data.fail_code = 0;
+            return ESP_FAIL;
+        }
+        if (client->ws_data.closed) {
+            ESP_LOGI(TAG, "Connection closed by server, code %d", client->ws_data.close_code);
+            return ESP_FAIL;
+        }
+        timeout_ms = 0;
     }
-    printf("\n");
+    return ESP_OK;
 }
 
-static esp_err_t ws_process_receive_frame(ws_client_handle_t client)
+// transport read, bytes that arrived with the upgrade response are served first
+static int ws_read(ws_client_handle_t client, char *buffer, int len, int timeout_ms)
 {
-    int received_header_len = 0;   // total received header len
-    int rlen = 0;       // esp_transport_read() returned len
-    int real_head_len = 2;  // real header len for this frame. <= 10 sizeof(ws_header_t)
-    int read_tries = 0;
-
-    // wait for data
-    int poll_read = esp_transport_poll_read(client->connection_info.transport, client->connection_info.network_timeout_ms);
-    if ( poll_read < 0) {
-        ESP_LOGE(TAG, "esp_transport_poll_read() failed.");
-        return ESP_FAIL;
-    } else if (poll_read == 0) {
-        return ESP_OK;
+    ws_data_t *ws_data = &client->ws_data;
+
+    if (ws_data->pending_len > 0) {
+        int n = len < ws_data->pending_len ? len : ws_data->pending_len;
+        // they sit in rcv_buff, always further in than where the parser stores what it read
+        memmove(buffer, ws_data->pending, n);
+        client->stats.copied_bytes += n;
+        ws_data->pending += n;
+        ws_data->pending_len -= n;
+        return n;
     }
+    return esp_transport_read(client->connection_info.transport, buffer, len, timeout_ms);
+}
 
-    // handle header
-    memset(&client->ws_data.ws_header, 0, sizeof(ws_header_t));
-    while (received_header_len < real_head_len) {
-        ESP_LOGI(TAG, "received_header_len(%d), real_head_len(%d)", received_header_len, real_head_len);
-        if ((read_tries++) > 5) {
-            ESP_LOGE(TAG, "ws_process_receive not finished in 5 transport_read()");
-            return ESP_FAIL;
+static void ws_parser_reset(ws_parser_t *parser)
+{
+    parser->state = WS_PARSE_HEADER;
+    parser->need = 2;
+    parser->got = 0;
+    memset(parser->mask, 0, sizeof(parser->mask));
+}
+
+static esp_err_t ws_parser_advance(ws_client_handle_t client, int len)
+{
+    ws_parser_t *parser = &client->ws_data.parser;
+    ws_header_t *header = &client->ws_data.ws_header;
+    esp_err_t ret;
+
+    if (parser->state == WS_PARSE_PAYLOAD) {
+        parser->payload_left -= len;
+        if (parser->got < parser->keep_len) {
+            parser->got += len;     // reads never cross keep_len
         }
-        rlen = esp_transport_read(client->connection_info.transport, (char *)&client->ws_data.ws_header+received_header_len, real_head_len - received_header_len, client->connection_info.network_timeout_ms);
-        ESP_LOGI(TAG, "rlen(%d)", rlen);
-        if (rlen < 0) {
-            ESP_LOGE(TAG, "Read error or end of stream");
-            return ESP_FAIL;
+        if (parser->streaming && parser->got == parser->keep_len && parser->payload_left > 0) {
+            // chunk full, hand it out and reuse the buffer for the next one
+            ws_parser_unmask(parser);
+            client->event.event_id = WS_EVENT_DATA;
+            client->event.data = parser->payload;
+            client->event.data_len = parser->got;
+            client->event.payload_len = parser->payload_len;
+            client->event.payload_offset = parser->payload_offset;
+            client->event.ws_header = header;
+            client->event.opcode = client->ws_data.msg_opcode;
+            client->event.truncated = false;
+            ws_trace(client, WS_TRACE_CHUNK, client->ws_data.msg_opcode, 0, parser->got);
+            ws_dispatch_buffer(client);
+            parser->payload_offset += parser->got;
+            parser->got = 0;
+            return ws_parser_next_chunk(client);
+        }
+        if (parser->payload_left > 0) {
+            return ESP_OK;
         }
-        if (rlen == 0 && received_header_len == 0) return ESP_OK;   // no header, continue main loop.
-        if (rlen == 0) continue; // got header, continue receive data.
+        ws_parser_unmask(parser);
+        client->stats.frames++;
+        client->stats.payload_bytes += parser->payload_len;
+        ret = ws_handle_frame(client);
+        ws_parser_reset(parser);
+        memset(header, 0, sizeof(ws_header_t));
+        return ret;
+    }
 
-        received_header_len += rlen;
+    parser->got += len;
+    if (parser->got < parser->need) {
+        return ESP_OK;
+    }
 
-        // calc real_head_len from minimal header
-        if (received_header_len == 2) {
-            if (client->ws_data.ws_header.payload_len < 126) {
-                continue;  // header complete
-            } else if (client->ws_data.ws_header.payload_len == 126) {
-                real_head_len += 2;
-            } else if (client->ws_data.ws_header.payload_len == 127) {
-                real_head_len += 8;
+    switch (parser->state) {
+        case WS_PARSE_HEADER:
+            if (header->payload_len == 126 || header->payload_len == 127) {
+                parser->state = WS_PARSE_EXT_LEN;
+                parser->need = header->payload_len == 126 ? 2 : 8;
+                parser->got = 0;
+                return ESP_OK;
             }
-        }
+            parser->payload_len = header->payload_len;
+            break;
+        case WS_PARSE_EXT_LEN:
+            // network byte order
+            parser->payload_len = 0;
+            for (int i = 0; i < parser->need; i++) {
+                parser->payload_len = (parser->payload_len << 8) | header->ext_payload_len[i];
+            }
+            if (parser->payload_len >> 63) {
+                ESP_LOGE(TAG, "invalid payload_len, most significant bit set");
+                return ESP_FAIL;
+            }
+            break;
+        case WS_PARSE_MASK:
+        default:
+            return ws_parser_start_payload(client);
     }
-    print_bytes(&client->ws_data.ws_header, sizeof(ws_header_t));
 
-    // handle payload_len
-    int payload_len = 0;
-    int received_payload_len = 0;
-    if (client->ws_data.ws_header.payload_len < 126) {
-        payload_len = client->ws_data.ws_header.payload_len;
-    } else if (client->ws_data.ws_header.payload_len == 126) {
-        payload_len = ntohs(*(uint16_t *)client->ws_data.ws_header.ext_payload_len);
-    } else if (client->ws_data.ws_header.payload_len == 127) {
-        ESP_LOGE(TAG, "payload_len > 0xFFFF");
-        return ESP_FAIL;
+    // header complete
+    ws_trace(client, WS_TRACE_FRAME, ((uint8_t *)header)[0], ((uint8_t *)header)[1], (uint32_t)parser->payload_len);
+    ESP_LOGV(TAG, "opcode(%d) payload_len(%llu)", header->opcode, (unsigned long long)parser->payload_len);
+    if (header->mask) {
+        parser->state = WS_PARSE_MASK;
+        parser->need = 4;
+        parser->got = 0;
+        return ESP_OK;
+    }
+    return ws_parser_start_payload(client);
+}
+
+// the next chunk of a streamed frame goes to the start of rcv_buff, which may be a new run
+// now. Make it as big as the pool allows right away
+static esp_err_t ws_parser_next_chunk(ws_client_handle_t client)
+{
+    ws_parser_t *parser = &client->ws_data.parser;
+
+    if (ws_dispatch_wait(client) == ESP_ERR_TIMEOUT) {
+        parser->state = WS_PARSE_WAIT_BUFF;
+        return ESP_OK;
+    }
+    if (ws_buff_reserve(client, client->ws_data.buff_limit, false) != ESP_OK && client->ws_data.rcv_buff == NULL) {
+        // a group whose pool ran dry kept no run at all
+        esp_err_t ret = ws_buff_reserve(client, 1, true);
+        if (ret == ESP_ERR_TIMEOUT) {
+            parser->state = WS_PARSE_WAIT_BUFF;
+            return ESP_OK;
+        }
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "No buffer for the rest of a streamed frame");
+            return ESP_FAIL;
+        }
     }
-    ESP_LOGI(TAG, "payload_len(%d)", payload_len);
+    parser->state = WS_PARSE_PAYLOAD;
+    parser->payload = client->ws_data.rcv_buff;
+    int capacity = client->ws_data.rcv_buff_len - 1;
+    parser->keep_len = parser->payload_left < capacity ? parser->payload_left : capacity;
+    return ESP_OK;
+}
 
-    // handle payload
-    if (payload_len > client->ws_data.rcv_buff_len) {
-        ESP_LOGE(TAG, "payload_len(%d) > rcv_buff_len(%d)", payload_len, client->ws_data.rcv_buff_len);
-        // return ESP_FAIL, re-connect to server.
+// pick where the payload goes: data frames are appended to the message in place,
+// control frames (<= 125 bytes) use their own buffer so a message in progress is kept.
+// one byte of rcv_buff is kept for the NUL terminator.
+static esp_err_t ws_parser_start_payload(ws_client_handle_t client)
+{
+    ws_parser_t *parser = &client->ws_data.parser;
+    ws_data_t *ws_data = &client->ws_data;
+    uint64_t payload_len = parser->payload_len;
+    int capacity;
+
+    parser->streaming = false;
+    if (ws_data->ws_header.srv_2 || ws_data->ws_header.srv_3) {
+        ESP_LOGE(TAG, "RSV2/RSV3 set, no extension defines them");
         return ESP_FAIL;
     }
-    memset(client->ws_data.rcv_buff, 0, client->ws_data.rcv_buff_len);
-    while (received_payload_len < payload_len) {
-        ESP_LOGI(TAG, "received_payload_len(%d), payload_len(%d)", received_payload_len, payload_len);
-        if ((read_tries++) > 5) {
-            ESP_LOGE(TAG, "ws_process_receive not finished in 5 transport_read()");
+    if (ws_data->ws_header.opcode <= 2) {
+        // a message is one TEXT/BINARY frame followed by CONTINUATION frames up to FIN,
+        // control frames may come in between but data frames of another message may not
+        if (ws_data->ws_header.opcode == 0 && ws_data->msg_opcode == 0) {
+            ESP_LOGE(TAG, "CONTINUATION frame without a message in progress");
             return ESP_FAIL;
         }
-        rlen = esp_transport_read(client->connection_info.transport, (char *)client->ws_data.rcv_buff+received_payload_len, client->ws_data.rcv_buff_len-received_payload_len, client->connection_info.network_timeout_ms);
-        ESP_LOGI(TAG, "rlen(%d)", rlen);
-        if (rlen < 0) {
-            ESP_LOGE(TAG, "Read error or end of stream");
+        if (ws_data->ws_header.opcode != 0 && ws_data->msg_opcode != 0) {
+            ESP_LOGE(TAG, "opcode(%d) frame before the message in progress is finished", ws_data->ws_header.opcode);
             return ESP_FAIL;
         }
-        if (rlen == 0) { continue; }
-        received_payload_len += rlen;
+        // RSV1 marks the first frame of a compressed message
+        if (ws_data->ws_header.srv_1 && (!ws_data->deflate || ws_data->ws_header.opcode == 0)) {
+            ESP_LOGE(TAG, "RSV1 set without permessage-deflate");
+            return ESP_FAIL;
+        }
+
+        // grow the run for the frame, short of that take what the pool can give. The group
+        // task doesn't wait for blocks or for the handler, the frame is picked up again
+        // after select()
+        if (ws_dispatch_wait(client) == ESP_ERR_TIMEOUT) {
+            parser->state = WS_PARSE_WAIT_BUFF;
+            return ESP_OK;
+        }
+        esp_err_t ret = ESP_FAIL;
+        if (!ws_data->msg_streaming && ws_data->msg_len + payload_len < ws_data->buff_limit) {
+            ret = ws_buff_reserve(client, ws_data->msg_len + payload_len + 1, true);
+        }
+        bool fits = ret == ESP_OK;
+        if (ret != ESP_OK && ret != ESP_ERR_TIMEOUT) {
+            if (ws_data->msg_streaming) {
+                ws_data->msg_len = 0;
+            }
+            if (ws_buff_reserve(client, ws_data->buff_limit, false) != ESP_OK && ws_data->rcv_buff == NULL) {
+                // a group whose pool ran dry kept no run at all
+                ret = ws_buff_reserve(client, 1, true);
+                if (ret != ESP_OK && ret != ESP_ERR_TIMEOUT) {
+                    ESP_LOGE(TAG, "No buffer for a data frame");
+                    return ESP_FAIL;
+                }
+            }
+        }
+        if (ret == ESP_ERR_TIMEOUT) {
+            parser->state = WS_PARSE_WAIT_BUFF;
+            return ESP_OK;
+        }
+        // only now, the checks above see the same state when the frame is picked up again
+        if (ws_data->ws_header.opcode != 0) {
+            ws_data->msg_opcode = ws_data->ws_header.opcode;
+            ws_data->msg_compressed = ws_data->ws_header.srv_1;
+        }
+        capacity = ws_data->rcv_buff_len - 1;
+
+        if (fits) {
+            parser->payload = ws_data->rcv_buff + ws_data->msg_len;
+            parser->keep_len = payload_len;
+        } else if (ws_data->msg_compressed) {
+            // can't be skipped or cut short either, the rest of the stream depends on it
+            ESP_LOGE(TAG, "compressed message larger than %d bytes", capacity);
+            ws_data->fail_code = WS_CLOSE_MESSAGE_TOO_BIG;
+            return ESP_FAIL;
+        } else if (ws_data->stream_large_messages) {
+            // too big to assemble, stream this and the remaining frames of the message
+            ws_data->msg_streaming = true;
+            ws_data->msg_len = 0;
+            parser->streaming = true;
+            parser->payload = ws_data->rcv_buff;
+            parser->keep_len = payload_len < capacity ? payload_len : capacity;
+        } else if (payload_len > capacity && !ws_data->msg_truncated) {
+            ESP_LOGE(TAG, "payload_len(%llu) > buff_limit(%d)", (unsigned long long)payload_len, ws_data->buff_limit);
+            ws_data->fail_code = WS_CLOSE_MESSAGE_TOO_BIG;
+            // return ESP_FAIL, re-connect to server.
+            return ESP_FAIL;
+        } else {
+            // keep what fits, drain the rest of this and the following frames
+            if (!ws_data->msg_truncated) {
+                ESP_LOGW(TAG, "message truncated at %d bytes", capacity);
+                ws_data->msg_truncated = true;
+            }
+            parser->payload = ws_data->rcv_buff + ws_data->msg_len;
+            parser->keep_len = capacity > ws_data->msg_len ? capacity - ws_data->msg_len : 0;
+        }
+    } else {
+        if (ws_data->ws_header.opcode != 8 && ws_data->ws_header.opcode != 9 && ws_data->ws_header.opcode != 10) {
+            ESP_LOGE(TAG, "reserved opcode(%d)", ws_data->ws_header.opcode);
+            return ESP_FAIL;
+        }
+        // control frames are never fragmented, they fit ctrl_buff and leave the message alone
+        if (!ws_data->ws_header.fin) {
+            ESP_LOGE(TAG, "fragmented control frame");
+            return ESP_FAIL;
+        }
+        if (payload_len > WS_CTRL_PAYLOAD_MAX) {
+            ESP_LOGE(TAG, "control frame payload_len(%llu) > %d", (unsigned long long)payload_len, WS_CTRL_PAYLOAD_MAX);
+            return ESP_FAIL;
+        }
+        parser->payload = ws_data->ctrl_buff;
+        parser->keep_len = payload_len;
+    }
+
+    parser->state = WS_PARSE_PAYLOAD;
+    parser->got = 0;
+    parser->payload_left = payload_len;
+    parser->payload_offset = 0;
+    if (payload_len == 0) {
+        return ws_parser_advance(client, 0);
     }
+    return ESP_OK;
+}
+
+static void ws_parser_unmask(ws_parser_t *parser)
+{
+    if (!parser->mask[0] && !parser->mask[1] && !parser->mask[2] && !parser->mask[3]) {
+        return;
+    }
+    ws_mask_copy(parser->payload, parser->payload, parser->got, parser->mask, parser->payload_offset & 3);
+}
+
+static esp_err_t ws_handle_frame(ws_client_handle_t client)
+{
+    ws_parser_t *parser = &client->ws_data.parser;
+    uint8_t *payload = parser->payload;
 
     // handle opcode
-    ws_header_t pong_ws_header;
-    int n_copy = 0;
-    ESP_LOGI(TAG, "opcode(%d)", client->ws_data.ws_header.opcode);
+    uint8_t pong[WS_MAX_HEADER_LEN + WS_CTRL_PAYLOAD_MAX];
     switch(client->ws_data.ws_header.opcode) {
         case 0: /* FRAGMENT */
         case 1: /* TEXT */
         case 2: /* BINARY */
-            client->event.event_id = WS_EVENT_DATA;
-            client->event.data = client->ws_data.rcv_buff;
-            client->event.data_len = payload_len;
-            client->event.ws_header = &(client->ws_data.ws_header);
-            ws_dispatch_event(client);
-
-            // handle fragment
-            if (client->ws_data.out_buff) {
-                ESP_LOGI(TAG, "out_buff_len(%d), out_buff_cur(%d)", client->ws_data.out_buff_len, client->ws_data.out_buff_cur);
-                n_copy = (client->ws_data.out_buff_len - client->ws_data.out_buff_cur) > payload_len ? payload_len : (client->ws_data.out_buff_len - client->ws_data.out_buff_cur);
-                memcpy(client->ws_data.out_buff + client->ws_data.out_buff_cur, client->ws_data.rcv_buff, n_copy);
-                client->ws_data.out_buff_cur += n_copy;
-
+            // streamed message has been handed out chunk by chunk, nothing to assemble
+            if (client->ws_data.msg_streaming) {
+                client->event.event_id = WS_EVENT_DATA;
+                client->event.data = payload;
+                client->event.data_len = parser->got;
+                client->event.payload_len = parser->payload_len;
+                client->event.payload_offset = parser->payload_offset;
+                client->event.ws_header = &(client->ws_data.ws_header);
+                client->event.opcode = client->ws_data.msg_opcode;
+                client->event.truncated = false;
+                ws_trace(client, WS_TRACE_CHUNK, client->ws_data.msg_opcode, 0, parser->got);
+                ws_dispatch_buffer(client);
                 if (client->ws_data.ws_header.fin) {
-                    client->event.event_id = WS_EVENT_DATA_FIN;
-                    client->event.data = client->ws_data.out_buff;
-                    client->event.data_len = client->ws_data.out_buff_cur;
-                    client->event.ws_header = &(client->ws_data.ws_header);
-                    ws_dispatch_event(client);
-                    client->ws_data.out_buff_cur = 0;
-                    memset(client->ws_data.out_buff, 0, client->ws_data.out_buff_len);
+                    client->ws_data.msg_streaming = false;
+                    client->ws_data.msg_opcode = 0;
+                }
+                break;
+            }
+
+            // handle fragment, already in place behind the previous ones. Nothing is
+            // dispatched before the message is complete
+            client->ws_data.msg_len += parser->got;
+            if (client->ws_data.ws_header.fin) {
+                int msg_len = client->ws_data.msg_len;
+                if (client->ws_data.msg_compressed) {
+                    client->ws_data.msg_compressed = false;
+                    if (ws_inflate_message(client, &msg_len) != ESP_OK) {
+                        return ESP_FAIL;
+                    }
                 }
+                client->ws_data.rcv_buff[msg_len] = 0;
+                client->event.event_id = WS_EVENT_DATA_FIN;
+                client->event.data = client->ws_data.rcv_buff;
+                client->event.data_len = msg_len;
+                client->event.payload_len = msg_len;
+                client->event.payload_offset = 0;
+                client->event.ws_header = &(client->ws_data.ws_header);
+                client->event.opcode = client->ws_data.msg_opcode;
+                client->event.truncated = client->ws_data.msg_truncated;
+                if (client->ws_data.msg_truncated) {
+                    client->stats.truncated_messages++;
+                }
+                ws_trace(client, WS_TRACE_MESSAGE, client->ws_data.msg_opcode, client->ws_data.msg_truncated, msg_len);
+                ws_dispatch_buffer(client);
+                client->ws_data.msg_len = 0;
+                client->ws_data.msg_opcode = 0;
+                client->ws_data.msg_truncated = false;
+                ws_buff_shrink(client);
             }
 
             break;
         case 9: /* PING */
-            memcpy(&pong_ws_header, &(client->ws_data.ws_header), 2);
-            pong_ws_header.opcode = 10;
-            pong_ws_header.mask = 1;
-            esp_transport_write(client->connection_info.transport, (char *)&pong_ws_header, 2, client->connection_info.network_timeout_ms);
-
-            if (pong_ws_header.payload_len > 0) {
-                char mask[4] = {0};
-                getrandom(mask, 4, 0);
-                esp_transport_write(client->connection_info.transport, mask, 4, client->connection_info.network_timeout_ms);
-                for (int i = 0; i < pong_ws_header.payload_len; i++) {
-                    client->ws_data.rcv_buff[i] = (client->ws_data.rcv_buff[i] ^ mask[i % 4]);
-                }
-                esp_transport_write(client->connection_info.transport, (char *)client->ws_data.rcv_buff, pong_ws_header.payload_len, client->connection_info.network_timeout_ms);
+            ws_trace(client, WS_TRACE_PING, 0, 0, parser->got);
+            // echo payload back right away, on the stack as the send queue belongs to the senders
+            if (ws_write_frame(client, 10 /* PONG */, payload, parser->got, pong, sizeof(pong)) != ESP_OK) {
+                return ESP_FAIL;
             }
             break;
-        case 8: /* CLOSE */
         case 10: /* PONG */
+            ws_trace(client, WS_TRACE_PONG, 0, 0, (uint32_t)(ws_now_ms() - client->keepalive.ping_sent_ms));
+            ESP_LOGV(TAG, "PONG after %d ms", (int)(ws_now_ms() - client->keepalive.ping_sent_ms));
+            break;
+        case 8: /* CLOSE */
+            ws_handle_close(client, payload, parser->got);
+            break;
         default:
             break;
     }
@@ -395,58 +1153,360 @@ static esp_err_t ws_process_receive_frame(ws_client_handle_t client)
     return ESP_OK;
 }
 
-static int ws_connect(ws_client_handle_t client) {
-    if (esp_transport_connect(client->connection_info.transport, client->connection_info.host, client->connection_info.port, client->connection_info.network_timeout_ms) < 0) {
-        ESP_LOGE(TAG, "Error connect to ther server esp_transport_connect");
-        return -1;
-    }
-
-    unsigned char random_key[16];
-    getrandom(random_key, sizeof(random_key), 0);
+static int64_t ws_now_ms()
+{
+    return esp_timer_get_time() / 1000;
+}
 
-    // Size of base64 coded string is equal '((input_size * 4) / 3) + (input_size / 96) + 6' including Z-term
-    unsigned char client_key[28] = {0};
+/*
+ * First retry after losing a connection is immediate, most drops are one-offs. After that
+ * the wait doubles from WS_RECONNECT_MIN_MS up to WS_RECONNECT_MAX_MS, with a random half
+ * on top of the other half so a room full of devices doesn't retry in lockstep.
+ */
+static int ws_reconnect_delay(ws_client_handle_t client)
+{
+    int attempts = client->reconnect_attempts;
+    int delay_ms = WS_RECONNECT_MAX_MS;
 
-    size_t outlen = 0;
-    mbedtls_base64_encode(client_key, sizeof(client_key), &outlen, random_key, sizeof(random_key));
-    int len = snprintf((char *)client->ws_data.rcv_buff, client->ws_data.rcv_buff_len,
-                         "GET %s HTTP/1.1\r\n"
-                         "Connection: Upgrade\r\n"
-                         "Host: %s:%d\r\n"
-                         "Upgrade: websocket\r\n"
-                         "Sec-WebSocket-Version: 13\r\n"
-                         "Sec-WebSocket-Protocol: mqtt\r\n"
-                         "Sec-WebSocket-Key: %s\r\n"
-                         "User-Agent: ESP32 Websocket Client\r\n\r\n",
-                         client->connection_info.path,
-                         client->connection_info.host,
-                         client->connection_info.port,
-                         client_key);
-    if (len <= 0 || len >= client->ws_data.rcv_buff_len) {
-        ESP_LOGE(TAG, "Error in request generation, %d", len);
-        return -1;
+    if (attempts == 0) {
+        return 0;
     }
-    ESP_LOGD(TAG, "Write upgrate request\r\n%s", client->ws_data.rcv_buff);
-    if (esp_transport_write(client->connection_info.transport, (char *)client->ws_data.rcv_buff, len, client->connection_info.network_timeout_ms) <= 0) {
-        ESP_LOGE(TAG, "Error write Upgrade header %s", client->ws_data.rcv_buff);
-        return -1;
+    if (attempts - 1 < 16 && (WS_RECONNECT_MIN_MS << (attempts - 1)) < WS_RECONNECT_MAX_MS) {
+        delay_ms = WS_RECONNECT_MIN_MS << (attempts - 1);
     }
-    if ((len = esp_transport_read(client->connection_info.transport, (char *)client->ws_data.rcv_buff, client->ws_data.rcv_buff_len, client->connection_info.network_timeout_ms)) <= 0) {
-        ESP_LOGE(TAG, "Error read response for Upgrade header %s", client->ws_data.rcv_buff);
-        return -1;
+    return delay_ms / 2 + esp_random() % (delay_ms / 2 + 1);
+}
+
+// how long the receive path may wait before ws_keepalive() has something to do
+static int ws_keepalive_timeout(ws_client_handle_t client)
+{
+    ws_keepalive_t *keepalive = &client->keepalive;
+    int timeout_ms = client->connection_info.network_timeout_ms;
+    int64_t deadline;
+
+    if (client->connection_info.ping_interval_ms < 0) {
+        return timeout_ms;
     }
-    char *server_key = get_http_header((char *)client->ws_data.rcv_buff, "Sec-WebSocket-Accept:");
-    if (server_key == NULL) {
-        ESP_LOGE(TAG, "Sec-WebSocket-Accept not found");
-        return -1;
+    if (keepalive->ping_pending) {
+        deadline = keepalive->ping_sent_ms + client->connection_info.pong_timeout_ms;
+    } else {
+        deadline = keepalive->last_rx_ms + client->connection_info.ping_interval_ms;
     }
+    int64_t left = deadline - ws_now_ms();
+    if (left < 0) {
+        return 0;
+    }
+    return left < timeout_ms ? (int)left : timeout_ms;
+}
 
-    // See mbedtls_sha1_ret() arg size
-    unsigned char expected_server_sha1[20];
-    // Size of base64 coded string see above
-    unsigned char expected_server_key[33] = {0};
-    // If you are interested, see https://tools.ietf.org/html/rfc6455
-    const char expected_server_magic[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+/*
+ * PING the server once it has been quiet for ping_interval_ms. If it stays quiet for
+ * another pong_timeout_ms the connection is taken as dead (e.g. half-open after the AP
+ * went away) and ESP_FAIL is returned so the caller reconnects.
+ */
+static esp_err_t ws_keepalive(ws_client_handle_t client)
+{
+    ws_keepalive_t *keepalive = &client->keepalive;
+    int64_t now = ws_now_ms();
+
+    if (client->connection_info.ping_interval_ms < 0) {
+        return ESP_OK;
+    }
+    if (keepalive->ping_pending) {
+        if (now - keepalive->ping_sent_ms >= client->connection_info.pong_timeout_ms) {
+            ESP_LOGW(TAG, "No PONG within %d ms, connection is dead", client->connection_info.pong_timeout_ms);
+            return ESP_FAIL;
+        }
+        return ESP_OK;
+    }
+    if (now - keepalive->last_rx_ms < client->connection_info.ping_interval_ms) {
+        return ESP_OK;
+    }
+
+    // on the stack as the send queue belongs to the senders
+    uint8_t ping[WS_MAX_HEADER_LEN + sizeof(now)];
+    ESP_LOGD(TAG, "PING after %d ms idle", (int)(now - keepalive->last_rx_ms));
+    if (ws_write_frame(client, 9 /* PING */, (const uint8_t *)&now, sizeof(now), ping, sizeof(ping)) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    keepalive->ping_pending = true;
+    keepalive->ping_sent_ms = now;
+    return ESP_OK;
+}
+
+static esp_err_t ws_inflate_init(ws_client_handle_t client, int window_bits)
+{
+    ws_inflate_t *inflate = calloc(1, sizeof(ws_inflate_t));
+    if (inflate == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    inflate->dict_size = 1 << window_bits;
+    inflate->dict = malloc(inflate->dict_size);
+    if (inflate->dict == NULL) {
+        free(inflate);
+        return ESP_ERR_NO_MEM;
+    }
+    client->ws_data.inflate = inflate;
+    return ESP_OK;
+}
+
+static void ws_inflate_reset(ws_inflate_t *inflate)
+{
+    tinfl_init(&inflate->decomp);
+    inflate->dict_ofs = 0;
+}
+
+/*
+ * Check the Sec-WebSocket-Extensions the server answered with, e.g.
+ * "permessage-deflate; server_no_context_takeover; server_max_window_bits=10".
+ * Only what we offered may come back, and the server window must fit ours.
+ */
+static esp_err_t ws_inflate_accept(ws_client_handle_t client, const char *extensions, size_t len)
+{
+    ws_inflate_t *inflate = client->ws_data.inflate;
+    const char *end = extensions + len;
+    const char *param;
+    bool window_limited = false;
+
+    if (extensions == NULL || len == 0) {
+        return ESP_OK;
+    }
+    if (inflate == NULL || len < strlen("permessage-deflate") || strncasecmp(extensions, "permessage-deflate", strlen("permessage-deflate")) != 0) {
+        ESP_LOGE(TAG, "Unexpected extension %.*s", (int)len, extensions);
+        return ESP_FAIL;
+    }
+
+    inflate->no_context_takeover = false;
+    for (param = memchr(extensions, ';', len); param; param = memchr(param, ';', end - param)) {
+        param++;
+        while (param < end && isspace((unsigned char)*param)) param++;
+        const char *param_end = memchr(param, ';', end - param);
+        size_t param_len = trimwhitespace_len(param, (param_end ? param_end : end) - param);
+        if (param_len == strlen("server_no_context_takeover") && strncasecmp(param, "server_no_context_takeover", param_len) == 0) {
+            inflate->no_context_takeover = true;
+        } else if (param_len > strlen("server_max_window_bits=") && strncasecmp(param, "server_max_window_bits=", strlen("server_max_window_bits=")) == 0) {
+            int window_bits = atoi(param + strlen("server_max_window_bits="));
+            if (window_bits < 8 || (1 << window_bits) > inflate->dict_size) {
+                ESP_LOGE(TAG, "server_max_window_bits=%d larger than offered", window_bits);
+                return ESP_FAIL;
+            }
+            window_limited = true;
+        } else if (param_len < strlen("client_") || strncasecmp(param, "client_", strlen("client_")) != 0) {
+            // client_* are about what we send, and we send uncompressed frames
+            ESP_LOGE(TAG, "Unexpected permessage-deflate parameter %.*s", (int)param_len, param);
+            return ESP_FAIL;
+        }
+    }
+    // RFC 7692 7.1.2.1: without it the server may use a 32KB window, more than dict holds
+    if (!window_limited && inflate->dict_size < (1 << 15)) {
+        ESP_LOGE(TAG, "server_max_window_bits missing, the server didn't limit its window to %d bytes", inflate->dict_size);
+        return ESP_FAIL;
+    }
+    ws_inflate_reset(inflate);
+    client->ws_data.deflate = true;
+    ESP_LOGI(TAG, "permessage-deflate, %d byte window%s", inflate->dict_size, inflate->no_context_takeover ? ", no context takeover" : "");
+    return ESP_OK;
+}
+
+/*
+ * Inflate the compressed message in rcv_buff[0..len) in place. The compressed bytes are
+ * moved to the end of the buffer and inflated to the front. Should the output catch up
+ * with the input still to be read, that rest is moved to the heap and the whole buffer
+ * is room for output. What doesn't fit is inflated all the same, to keep the window
+ * right for the next message, but dropped.
+ */
+static esp_err_t ws_inflate_message(ws_client_handle_t client, int *len)
+{
+    // the sender strips this empty stored block off every message
+    static const uint8_t deflate_tail[4] = { 0x00, 0x00, 0xFF, 0xFF };
+    ws_inflate_t *inflate = client->ws_data.inflate;
+    uint8_t *buff;
+    int capacity;
+    int in_len = *len;
+
+    // inflated messages are bigger, take the largest run we can get. Blocks held by the
+    // dispatch task come back, wait for them rather than truncate; the group task can't wait
+    ws_buff_reserve(client, client->ws_data.buff_limit, client->group == NULL);
+    buff = client->ws_data.rcv_buff;
+    capacity = client->ws_data.rcv_buff_len - 1;
+    // frames that came in behind this one go to the very end, out of the way
+    if (client->ws_data.pending_len > 0) {
+        uint8_t *pending = buff + client->ws_data.rcv_buff_len - client->ws_data.pending_len;
+        memmove(pending, client->ws_data.pending, client->ws_data.pending_len);
+        client->ws_data.pending = pending;
+        client->stats.copied_bytes += client->ws_data.pending_len;
+        capacity -= client->ws_data.pending_len;
+    }
+    int out_len = 0;
+    bool truncated = false;
+    uint8_t *spill = NULL;      /* input that had to make room for the output */
+
+    memmove(buff + capacity - in_len, buff, in_len);
+    client->stats.copied_bytes += in_len;
+    if (inflate->no_context_takeover) {
+        ws_inflate_reset(inflate);
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        const uint8_t *src = pass == 0 ? buff + capacity - in_len : deflate_tail;
+        size_t src_left = pass == 0 ? in_len : sizeof(deflate_tail);
+        tinfl_status status;
+        do {
+            size_t in_bytes = src_left;
+            size_t out_bytes = inflate->dict_size - inflate->dict_ofs;
+            status = tinfl_decompress(&inflate->decomp, src, &in_bytes, inflate->dict, inflate->dict + inflate->dict_ofs, &out_bytes, TINFL_FLAG_HAS_MORE_INPUT);
+            src += in_bytes;
+            src_left -= in_bytes;
+
+            // room up to the first byte not read yet
+            int limit = pass == 0 && spill == NULL && src_left > 0 ? src - buff : capacity;
+            if (out_len + (int)out_bytes > limit && limit < capacity) {
+                spill = malloc(src_left);
+                if (spill) {
+                    memcpy(spill, src, src_left);
+                    client->stats.copied_bytes += src_left;
+                    src = spill;
+                    limit = capacity;
+                }
+            }
+            int copy = out_bytes;
+            if (truncated || out_len + copy > limit) {
+                copy = truncated ? 0 : limit - out_len;
+                truncated = true;
+            }
+            memcpy(buff + out_len, inflate->dict + inflate->dict_ofs, copy);
+            out_len += copy;
+            client->stats.copied_bytes += copy;
+            inflate->dict_ofs = (inflate->dict_ofs + out_bytes) & (inflate->dict_size - 1);
+            client->stats.deflate_out_bytes += out_bytes;
+        } while (status == TINFL_STATUS_HAS_MORE_OUTPUT);
+
+        if (status == TINFL_STATUS_DONE) {
+            // final block, the next message starts a new stream
+            ws_inflate_reset(inflate);
+            break;
+        }
+        if (status != TINFL_STATUS_NEEDS_MORE_INPUT) {
+            ESP_LOGE(TAG, "inflate failed, status %d", status);
+            free(spill);
+            return ESP_FAIL;
+        }
+    }
+    free(spill);
+
+    client->stats.deflate_messages++;
+    client->stats.deflate_in_bytes += in_len;
+    if (truncated) {
+        ESP_LOGW(TAG, "inflated message truncated at %d bytes", out_len);
+        client->ws_data.msg_truncated = true;
+    }
+    ESP_LOGD(TAG, "inflated %d -> %d bytes", in_len, out_len);
+    *len = out_len;
+    return ESP_OK;
+}
+
+// rcv_buff has room for the handshake, ws_client_step() made sure of it
+static int ws_connect(ws_client_handle_t client) {
+    if (esp_transport_connect(client->connection_info.transport, client->connection_info.host, client->connection_info.port, client->connection_info.network_timeout_ms) < 0) {
+        ESP_LOGE(TAG, "Error connect to ther server esp_transport_connect");
+        return -1;
+    }
+
+    unsigned char random_key[16];
+    getrandom(random_key, sizeof(random_key), 0);
+
+    // Size of base64 coded string is equal '((input_size * 4) / 3) + (input_size / 96) + 6' including Z-term
+    unsigned char client_key[28] = {0};
+
+    size_t outlen = 0;
+    mbedtls_base64_encode(client_key, sizeof(client_key), &outlen, random_key, sizeof(random_key));
+
+    // ask the server to keep its window small, that is what we have to hold to inflate
+    char extensions[96] = "";
+    if (client->ws_data.inflate) {
+        int window_bits = 0;
+        while ((1 << window_bits) < client->ws_data.inflate->dict_size) window_bits++;
+        snprintf(extensions, sizeof(extensions), "Sec-WebSocket-Extensions: permessage-deflate; server_max_window_bits=%d\r\n", window_bits);
+    }
+    int len = snprintf((char *)client->ws_data.rcv_buff, client->ws_data.rcv_buff_len,
+                         "GET %s HTTP/1.1\r\n"
+                         "Connection: Upgrade\r\n"
+                         "Host: %s:%d\r\n"
+                         "Upgrade: websocket\r\n"
+                         "Sec-WebSocket-Version: 13\r\n"
+                         "Sec-WebSocket-Protocol: mqtt\r\n"
+                         "Sec-WebSocket-Key: %s\r\n"
+                         "%s"
+                         "User-Agent: ESP32 Websocket Client\r\n\r\n",
+                         client->connection_info.path,
+                         client->connection_info.host,
+                         client->connection_info.port,
+                         client_key,
+                         extensions);
+    if (len <= 0 || len >= client->ws_data.rcv_buff_len) {
+        ESP_LOGE(TAG, "Error in request generation, %d", len);
+        return -1;
+    }
+    ESP_LOGD(TAG, "Write upgrate request\r\n%s", client->ws_data.rcv_buff);
+    if (esp_transport_write(client->connection_info.transport, (char *)client->ws_data.rcv_buff, len, client->connection_info.network_timeout_ms) <= 0) {
+        ESP_LOGE(TAG, "Error write Upgrade header %s", client->ws_data.rcv_buff);
+        return -1;
+    }
+
+    // the response may arrive in pieces, parse it as it comes until the headers are complete
+    ws_upgrade_t upgrade = {0};
+    http_parser parser;
+    http_parser_settings settings;
+    http_parser_init(&parser, HTTP_RESPONSE);
+    http_parser_settings_init(&settings);
+    settings.on_header_field = ws_upgrade_on_header_field;
+    settings.on_header_value = ws_upgrade_on_header_value;
+    settings.on_headers_complete = ws_upgrade_on_headers_complete;
+    parser.data = &upgrade;
+
+    char *response = (char *)client->ws_data.rcv_buff;
+    int header_len = 0;
+    len = 0;
+    while (!upgrade.headers_complete) {
+        if (len >= client->ws_data.rcv_buff_len) {
+            ESP_LOGE(TAG, "Upgrade response larger than %d bytes", client->ws_data.rcv_buff_len);
+            return -1;
+        }
+        int rlen = esp_transport_read(client->connection_info.transport, response + len, client->ws_data.rcv_buff_len - len, client->connection_info.network_timeout_ms);
+        if (rlen <= 0) {
+            ESP_LOGE(TAG, "Error read response for Upgrade header");
+            return -1;
+        }
+        // on a successful upgrade the parser stops right behind the headers
+        int nparsed = http_parser_execute(&parser, &settings, response + len, rlen);
+        if (!upgrade.headers_complete && nparsed != rlen) {
+            ESP_LOGE(TAG, "Error parse Upgrade response: %s", http_errno_description(HTTP_PARSER_ERRNO(&parser)));
+            return -1;
+        }
+        header_len = len + nparsed;
+        len += rlen;
+    }
+    ESP_LOGD(TAG, "Upgrade response\r\n%.*s", header_len, response);
+
+    if (parser.status_code != 101) {
+        ESP_LOGE(TAG, "Upgrade refused, HTTP status %d", parser.status_code);
+        return -1;
+    }
+    if (!upgrade.upgrade_websocket || !upgrade.connection_upgrade || !parser.upgrade) {
+        ESP_LOGE(TAG, "Upgrade/Connection headers missing or invalid");
+        return -1;
+    }
+    if (upgrade.accept == NULL) {
+        ESP_LOGE(TAG, "Sec-WebSocket-Accept not found");
+        return -1;
+    }
+
+    // See mbedtls_sha1_ret() arg size
+    unsigned char expected_server_sha1[20];
+    // Size of base64 coded string see above
+    unsigned char expected_server_key[33] = {0};
+    // If you are interested, see https://tools.ietf.org/html/rfc6455
+    const char expected_server_magic[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
     unsigned char expected_server_text[sizeof(client_key) + sizeof(expected_server_magic) + 1];
     strcpy((char*)expected_server_text, (char*)client_key);
     strcat((char*)expected_server_text, expected_server_magic);
@@ -455,75 +1515,405 @@ static int ws_connect(ws_client_handle_t client) {
     mbedtls_sha1_ret(expected_server_text, key_len, expected_server_sha1);
     mbedtls_base64_encode(expected_server_key, sizeof(expected_server_key),  &outlen, expected_server_sha1, sizeof(expected_server_sha1));
     expected_server_key[ (outlen < sizeof(expected_server_key)) ? outlen : (sizeof(expected_server_key) - 1) ] = 0;
-    ESP_LOGD(TAG, "server key=%s, send_key=%s, expected_server_key=%s", (char *)server_key, (char*)client_key, expected_server_key);
-    if (strcmp((char*)expected_server_key, (char*)server_key) != 0) {
+    ESP_LOGD(TAG, "server key=%.*s, send_key=%s, expected_server_key=%s", (int)upgrade.accept_len, upgrade.accept, (char*)client_key, expected_server_key);
+    if (upgrade.accept_len != strlen((char*)expected_server_key) || memcmp(expected_server_key, upgrade.accept, upgrade.accept_len) != 0) {
         ESP_LOGE(TAG, "Invalid websocket key");
         return -1;
     }
+
+    if (ws_inflate_accept(client, upgrade.extensions, upgrade.extensions_len) != ESP_OK) {
+        return -1;
+    }
+
+    // frames the server sent right behind the response are read before the transport
+    client->ws_data.pending = client->ws_data.rcv_buff + header_len;
+    client->ws_data.pending_len = len - header_len;
+    ws_buff_shrink(client);
     return 0;
 }
 
-esp_err_t ws_client_write_data(ws_client_handle_t client, char *buff, int len)
+/*
+ * header fields and values may be handed over in several pieces when the response is
+ * split across reads. They are read one after the other into rcv_buff, so the pieces
+ * are contiguous and it is enough to remember the start and add up the lengths.
+ */
+static int ws_upgrade_on_header_field(http_parser *parser, const char *at, size_t length)
 {
-    int poll_write;
-    if ((poll_write = esp_transport_poll_write(client->connection_info.transport, client->connection_info.network_timeout_ms)) <= 0) {
-        ESP_LOGE(TAG, "socket not ready for writing");
-        return ESP_FAIL;
+    ws_upgrade_t *upgrade = parser->data;
+    if (upgrade->in_value) {
+        ws_upgrade_header_done(upgrade);
+    }
+    if (upgrade->field == NULL) {
+        upgrade->field = at;
+        upgrade->field_len = 0;
     }
+    upgrade->field_len += length;
+    return 0;
+}
 
-    ws_header_t ws_header;
-    int header_len = 2;
-    ws_header.fin = 1;
-    ws_header.opcode = 8; // binary
-    ws_header.mask = 1;
+static int ws_upgrade_on_header_value(http_parser *parser, const char *at, size_t length)
+{
+    ws_upgrade_t *upgrade = parser->data;
+    if (!upgrade->in_value) {
+        upgrade->in_value = true;
+        upgrade->value = at;
+        upgrade->value_len = 0;
+    }
+    upgrade->value_len += length;
+    return 0;
+}
 
-    if (len < 126) {
-        ws_header.payload_len = len;
-    } else if (len >= 126 && len < 0xFFFF) {
-        ws_header.payload_len = 126;
-        *(uint16_t *)&ws_header.ext_payload_len = htons(len);
-        header_len += 2;
-    } else {
-        ws_header.payload_len = 127;
-        /* TOO BIG, we don't support */
-        ESP_LOGE(TAG, "payload too big.");
+static int ws_upgrade_on_headers_complete(http_parser *parser)
+{
+    ws_upgrade_t *upgrade = parser->data;
+    if (upgrade->in_value) {
+        ws_upgrade_header_done(upgrade);
+    }
+    upgrade->headers_complete = true;
+    return 0;
+}
+
+// header names and the Upgrade/Connection tokens are case-insensitive
+static void ws_upgrade_header_done(ws_upgrade_t *upgrade)
+{
+    const char *field = upgrade->field;
+    size_t field_len = upgrade->field_len;
+    size_t value_len = trimwhitespace_len(upgrade->value, upgrade->value_len);
+
+    if (field_len == strlen("Upgrade") && strncasecmp(field, "Upgrade", field_len) == 0) {
+        upgrade->upgrade_websocket = value_len == strlen("websocket") && strncasecmp(upgrade->value, "websocket", value_len) == 0;
+    } else if (field_len == strlen("Connection") && strncasecmp(field, "Connection", field_len) == 0) {
+        upgrade->connection_upgrade = ws_token_in_list(upgrade->value, value_len, "upgrade");
+    } else if (field_len == strlen("Sec-WebSocket-Accept") && strncasecmp(field, "Sec-WebSocket-Accept", field_len) == 0) {
+        upgrade->accept = upgrade->value;
+        upgrade->accept_len = value_len;
+    } else if (field_len == strlen("Sec-WebSocket-Extensions") && strncasecmp(field, "Sec-WebSocket-Extensions", field_len) == 0) {
+        upgrade->extensions = upgrade->value;
+        upgrade->extensions_len = value_len;
+    }
+    upgrade->field = NULL;
+    upgrade->in_value = false;
+}
+
+// is token one of the comma separated entries of list, e.g. "keep-alive, Upgrade"
+static bool ws_token_in_list(const char *list, size_t list_len, const char *token)
+{
+    size_t token_len = strlen(token);
+    const char *end = list + list_len;
+
+    while (list < end) {
+        const char *comma = memchr(list, ',', end - list);
+        const char *item_end = comma ? comma : end;
+        while (list < item_end && isspace((unsigned char)*list)) list++;
+        size_t item_len = trimwhitespace_len(list, item_end - list);
+        if (item_len == token_len && strncasecmp(list, token, token_len) == 0) {
+            return true;
+        }
+        list = comma ? comma + 1 : end;
+    }
+    return false;
+}
+
+esp_err_t ws_client_write_data(ws_client_handle_t client, const char *buff, int len)
+{
+    return ws_client_send(client, 2 /* BINARY */, buff, len, client->connection_info.network_timeout_ms);
+}
+
+esp_err_t ws_client_send(ws_client_handle_t client, int opcode, const char *data, int len, int timeout_ms)
+{
+    if (client->state != WS_STATE_CONNECTED) {
+        ESP_LOGE(TAG, "Client not connected");
+        return ESP_FAIL;
+    }
+    if (client->ws_data.close_sent) {
+        ESP_LOGE(TAG, "Connection is closing");
         return ESP_FAIL;
     }
+    return ws_send_queue_add(client, opcode, (const uint8_t *)data, len, timeout_ms);
+}
+
+int ws_client_send_queue_free(ws_client_handle_t client)
+{
+    ws_send_queue_t *queue = &client->send_queue;
+    int free_len;
 
-    char mask[4] = {0};
+    xSemaphoreTake(queue->lock, portMAX_DELAY);
+    free_len = queue->size - queue->fill_len - WS_MAX_HEADER_LEN;
+    xSemaphoreGive(queue->lock);
+    return free_len > 0 ? free_len : 0;
+}
+
+static esp_err_t ws_send_queue_init(ws_client_handle_t client, int size)
+{
+    ws_send_queue_t *queue = &client->send_queue;
+
+    queue->size = size;
+    queue->fill = malloc(size);
+    queue->drain = malloc(size);
+    queue->lock = xSemaphoreCreateMutex();
+    queue->drained = xSemaphoreCreateBinary();
+    if (queue->fill == NULL || queue->drain == NULL || queue->lock == NULL || queue->drained == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+/*
+ * Mask the frame straight into the queue. A full queue means the connection doesn't keep
+ * up: wait up to timeout_ms for the ws task to drain it, then give up with ESP_ERR_TIMEOUT.
+ * The ws task itself (an event handler without dispatch task) drains it on the spot.
+ */
+static esp_err_t ws_send_queue_add(ws_client_handle_t client, int opcode, const uint8_t *data, int len, int timeout_ms)
+{
+    ws_send_queue_t *queue = &client->send_queue;
+    int frame_len = WS_MAX_HEADER_LEN + len;
+    int64_t deadline = ws_now_ms() + timeout_ms;
+    uint8_t mask[4];
+
+    if (frame_len > queue->size) {
+        ESP_LOGE(TAG, "Message of %d bytes larger than the send queue", len);
+        return ESP_ERR_INVALID_SIZE;
+    }
     getrandom(mask, 4, 0);
-    for (int i = 0; i < len; i++) {
-        buff[i] = (buff[i] ^ mask[i % 4]);
+    while (1) {
+        xSemaphoreTake(queue->lock, portMAX_DELAY);
+        if (queue->fill_len + frame_len <= queue->size) {
+            uint8_t *frame = queue->fill + queue->fill_len;
+            int header_len = ws_frame_header(frame, opcode, len, mask);
+            ws_mask_copy(frame + header_len, data, len, mask, 0);
+            queue->fill_len += header_len + len;
+            client->stats.tx_messages++;
+            xSemaphoreGive(queue->lock);
+            ws_transport_wake(client->connection_info.transport);
+            return ESP_OK;
+        }
+        xSemaphoreGive(queue->lock);
+
+        if (ws_on_network_task(client)) {
+            if (ws_send_queue_drain(client) != ESP_OK) {
+                return ESP_FAIL;
+            }
+            continue;
+        }
+        int64_t left = deadline - ws_now_ms();
+        if (left <= 0 || xSemaphoreTake(queue->drained, left / portTICK_PERIOD_MS) != pdTRUE) {
+            client->stats.tx_queue_full++;
+            return ESP_ERR_TIMEOUT;
+        }
     }
+}
 
-    if (esp_transport_write(client->connection_info.transport, (char *)&ws_header, header_len, client->connection_info.network_timeout_ms) != header_len) {
-        ESP_LOGE(TAG, "Error write header");
-        return ESP_FAIL;
+// ws task only: write everything queued so far with one transport write
+static esp_err_t ws_send_queue_drain(ws_client_handle_t client)
+{
+    ws_send_queue_t *queue = &client->send_queue;
+    uint8_t *buff;
+    int len;
+
+    if (queue->fill_len == 0) {
+        return ESP_OK;
     }
+    xSemaphoreTake(queue->lock, portMAX_DELAY);
+    buff = queue->fill;
+    len = queue->fill_len;
+    queue->fill = queue->drain;
+    queue->fill_len = 0;
+    queue->drain = buff;
+    xSemaphoreGive(queue->lock);
+    xSemaphoreGive(queue->drained);
+
+    client->stats.tx_writes++;
+    return ws_write_all(client, buff, len);
+}
 
-    if (esp_transport_write(client->connection_info.transport, mask, 4, client->connection_info.network_timeout_ms) != 4) {
-        ESP_LOGE(TAG, "Error write mask");
-        return ESP_FAIL;
+// the connection is gone, so are the frames queued for it
+static void ws_send_queue_flush(ws_client_handle_t client)
+{
+    ws_send_queue_t *queue = &client->send_queue;
+
+    xSemaphoreTake(queue->lock, portMAX_DELAY);
+    queue->fill_len = 0;
+    xSemaphoreGive(queue->lock);
+    xSemaphoreGive(queue->drained);
+}
+
+static bool ws_on_network_task(ws_client_handle_t client)
+{
+    TaskHandle_t task = client->group ? client->group->task : client->task;
+    return task == xTaskGetCurrentTaskHandle();
+}
+
+// FIN frame header with masking key, returns its length, at most WS_MAX_HEADER_LEN
+static int ws_frame_header(uint8_t *dst, int opcode, int len, const uint8_t mask[4])
+{
+    int header_len = 0;
+
+    dst[header_len++] = 0x80 | (opcode & 0x0F);    // FIN
+    if (len < 126) {
+        dst[header_len++] = 0x80 | len;
+    } else if (len <= 0xFFFF) {
+        dst[header_len++] = 0x80 | 126;
+        dst[header_len++] = (len >> 8) & 0xFF;
+        dst[header_len++] = len & 0xFF;
+    } else {
+        dst[header_len++] = 0x80 | 127;
+        for (int i = 7; i >= 0; i--) {
+            dst[header_len++] = ((uint64_t)len >> (8 * i)) & 0xFF;
+        }
     }
+    memcpy(dst + header_len, mask, 4);
+    return header_len + 4;
+}
 
+/*
+ * Build header, mask and masked payload in scratch and send them with one write, so a
+ * small frame costs one TLS record. Larger payloads follow in scratch sized chunks.
+ * The caller's data is left untouched. Writes right away, ws task only.
+ */
+static esp_err_t ws_write_frame(ws_client_handle_t client, int opcode, const uint8_t *data, int len, uint8_t *scratch, int scratch_len)
+{
+    uint8_t mask[4];
+    int header_len;
+
+    getrandom(mask, 4, 0);
+    header_len = ws_frame_header(scratch, opcode, len, mask);
+
+    int offset = 0;
+    do {
+        int chunk = len - offset < scratch_len - header_len ? len - offset : scratch_len - header_len;
+        ws_mask_copy(scratch + header_len, data + offset, chunk, mask, offset);
+        if (ws_write_all(client, scratch, header_len + chunk) != ESP_OK) {
+            return ESP_FAIL;
+        }
+        offset += chunk;
+        header_len = 0;
+    } while (offset < len);
+
+    return ESP_OK;
+}
+
+// write until everything is out, continuing after partial writes
+static esp_err_t ws_write_all(ws_client_handle_t client, const uint8_t *buff, int len)
+{
     int write_len = 0;
-    int write_tries = 0;
-    int rlen = 0;
     while (write_len < len) {
-        ESP_LOGI(TAG, "write_len(%d), len(%d)", write_len, len);
-        if ((write_tries++) > 5) {
-            ESP_LOGE(TAG, "ws_client_write_data not finished in 5 esp_transport_write()");
+        int wlen = esp_transport_write(client->connection_info.transport, (const char *)buff + write_len, len - write_len, client->connection_info.network_timeout_ms);
+        if (wlen <= 0) {
+            ESP_LOGE(TAG, "Error write data or timeout, wlen = %d", wlen);
             return ESP_FAIL;
         }
-        rlen = esp_transport_write(client->connection_info.transport, buff, len, client->connection_info.network_timeout_ms);
-        if (rlen < 0) {
-            ESP_LOGE(TAG, "Error write data or timeout, rlen = %d", rlen);
-            return ESP_FAIL;
+        write_len += wlen;
+    }
+    return ESP_OK;
+}
+
+/*
+ * Answer the server's CLOSE or fail the connection, ws task only. Nothing may be sent after
+ * it, the connection ends when the server's CLOSE arrives or the socket is closed.
+ */
+static esp_err_t ws_send_close(ws_client_handle_t client, int code)
+{
+    uint8_t frame[WS_MAX_HEADER_LEN + 2];
+    uint8_t status[2] = { code >> 8, code & 0xff };
+
+    client->ws_data.close_sent = true;
+    ws_trace(client, WS_TRACE_CLOSE, 1, 0, code);
+    // frames queued before go out first
+    ws_send_queue_drain(client);
+    return ws_write_frame(client, 8 /* CLOSE */, status, sizeof(status), frame, sizeof(frame));
+}
+
+/*
+ * The client was stopped: send what's queued, then our CLOSE, and give the server
+ * WS_CLOSE_TIMEOUT_MS to answer it before the transport is closed. Without wait it only
+ * reads what is there and returns false while the answer is still due, the group task
+ * calls it again once the socket is readable.
+ */
+static bool ws_client_finish(ws_client_handle_t client, bool wait)
+{
+    if (client->finish_until_ms == 0) {
+        if (client->state != WS_STATE_CONNECTED) {
+            return true;
         }
-        write_len += rlen;
+        if (client->ws_data.close_sent ? ws_send_queue_drain(client) != ESP_OK
+                                       : ws_send_close(client, WS_CLOSE_NORMAL) != ESP_OK) {
+            return true;
+        }
+        client->finish_until_ms = ws_now_ms() + WS_CLOSE_TIMEOUT_MS;
     }
+    while (client->ws_data.close_sent && !client->ws_data.closed) {
+        int64_t left = client->finish_until_ms - ws_now_ms();
+        if (left <= 0 || ws_process_receive(client, wait ? (int)left : 0) != ESP_OK) {
+            break;
+        }
+        if (!wait && !client->ws_data.closed) {
+            return false;
+        }
+    }
+    client->finish_until_ms = 0;
+    return true;
+}
 
-    return ESP_OK;
+// the server's CLOSE: keep status code and reason for WS_EVENT_DISCONNECTED and answer it
+static void ws_handle_close(ws_client_handle_t client, const uint8_t *payload, int len)
+{
+    ws_data_t *ws_data = &client->ws_data;
+    int reply;
+
+    if (len >= 2) {
+        ws_data->close_code = payload[0] << 8 | payload[1];
+        ws_data->close_reason_len = len - 2;
+        memcpy(ws_data->close_reason, payload + 2, len - 2);
+        reply = ws_close_code_valid(ws_data->close_code) ? ws_data->close_code : WS_CLOSE_PROTOCOL_ERROR;
+    } else {
+        // a status code is optional, but not half of one
+        ws_data->close_code = len == 0 ? WS_CLOSE_NO_STATUS : WS_CLOSE_PROTOCOL_ERROR;
+        ws_data->close_reason_len = 0;
+        reply = len == 0 ? WS_CLOSE_NORMAL : WS_CLOSE_PROTOCOL_ERROR;
+    }
+    ws_trace(client, WS_TRACE_CLOSE, 0, 0, ws_data->close_code);
+    if (!ws_data->close_sent) {
+        ws_send_close(client, reply);
+    }
+    ws_data->closed = true;
+}
+
+// codes a peer may put on the wire, 1005, 1006 and 1015 are for reporting only
+static bool ws_close_code_valid(int code)
+{
+    if (code >= 1000 && code <= 1014) {
+        return code != 1004 && code != 1005 && code != 1006;
+    }
+    return code >= 3000 && code <= 4999;
+}
+
+/*
+ * dst = src ^ mask, dst may be src. offset is the position of src[0] in the payload so a
+ * payload can be masked chunk by chunk. Bytes are done one by one until dst is aligned,
+ * then a native word at a time with the mask pre-rotated to match.
+ */
+static void ws_mask_copy(uint8_t *dst, const uint8_t *src, int len, const uint8_t mask[4], int offset)
+{
+    uint8_t rotated[sizeof(uintptr_t)];
+    uintptr_t mask_word;
+    int i = 0;
+
+    while (i < len && ((uintptr_t)(dst + i) & (sizeof(uintptr_t) - 1))) {
+        dst[i] = src[i] ^ mask[(offset + i) & 3];
+        i++;
+    }
+    for (int k = 0; k < (int)sizeof(uintptr_t); k++) {
+        rotated[k] = mask[(offset + i + k) & 3];
+    }
+    memcpy(&mask_word, rotated, sizeof(uintptr_t));
+    for (; i + (int)sizeof(uintptr_t) <= len; i += sizeof(uintptr_t)) {
+        uintptr_t word;
+        memcpy(&word, src + i, sizeof(uintptr_t));  // src may be unaligned
+        *(uintptr_t *)(dst + i) = word ^ mask_word;
+    }
+    for (; i < len; i++) {
+        dst[i] = src[i] ^ mask[(offset + i) & 3];
+    }
 }
 
 esp_err_t ws_client_destroy(ws_client_handle_t client) {
@@ -532,16 +1922,223 @@ esp_err_t ws_client_destroy(ws_client_handle_t client) {
     free(client->connection_info.path);
     free(client->connection_info.scheme);
     esp_transport_list_destroy(client->connection_info.transport_list);
+    if (client->dispatch && client->dispatch->task_running) {
+        ws_dispatch_msg_t stop = { .stop = true };
+        xEventGroupClearBits(client->status_bits, DISPATCH_STOPPED_BIT);
+        xQueueSend(client->dispatch->queue, &stop, portMAX_DELAY);
+        xEventGroupWaitBits(client->status_bits, DISPATCH_STOPPED_BIT, false, true, portMAX_DELAY);
+    }
     vEventGroupDelete(client->status_bits);
-    free(client->ws_data.rcv_buff);
+    if (client->dispatch) {
+        if (client->dispatch->queue) {
+            vQueueDelete(client->dispatch->queue);
+        }
+        free(client->dispatch);
+    }
+    if (client->group) {
+        ws_client_group_handle_t group = client->group;
+        xSemaphoreTake(group->lock, portMAX_DELAY);
+        for (int i = 0; i < group->client_count; i++) {
+            if (group->clients[i] == client) {
+                group->clients[i] = group->clients[--group->client_count];
+                break;
+            }
+        }
+        xSemaphoreGive(group->lock);
+        if (client->ws_data.rcv_buff) {
+            ws_pool_trim(client->ws_data.pool, client->ws_data.rcv_buff, &client->ws_data.rcv_buff_len, 0);
+        }
+    } else if (client->ws_data.pool) {
+        ws_pool_destroy(client->ws_data.pool);
+    }
+    free(client->send_queue.fill);
+    free(client->send_queue.drain);
+    if (client->send_queue.lock) {
+        vSemaphoreDelete(client->send_queue.lock);
+    }
+    if (client->send_queue.drained) {
+        vSemaphoreDelete(client->send_queue.drained);
+    }
+    if (client->lock) {
+        vSemaphoreDelete(client->lock);
+    }
+    if (client->ws_data.inflate) {
+        free(client->ws_data.inflate->dict);
+        free(client->ws_data.inflate);
+    }
     free(client);
     return ESP_OK;
 }
 
+ws_client_group_handle_t ws_client_group_init(const ws_client_group_config_t *config) {
+    ws_client_group_handle_t group = calloc(1, sizeof(ws_client_group_t));
+    WS_MEM_CHECK(TAG, group, return NULL);
+
+    int block_size = config->pool_block_size;
+    if (block_size <= 0) {
+        block_size = WS_POOL_BLOCK_SIZE;
+    }
+    int block_count = config->pool_block_count;
+    if (block_count <= 0) {
+        block_count = WS_GROUP_POOL_BLOCKS;
+    }
+    int task_prio = config->task_prio;
+    if (task_prio <= 0) {
+        task_prio = WS_TASK_PRIORITY;
+    }
+    int task_stack = config->task_stack;
+    if (task_stack == 0) {
+        task_stack = WS_TASK_STACK;
+    }
+    group->pool = ws_pool_init(block_size, block_count, config->pool_in_psram);
+    WS_MEM_CHECK(TAG, group->pool, goto _ws_group_init_failed);
+    group->wake = ws_transport_tcp_init();
+    WS_MEM_CHECK(TAG, group->wake, goto _ws_group_init_failed);
+    group->lock = xSemaphoreCreateMutex();
+    WS_MEM_CHECK(TAG, group->lock, goto _ws_group_init_failed);
+    group->status_bits = xEventGroupCreate();
+    WS_MEM_CHECK(TAG, group->status_bits, goto _ws_group_init_failed);
+
+    group->run = true;
+    if (xTaskCreate(ws_group_task, "ws_group", task_stack, group, task_prio, NULL) != pdTRUE) {
+        ESP_LOGE(TAG, "Error create ws group task");
+        goto _ws_group_init_failed;
+    }
+    group->task_running = true;
+    return group;
+_ws_group_init_failed:
+    ws_client_group_destroy(group);
+    return NULL;
+}
+
+esp_err_t ws_client_group_destroy(ws_client_group_handle_t group) {
+    if (group->client_count > 0) {
+        ESP_LOGE(TAG, "Group still has %d clients", group->client_count);
+        return ESP_FAIL;
+    }
+    if (group->task_running) {
+        group->run = false;
+        ws_transport_wake(group->wake);
+        xEventGroupWaitBits(group->status_bits, STOPPED_BIT, false, true, portMAX_DELAY);
+    }
+    if (group->status_bits) {
+        vEventGroupDelete(group->status_bits);
+    }
+    if (group->lock) {
+        vSemaphoreDelete(group->lock);
+    }
+    if (group->pool) {
+        ws_pool_destroy(group->pool);
+    }
+    if (group->wake) {
+        esp_transport_destroy(group->wake);
+    }
+    free(group);
+    return ESP_OK;
+}
+
+// drop the current connection and connect again, e.g. when the application stopped
+// hearing from the server. Takes effect on the next pass of the ws task.
+esp_err_t ws_client_reconnect(ws_client_handle_t client) {
+    if (!client->run) {
+        ESP_LOGW(TAG, "Client asked to reconnect, but was not started");
+        return ESP_FAIL;
+    }
+    client->reconnect = true;
+    return ESP_OK;
+}
+
+// the network is back (e.g. got an IP after roaming): retry now instead of sitting out
+// the backoff. An established connection is left alone.
+esp_err_t ws_client_wakeup(ws_client_handle_t client) {
+    if (!client->run) {
+        return ESP_FAIL;
+    }
+    xSemaphoreTake(client->lock, portMAX_DELAY);
+    client->reconnect_attempts = 0;
+    xEventGroupSetBits(client->status_bits, WAKEUP_BIT);
+    xSemaphoreGive(client->lock);
+    return ESP_OK;
+}
+
+void ws_client_get_stats(ws_client_handle_t client, ws_client_stats_t *stats) {
+    memcpy(stats, &client->stats, sizeof(ws_client_stats_t));
+}
+
+void ws_client_reset_stats(ws_client_handle_t client) {
+    memset(&client->stats, 0, sizeof(ws_client_stats_t));
+    client->stats.since_us = esp_timer_get_time();
+}
+
+void ws_client_log_stats(ws_client_handle_t client) {
+    ws_client_stats_t *stats = &client->stats;
+    int64_t elapsed_ms = (esp_timer_get_time() - stats->since_us) / 1000 + 1;
+    uint32_t frames = stats->frames ? stats->frames : 1;
+    int milli_fps = (int)(stats->frames * 1000000LL / elapsed_ms);
+
+    ESP_LOGI(TAG, "rx: %d frames in %d s (%d.%03d/s), %d payload bytes/frame, %d copied bytes/frame",
+             (int)stats->frames, (int)(elapsed_ms / 1000), milli_fps / 1000, milli_fps % 1000,
+             (int)(stats->payload_bytes / frames), (int)(stats->copied_bytes / frames));
+    ESP_LOGI(TAG, "reconnects: %d, last %d ms, avg %d ms, max %d ms",
+             (int)stats->reconnects, (int)(stats->last_reconnect_us / 1000),
+             (int)(stats->reconnects ? stats->reconnect_us / stats->reconnects / 1000 : 0),
+             (int)(stats->max_reconnect_us / 1000));
+    int used_blocks, peak_blocks;
+    ws_pool_get_usage(client->ws_data.pool, &used_blocks, &peak_blocks);
+    ESP_LOGI(TAG, "pool: %d blocks in use, peak %d, %d bytes", used_blocks, peak_blocks, ws_pool_size(client->ws_data.pool));
+    ESP_LOGI(TAG, "tx: %d messages in %d writes, queue full %d times",
+             (int)stats->tx_messages, (int)stats->tx_writes, (int)stats->tx_queue_full);
+    if (stats->truncated_messages) {
+        ESP_LOGW(TAG, "%d messages truncated", (int)stats->truncated_messages);
+    }
+    if (stats->dropped_messages) {
+        ESP_LOGW(TAG, "%d messages dropped", (int)stats->dropped_messages);
+    }
+    if (stats->deflate_messages) {
+        ESP_LOGI(TAG, "deflate: %d messages, %d -> %d bytes",
+                 (int)stats->deflate_messages, (int)stats->deflate_in_bytes, (int)stats->deflate_out_bytes);
+    }
+}
+
+// printf, not the log: it's asked for and shouldn't depend on CONFIG_WS_CLIENT_LOG_LEVEL
+void ws_client_dump_trace(ws_client_handle_t client) {
+#ifdef CONFIG_WS_CLIENT_TRACE
+    static const char *names[] = { "frame", "chunk", "message", "ping", "pong", "close", "connected", "disconnected" };
+    uint32_t head = client->trace_head;
+    uint32_t count = head < CONFIG_WS_CLIENT_TRACE_ENTRIES ? head : CONFIG_WS_CLIENT_TRACE_ENTRIES;
+
+    // entries recorded while dumping may show up torn, fine for a diagnostic
+    printf("ws trace, last %u of %u entries\n", (unsigned)count, (unsigned)head);
+    for (uint32_t i = head - count; i != head; i++) {
+        ws_trace_entry_t *entry = &client->trace[i % CONFIG_WS_CLIENT_TRACE_ENTRIES];
+        printf("%10u %-12s %02X %02X %u\n", (unsigned)entry->time_us,
+               entry->type < sizeof(names) / sizeof(names[0]) ? names[entry->type] : "?",
+               entry->b0, entry->b1, (unsigned)entry->arg);
+    }
+#else
+    printf("ws trace not enabled, see CONFIG_WS_CLIENT_TRACE\n");
+#endif
+}
+
 esp_err_t ws_client_stop(ws_client_handle_t client) {
     if (client->run) {
+        // the ws task sees it, sends the CLOSE on its way out and waits for the answer.
+        // The connection belongs to that task, only it writes close_sent and the queue
         client->run = false;
-        xEventGroupWaitBits(client->status_bits, STOPPED_BIT, false, true, portMAX_DELAY);
+        xEventGroupSetBits(client->status_bits, WAKEUP_BIT);
+        ws_transport_wake(client->connection_info.transport);
+        if (client->state == WS_STATE_INIT) {
+            // a connect or upgrade in progress would hold the ws task for network_timeout_ms.
+            // Should it have connected meanwhile, that connection goes without a CLOSE
+            ws_transport_shutdown(client->connection_info.transport);
+        }
+        EventBits_t bits = xEventGroupWaitBits(client->status_bits, STOPPED_BIT, false, true, 2 * WS_CLOSE_TIMEOUT_MS / portTICK_PERIOD_MS);
+        if (!(bits & STOPPED_BIT)) {
+            // stuck writing: pull the socket from under the ws task
+            ESP_LOGW(TAG, "ws task doesn't stop, shutting the connection down");
+            ws_transport_shutdown(client->connection_info.transport);
+            xEventGroupWaitBits(client->status_bits, STOPPED_BIT, false, true, portMAX_DELAY);
+        }
         client->state = WS_STATE_UNKNOWN;
         return ESP_OK;
     } else {
@@ -552,10 +2149,39 @@ esp_err_t ws_client_stop(ws_client_handle_t client) {
 
 static esp_err_t ws_abort_connection(ws_client_handle_t client)
 {
+    if (client->state == WS_STATE_CONNECTED) {
+        client->disconnected_us = esp_timer_get_time();
+        // a wakeup while connected had nothing to do, it mustn't skip the backoff now
+        xEventGroupClearBits(client->status_bits, WAKEUP_BIT);
+    }
     esp_transport_close(client->connection_info.transport);
+    client->ws_data.msg_len = 0;
+    client->ws_data.msg_opcode = 0;
+    client->ws_data.msg_truncated = false;
+    client->ws_data.msg_streaming = false;
+    client->ws_data.pending_len = 0;
+    client->ws_data.deflate = false;
+    client->ws_data.msg_compressed = false;
+    client->ws_data.buff_wait_until_ms = 0;
+    ws_buff_shrink(client);
+    ws_parser_reset(&client->ws_data.parser);
+    memset(&client->ws_data.ws_header, 0, sizeof(ws_header_t));
     client->state = WS_STATE_WAIT_TIMEOUT;
-    ESP_LOGI(TAG, "Reconnect after %d ms", client->connection_info.network_timeout_ms);
     client->event.event_id = WS_EVENT_DISCONNECTED;
+    client->event.ws_header = NULL;
+    if (client->ws_data.closed) {
+        client->event.close_code = client->ws_data.close_code;
+        client->event.data = client->ws_data.close_reason;
+        client->event.data_len = client->ws_data.close_reason_len;
+    } else {
+        client->event.close_code = WS_CLOSE_ABNORMAL;
+        client->event.data = NULL;
+        client->event.data_len = 0;
+    }
+    ws_trace(client, WS_TRACE_DISCONNECTED, 0, 0, client->event.close_code);
+    client->ws_data.close_sent = false;
+    client->ws_data.closed = false;
+    ws_send_queue_flush(client);
     ws_dispatch_event(client);
     return ESP_OK;
 }
@@ -565,56 +2191,255 @@ static esp_err_t ws_dispatch_event(ws_client_handle_t client)
     client->event.user_context = client->user_context;
     client->event.client = client;
 
+    if (client->dispatch) {
+        ws_dispatch_msg_t msg = {
+            .event = client->event,
+        };
+        if (client->event.ws_header) {
+            msg.ws_header = *client->event.ws_header;
+        }
+        // only data events own a buffer, whatever else data points to may change before
+        // the dispatch task gets to it
+        if (msg.event.event_id == WS_EVENT_DISCONNECTED && msg.event.data_len > 0) {
+            memcpy(msg.close_reason, msg.event.data, msg.event.data_len);
+        } else {
+            msg.event.data = NULL;
+            msg.event.data_len = 0;
+        }
+        // the group task never waits for the handler, see ws_dispatch_wait()
+        if (xQueueSend(client->dispatch->queue, &msg, client->group ? 0 : portMAX_DELAY) != pdTRUE) {
+            ESP_LOGW(TAG, "Event handler too slow, dropping event %d", msg.event.event_id);
+            client->stats.dropped_messages++;
+            return ESP_FAIL;
+        }
+        return ESP_OK;
+    }
+
     if (client->event_handle) {
         return client->event_handle(&client->event);
     }
     return ESP_FAIL;
 }
 
-static char *create_string(const char *ptr, int len)
+static esp_err_t ws_dispatch_init(ws_client_handle_t client, int queue_size)
 {
-    char *ret;
-    if (len <= 0) {
-        return NULL;
+    ws_dispatch_t *dispatch = calloc(1, sizeof(ws_dispatch_t));
+    if (dispatch == NULL) {
+        return ESP_ERR_NO_MEM;
     }
-    ret = calloc(1, len + 1);
-    WS_MEM_CHECK(TAG, ret, return NULL);
-    memcpy(ret, ptr, len);
-    return ret;
+    client->dispatch = dispatch;
+    dispatch->queue = xQueueCreate(queue_size, sizeof(ws_dispatch_msg_t));
+    if (dispatch->queue == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
 }
 
-static char *trimwhitespace(const char *str)
+/*
+ * Dispatch an event whose data is at the start of rcv_buff (a message or a streamed chunk).
+ * With a dispatch task the run goes along with the event, trimmed to the data, and the ws
+ * task carries on with a new one. A slow handler only holds up reading the socket once the
+ * pool runs dry. The group task doesn't wait for a new run then, it leaves rcv_buff NULL
+ * and the next data frame waits for blocks instead. Nor for room in the queue, the frame
+ * waited for that before it was read, see ws_dispatch_wait().
+ */
+static esp_err_t ws_dispatch_buffer(ws_client_handle_t client)
 {
-    char *end;
+    ws_data_t *ws_data = &client->ws_data;
+    int64_t deadline = ws_now_ms() + client->connection_info.network_timeout_ms;
+    uint8_t *run;
+    int run_len;
 
-    // Trim leading space
-    while (isspace((unsigned char)*str)) str++;
+    if (client->dispatch == NULL) {
+        return ws_dispatch_event(client);
+    }
+    if (client->group && uxQueueSpacesAvailable(client->dispatch->queue) == 0) {
+        // the handler hasn't made room within network_timeout_ms
+        ESP_LOGW(TAG, "Event handler too slow, dropping %d bytes", client->event.data_len);
+        client->stats.dropped_messages++;
+        return ESP_FAIL;
+    }
+    // bytes still pending in the old run have to come along
+    while ((run = ws_pool_alloc(ws_data->pool, ws_data->pending_len + 1, &run_len)) == NULL) {
+        if (client->group && ws_data->pending_len == 0) {
+            run_len = 0;
+            break;
+        }
+        if (client->group) {
+            // only right after the upgrade, the pending bytes have nowhere else to go
+            ESP_LOGW(TAG, "Pool empty, dropping %d bytes", client->event.data_len);
+            client->stats.dropped_messages++;
+            return ESP_FAIL;
+        }
+        int64_t left = deadline - ws_now_ms();
+        if (left <= 0 || ws_pool_wait(ws_data->pool, left) != ESP_OK) {
+            ESP_LOGW(TAG, "Event handler too slow, dropping %d bytes", client->event.data_len);
+            client->stats.dropped_messages++;
+            return ESP_FAIL;
+        }
+    }
 
-    if (*str == 0) {
-        return (char *)str;
+    ws_dispatch_msg_t msg = {
+        .event = client->event,
+        .ws_header = ws_data->ws_header,
+        .buff = ws_data->rcv_buff,
+        .buff_len = ws_data->rcv_buff_len,
+    };
+    msg.event.user_context = client->user_context;
+    msg.event.client = client;
+    if (ws_data->pending_len > 0) {
+        // at the end of the run, ws_read() relies on the parser writing behind them
+        uint8_t *pending = run + run_len - ws_data->pending_len;
+        memcpy(pending, ws_data->pending, ws_data->pending_len);
+        ws_data->pending = pending;
+        client->stats.copied_bytes += ws_data->pending_len;
     }
+    ws_pool_trim(ws_data->pool, msg.buff, &msg.buff_len, msg.event.data_len + 1);
+    ws_data->rcv_buff = run;
+    ws_data->rcv_buff_len = run_len;
+    // the group task is the only one to fill the queue, there still is room
+    xQueueSend(client->dispatch->queue, &msg, client->group ? 0 : portMAX_DELAY);
+    return ESP_OK;
+}
 
-    // Trim trailing space
-    end = (char *)(str + strlen(str) - 1);
-    while (end > str && isspace((unsigned char)*end)) end--;
+/*
+ * Group task: a data frame is read only once the dispatch queue has room for what it
+ * may hand out, a slow handler of one client must not hold up the others. ESP_OK when
+ * there is room (or no need for it), ESP_ERR_TIMEOUT to try again later, ESP_FAIL once
+ * network_timeout_ms has passed: the frame is read all the same and what it brings is
+ * dropped, ws_dispatch_buffer() counts it.
+ */
+static esp_err_t ws_dispatch_wait(ws_client_handle_t client)
+{
+    ws_data_t *ws_data = &client->ws_data;
 
-    // Write new null terminator
-    *(end + 1) = 0;
+    if (client->group == NULL || client->dispatch == NULL || uxQueueSpacesAvailable(client->dispatch->queue) > 0) {
+        return ESP_OK;
+    }
+    if (ws_data->buff_wait_until_ms == 0) {
+        ws_data->buff_wait_until_ms = ws_now_ms() + client->connection_info.network_timeout_ms;
+    }
+    if (ws_now_ms() < ws_data->buff_wait_until_ms) {
+        return ESP_ERR_TIMEOUT;
+    }
+    ws_data->buff_wait_until_ms = 0;
+    return ESP_FAIL;
+}
 
-    return (char *)str;
+/*
+ * Make rcv_buff at least len bytes, growing the run in place or moving what it holds (the
+ * message so far and pending bytes) to a bigger one. Pending bytes keep their offset, so
+ * the run is never smaller than what they need. When wait is set and blocks can come back
+ * (from a dispatch task, or from the other clients of a group), wait up to
+ * network_timeout_ms for them. The group task can't wait: it gets ESP_ERR_TIMEOUT and
+ * asks again later, until that time is up.
+ */
+static esp_err_t ws_buff_reserve(ws_client_handle_t client, int len, bool wait)
+{
+    ws_data_t *ws_data = &client->ws_data;
+    int64_t deadline = ws_now_ms() + client->connection_info.network_timeout_ms;
+    uint8_t *run;
+    int run_len;
+
+    if (len > ws_data->buff_limit) {
+        return ESP_FAIL;
+    }
+    if (ws_data->pending_len > 0 && ws_data->pending - ws_data->rcv_buff + ws_data->pending_len > len) {
+        len = ws_data->pending - ws_data->rcv_buff + ws_data->pending_len;
+    }
+    while (ws_data->rcv_buff == NULL || !ws_pool_extend(ws_data->pool, ws_data->rcv_buff, &ws_data->rcv_buff_len, len)) {
+        run = ws_pool_alloc(ws_data->pool, len, &run_len);
+        if (run) {
+            if (ws_data->rcv_buff) {
+                memcpy(run, ws_data->rcv_buff, ws_data->msg_len);
+                client->stats.copied_bytes += ws_data->msg_len;
+                if (ws_data->pending_len > 0) {
+                    int offset = ws_data->pending - ws_data->rcv_buff;
+                    memcpy(run + offset, ws_data->pending, ws_data->pending_len);
+                    ws_data->pending = run + offset;
+                    client->stats.copied_bytes += ws_data->pending_len;
+                }
+                ws_pool_trim(ws_data->pool, ws_data->rcv_buff, &ws_data->rcv_buff_len, 0);
+            }
+            ws_data->rcv_buff = run;
+            ws_data->rcv_buff_len = run_len;
+            break;
+        }
+        if (!wait || (client->dispatch == NULL && client->group == NULL)) {
+            return ESP_FAIL;
+        }
+        if (client->group) {
+            if (ws_data->buff_wait_until_ms == 0) {
+                ws_data->buff_wait_until_ms = ws_now_ms() + client->connection_info.network_timeout_ms;
+            }
+            return ws_now_ms() < ws_data->buff_wait_until_ms ? ESP_ERR_TIMEOUT : ESP_FAIL;
+        }
+        int64_t left = deadline - ws_now_ms();
+        if (left <= 0 || ws_pool_wait(ws_data->pool, left) != ESP_OK) {
+            return ESP_FAIL;
+        }
+    }
+    ws_data->buff_wait_until_ms = 0;
+    return ESP_OK;
 }
 
-static char *get_http_header(const char *buffer, const char *key)
+// give back the blocks rcv_buff doesn't need for the message so far and pending bytes
+static void ws_buff_shrink(ws_client_handle_t client)
 {
-    char *found = strstr(buffer, key);
-    if (found) {
-        found += strlen(key);
-        char *found_end = strstr(found, "\r\n");
-        if (found_end) {
-            found_end[0] = 0;//terminal string
+    ws_data_t *ws_data = &client->ws_data;
+    int keep_len = ws_data->msg_len + 1;
+
+    if (ws_data->rcv_buff == NULL) {
+        return;
+    }
+    if (ws_data->pending_len > 0 && ws_data->pending - ws_data->rcv_buff + ws_data->pending_len > keep_len) {
+        keep_len = ws_data->pending - ws_data->rcv_buff + ws_data->pending_len;
+    }
+    ws_pool_trim(ws_data->pool, ws_data->rcv_buff, &ws_data->rcv_buff_len, keep_len);
+}
+
+static void ws_dispatch_task(void *pv)
+{
+    ws_client_handle_t client = (ws_client_handle_t)pv;
+    ws_dispatch_t *dispatch = client->dispatch;
+    ws_dispatch_msg_t msg;
 
-            return trimwhitespace(found);
+    while (xQueueReceive(dispatch->queue, &msg, portMAX_DELAY) == pdTRUE) {
+        if (msg.stop) {
+            break;
+        }
+        if (msg.event.ws_header) {
+            msg.event.ws_header = &msg.ws_header;
+        }
+        if (msg.event.event_id == WS_EVENT_DISCONNECTED && msg.event.data_len > 0) {
+            msg.event.data = msg.close_reason;
+        }
+        if (client->event_handle) {
+            client->event_handle(&msg.event);
+        }
+        if (msg.buff) {
+            ws_pool_trim(client->ws_data.pool, msg.buff, &msg.buff_len, 0);
         }
     }
-    return NULL;
-}
\ No newline at end of file
+    xEventGroupSetBits(client->status_bits, DISPATCH_STOPPED_BIT);
+    vTaskDelete(NULL);
+}
+
+static char *create_string(const char *ptr, int len)
+{
+    char *ret;
+    if (len <= 0) {
+        return NULL;
+    }
+    ret = calloc(1, len + 1);
+    WS_MEM_CHECK(TAG, ret, return NULL);
+    memcpy(ret, ptr, len);
+    return ret;
+}
+
+// length of str without trailing whitespace
+static size_t trimwhitespace_len(const char *str, size_t len)
+{
+    while (len > 0 && isspace((unsigned char)str[len - 1])) len--;
+    return len;
+}
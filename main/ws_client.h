@@ -12,6 +12,7 @@ extern "C" {
 #define WS_CLIENT_ENABLE_WSS        CONFIG_ESP_HTTP_CLIENT_ENABLE_HTTPS
 
 typedef struct ws_client* ws_client_handle_t;
+typedef struct ws_client_group* ws_client_group_handle_t;
 
 /* header without masking-key(4 bytes) */
 typedef struct ws_header
@@ -30,10 +31,24 @@ typedef enum {
     WS_EVENT_ERROR = 0,
     WS_EVENT_CONNECTED,          /*!< connected event, additional context: session_present flag */
     WS_EVENT_DISCONNECTED,       /*!< disconnected event */
-    WS_EVENT_DATA,               /*!< data event */
-    WS_EVENT_DATA_FIN,           /*!< data event, for fragment, use out_buffer together */
+    WS_EVENT_DATA,               /*!< data event, a frame or chunk of a message too large to assemble, only with stream_large_messages */
+    WS_EVENT_DATA_FIN,           /*!< data event, complete message with all fragments assembled */
 } ws_event_id_t;
 
+/* CLOSE status codes, RFC 6455 7.4.1 */
+typedef enum {
+    WS_CLOSE_NORMAL = 1000,
+    WS_CLOSE_GOING_AWAY = 1001,
+    WS_CLOSE_PROTOCOL_ERROR = 1002,
+    WS_CLOSE_UNSUPPORTED_DATA = 1003,
+    WS_CLOSE_NO_STATUS = 1005,           /*!< the server's CLOSE had no status code */
+    WS_CLOSE_ABNORMAL = 1006,            /*!< connection lost without a CLOSE */
+    WS_CLOSE_INVALID_DATA = 1007,
+    WS_CLOSE_POLICY_VIOLATION = 1008,
+    WS_CLOSE_MESSAGE_TOO_BIG = 1009,
+    WS_CLOSE_INTERNAL_ERROR = 1011,
+} ws_close_code_t;
+
 /**
  * WS event configuration structure
  */
@@ -42,12 +57,36 @@ typedef struct {
     ws_client_handle_t client;    /*!< WS client handle for this event */
     void *user_context;           /*!< User context passed from WS client config */
     ws_header_t *ws_header;       /*!< WS header */
-    uint8_t *data;                /*!< Data asociated with this event */
+    uint8_t *data;                /*!< Data asociated with this event, points into the WS receive buffer and is only valid during the callback. NUL terminated for WS_EVENT_DATA_FIN */
     int data_len;                 /*!< Lenght of the data for this event */
+    uint64_t payload_len;         /*!< Total payload length of the frame (WS_EVENT_DATA) or message (WS_EVENT_DATA_FIN) */
+    uint64_t payload_offset;      /*!< Offset of data within the payload, non zero for streamed chunks */
+    int opcode;                   /*!< Opcode of the message, 1 TEXT or 2 BINARY, ws_header->opcode is 0 for its continuation frames */
+    bool truncated;               /*!< WS_EVENT_DATA_FIN: the message, or what it inflated to, didn't fit buffer_size and data holds only its start */
+    int close_code;               /*!< WS_EVENT_DISCONNECTED: status code of the server's CLOSE, data holds its reason. WS_CLOSE_ABNORMAL without one */
 } ws_event_t;
 
 typedef esp_err_t (* ws_event_callback_t)(ws_event_t *event);
 
+typedef struct ws_client_stats {
+    int64_t since_us;                       /*!< when counting started, esp_timer_get_time() */
+    uint32_t frames;                        /*!< frames received, data and control */
+    uint64_t payload_bytes;                 /*!< their payload */
+    uint64_t copied_bytes;                  /*!< bytes moved again after being read off the transport */
+    uint32_t truncated_messages;            /*!< messages cut short to fit buffer_size, before or after inflating */
+    uint32_t dropped_messages;              /*!< messages and chunks the event handler never got, no room to hand them over */
+    uint32_t tx_messages;                   /*!< messages queued for sending */
+    uint32_t tx_writes;                     /*!< transport writes they took, several queued messages go out in one */
+    uint32_t tx_queue_full;                 /*!< sends that timed out on a full queue */
+    uint32_t reconnects;                    /*!< connections made after losing one */
+    int64_t reconnect_us;                   /*!< total time from losing a connection to the next WS_EVENT_CONNECTED */
+    int64_t last_reconnect_us;
+    int64_t max_reconnect_us;
+    uint32_t deflate_messages;              /*!< compressed messages received */
+    uint64_t deflate_in_bytes;              /*!< their size on the wire */
+    uint64_t deflate_out_bytes;             /*!< their size inflated */
+} ws_client_stats_t;
+
 typedef struct {
     ws_event_callback_t event_handle;       /*!< handle for WS events */
     const char *uri;                        /*!< Complete WS URI */
@@ -55,20 +94,64 @@ typedef struct {
     void *user_context;                     /*!< pass user context to this option, then can receive that context in ``event->user_context`` */
     int task_prio;                          /*!< WS task priority, default is 5, can be changed in ``make menuconfig`` */
     int task_stack;                         /*!< WS task stack size, default is 6144 bytes, can be changed in ``make menuconfig`` */
-    int buffer_size;                        /*!< size of WS send/receive buffer*/
-    uint8_t *out_buffer;
-    int out_buffer_size;
+    int buffer_size;                        /*!< largest WS receive buffer, largest message that can be assembled is buffer_size - 1 */
+    bool stream_large_messages;             /*!< hand out messages that don't fit the receive buffer as WS_EVENT_DATA chunks instead of reconnecting, no WS_EVENT_DATA_FIN is sent for them */
+    int ping_interval_ms;                   /*!< send a PING after this long without anything from the server, default is 10000, -1 to disable */
+    int pong_timeout_ms;                    /*!< reconnect when the server stays silent this long after a PING, default is 5000 */
+    bool permessage_deflate;                /*!< offer permessage-deflate, compressed messages are inflated in place before WS_EVENT_DATA_FIN, the inflated message has to fit buffer_size */
+    int deflate_window_bits;                /*!< LZ77 window the server may use, 9..15, default is 10. Costs 1 << deflate_window_bits bytes plus an 11KB inflater */
+    int dispatch_queue_size;                /*!< 0: event handler runs in the WS task. > 0: it runs in its own task, up to this many messages are queued to it, holding their pool blocks until handled, so the WS task keeps reading while the handler works */
+    int pool_block_size;                    /*!< receive buffers are runs of blocks of this size from one pool, default is 512 */
+    int pool_block_count;                   /*!< blocks in the pool, default is enough for a buffer_size message per buffer in flight */
+    bool pool_in_psram;                     /*!< allocate the pool in PSRAM if there is any */
+    int send_queue_size;                    /*!< bytes of outgoing frames that can be queued, bounds the largest message that can be sent, default is 1024 */
+    ws_client_group_handle_t group;         /*!< serve this client from the group's task and buffer pool instead of its own, task_* and pool_* are then ignored */
     const char *cert_pem;                   /*!< Pointer to certificate data in PEM format for server verify (with SSL), default is NULL, not required to verify the server */
     const char *client_cert_pem;            /*!< Pointer to certificate data in PEM format for SSL mutual authentication, default is NULL, not required if mutual authentication is not needed. If it is not NULL, also `client_key_pem` has to be provided. */
     const char *client_key_pem;             /*!< Pointer to private key data in PEM format for SSL mutual authentication, default is NULL, not required if mutual authentication is not needed. If it is not NULL, also `client_cert_pem` has to be provided. */
 } ws_client_config_t;
 
+typedef struct {
+    int task_prio;                          /*!< group task priority, default is 5 */
+    int task_stack;                         /*!< group task stack size, default is 4096 bytes, it runs every client's TLS handshake */
+    int pool_block_size;                    /*!< receive buffer pool shared by the clients, default is 512 */
+    int pool_block_count;                   /*!< default is 20 */
+    bool pool_in_psram;                     /*!< allocate the pool in PSRAM if there is any */
+} ws_client_group_config_t;
+
+/*
+ * Clients created with a group don't get a task of their own: one group task services up
+ * to 4 of them, waiting in select() on all their sockets, and their messages share one
+ * buffer pool. A client short of pool blocks, or whose dispatch queue is full, waits up
+ * to network_timeout_ms for them without holding up the others, then drops the message
+ * (dropped_messages in its stats). Start, stop and destroy the clients as usual, destroy
+ * them before the group.
+ */
+ws_client_group_handle_t ws_client_group_init(const ws_client_group_config_t *config);
+esp_err_t ws_client_group_destroy(ws_client_group_handle_t group);
+
 ws_client_handle_t ws_client_init(const ws_client_config_t *config);
 esp_err_t ws_client_start(ws_client_handle_t client);
 esp_err_t ws_client_stop(ws_client_handle_t client);
 esp_err_t ws_client_destroy(ws_client_handle_t client);
+esp_err_t ws_client_reconnect(ws_client_handle_t client);
+esp_err_t ws_client_wakeup(ws_client_handle_t client);
+void ws_client_get_stats(ws_client_handle_t client, ws_client_stats_t *stats);
+void ws_client_reset_stats(ws_client_handle_t client);
+void ws_client_log_stats(ws_client_handle_t client);
+/* print the frame trace ring, CONFIG_WS_CLIENT_TRACE */
+void ws_client_dump_trace(ws_client_handle_t client);
 
-esp_err_t ws_client_write_data(ws_client_handle_t client, char *buff, int len);
+/*
+ * Messages are queued and sent by the ws task, from any task. A send waits up to timeout_ms
+ * while the queue is full and fails with ESP_ERR_TIMEOUT if it stays full: the connection
+ * doesn't keep up, back off. Queued messages are dropped if the connection is lost.
+ */
+esp_err_t ws_client_send(ws_client_handle_t client, int opcode, const char *data, int len, int timeout_ms);
+/* BINARY message, waits up to the network timeout */
+esp_err_t ws_client_write_data(ws_client_handle_t client, const char *buff, int len);
+/* largest message that can be queued right now without waiting */
+int ws_client_send_queue_free(ws_client_handle_t client);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,165 @@
+#include "ws_pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+static const char *TAG = "WS_POOL";
+
+typedef struct ws_pool {
+    uint8_t *mem;
+    int block_size;
+    int block_count;
+    uint8_t *used;              /* one flag per block */
+    int used_blocks;
+    int peak_blocks;
+    SemaphoreHandle_t lock;
+    SemaphoreHandle_t freed;    /* given whenever blocks are given back */
+} ws_pool_t;
+
+#define WS_POOL_BLOCKS(pool, len)   (((len) + (pool)->block_size - 1) / (pool)->block_size)
+#define WS_POOL_INDEX(pool, ptr)    ((int)((ptr) - (pool)->mem) / (pool)->block_size)
+
+static void ws_pool_mark(ws_pool_t *pool, int first, int count, uint8_t used);
+
+ws_pool_handle_t ws_pool_init(int block_size, int block_count, bool psram)
+{
+    ws_pool_t *pool = calloc(1, sizeof(ws_pool_t));
+    if (pool == NULL) {
+        return NULL;
+    }
+    // word aligned blocks, the masking kernel likes that
+    pool->block_size = (block_size + 3) & ~3;
+    pool->block_count = block_count;
+    if (psram) {
+        pool->mem = heap_caps_malloc(pool->block_size * block_count, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (pool->mem == NULL) {
+            ESP_LOGW(TAG, "No PSRAM for %d bytes, using internal RAM", pool->block_size * block_count);
+        }
+    }
+    if (pool->mem == NULL) {
+        pool->mem = malloc(pool->block_size * block_count);
+    }
+    pool->used = calloc(block_count, 1);
+    pool->lock = xSemaphoreCreateMutex();
+    pool->freed = xSemaphoreCreateBinary();
+    if (pool->mem == NULL || pool->used == NULL || pool->lock == NULL || pool->freed == NULL) {
+        ws_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void ws_pool_destroy(ws_pool_handle_t pool)
+{
+    if (pool->lock) {
+        vSemaphoreDelete(pool->lock);
+    }
+    if (pool->freed) {
+        vSemaphoreDelete(pool->freed);
+    }
+    free(pool->used);
+    free(pool->mem);
+    free(pool);
+}
+
+int ws_pool_size(ws_pool_handle_t pool)
+{
+    return pool->block_size * pool->block_count;
+}
+
+static void ws_pool_mark(ws_pool_t *pool, int first, int count, uint8_t used)
+{
+    memset(pool->used + first, used, count);
+    pool->used_blocks += used ? count : -count;
+    if (pool->used_blocks > pool->peak_blocks) {
+        pool->peak_blocks = pool->used_blocks;
+    }
+}
+
+// first fit
+uint8_t *ws_pool_alloc(ws_pool_handle_t pool, int len, int *run_len)
+{
+    int need = WS_POOL_BLOCKS(pool, len > 0 ? len : 1);
+    uint8_t *run = NULL;
+
+    xSemaphoreTake(pool->lock, portMAX_DELAY);
+    for (int first = 0, free_blocks = 0; first + free_blocks < pool->block_count; ) {
+        if (pool->used[first + free_blocks]) {
+            first += free_blocks + 1;
+            free_blocks = 0;
+            continue;
+        }
+        if (++free_blocks == need) {
+            ws_pool_mark(pool, first, need, 1);
+            run = pool->mem + first * pool->block_size;
+            *run_len = need * pool->block_size;
+            break;
+        }
+    }
+    xSemaphoreGive(pool->lock);
+    return run;
+}
+
+bool ws_pool_extend(ws_pool_handle_t pool, uint8_t *run, int *run_len, int len)
+{
+    int first = WS_POOL_INDEX(pool, run);
+    int have = *run_len / pool->block_size;
+    int need = WS_POOL_BLOCKS(pool, len);
+    bool extended = true;
+
+    if (need <= have) {
+        return true;
+    }
+    xSemaphoreTake(pool->lock, portMAX_DELAY);
+    if (first + need > pool->block_count) {
+        extended = false;
+    }
+    for (int i = first + have; extended && i < first + need; i++) {
+        if (pool->used[i]) {
+            extended = false;
+        }
+    }
+    if (extended) {
+        ws_pool_mark(pool, first + have, need - have, 1);
+        *run_len = need * pool->block_size;
+    }
+    xSemaphoreGive(pool->lock);
+    return extended;
+}
+
+void ws_pool_trim(ws_pool_handle_t pool, uint8_t *run, int *run_len, int keep_len)
+{
+    int first = WS_POOL_INDEX(pool, run);
+    int have = *run_len / pool->block_size;
+    int keep = WS_POOL_BLOCKS(pool, keep_len);
+
+    if (keep >= have) {
+        return;
+    }
+    xSemaphoreTake(pool->lock, portMAX_DELAY);
+    ws_pool_mark(pool, first + keep, have - keep, 0);
+    xSemaphoreGive(pool->lock);
+    *run_len = keep * pool->block_size;
+    xSemaphoreGive(pool->freed);
+}
+
+esp_err_t ws_pool_wait(ws_pool_handle_t pool, int timeout_ms)
+{
+    if (xSemaphoreTake(pool->freed, timeout_ms / portTICK_PERIOD_MS) != pdTRUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+    return ESP_OK;
+}
+
+void ws_pool_get_usage(ws_pool_handle_t pool, int *used_blocks, int *peak_blocks)
+{
+    xSemaphoreTake(pool->lock, portMAX_DELAY);
+    *used_blocks = pool->used_blocks;
+    *peak_blocks = pool->peak_blocks;
+    xSemaphoreGive(pool->lock);
+}
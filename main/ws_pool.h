@@ -0,0 +1,39 @@
+#ifndef _WS_POOL_H_
+#define _WS_POOL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ws_pool* ws_pool_handle_t;
+
+/*
+ * Fixed-block pool for WebSocket messages. A message takes a run of adjacent blocks so it
+ * stays one contiguous buffer, runs grow block by block as fragments arrive and go back
+ * to the pool once the message has been handled. Lengths are in bytes and rounded up to
+ * whole blocks. Safe to use from the WS task and the dispatch task at the same time.
+ */
+ws_pool_handle_t ws_pool_init(int block_size, int block_count, bool psram);
+void ws_pool_destroy(ws_pool_handle_t pool);
+int ws_pool_size(ws_pool_handle_t pool);
+
+/* new run of at least len bytes, NULL if no such run is free. *run_len is set to its size */
+uint8_t *ws_pool_alloc(ws_pool_handle_t pool, int len, int *run_len);
+/* grow the run in place to at least len bytes, false if the blocks behind it are taken */
+bool ws_pool_extend(ws_pool_handle_t pool, uint8_t *run, int *run_len, int len);
+/* give back all blocks of the run past keep_len bytes, keep_len 0 frees the whole run */
+void ws_pool_trim(ws_pool_handle_t pool, uint8_t *run, int *run_len, int keep_len);
+/* wait until blocks are given back, ESP_ERR_TIMEOUT if none were within timeout_ms */
+esp_err_t ws_pool_wait(ws_pool_handle_t pool, int timeout_ms);
+
+void ws_pool_get_usage(ws_pool_handle_t pool, int *used_blocks, int *peak_blocks);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
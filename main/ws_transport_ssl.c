@@ -0,0 +1,568 @@
+#include "sdkconfig.h"
+#ifdef CONFIG_WS_CLIENT_LOG_LEVEL
+#define LOG_LOCAL_LEVEL CONFIG_WS_CLIENT_LOG_LEVEL
+#endif
+#include "ws_transport_ssl.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/net_sockets.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/pk.h"
+
+static const char *TAG = "WS_TRANSPORT_SSL";
+
+/* a connect on a shared wake socket checks for ws_transport_shutdown() this often */
+#define SSL_ABORT_POLL_MS   100
+
+typedef struct {
+    mbedtls_ssl_context ssl;
+    mbedtls_ssl_config conf;
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context ctr_drbg;
+    mbedtls_x509_crt cacert;
+    mbedtls_x509_crt clientcert;
+    mbedtls_pk_context clientkey;
+    mbedtls_net_context fd;
+    mbedtls_ssl_session session;    /* session of the last connection, offered on the next */
+    bool has_session;
+    bool plain;                     /* ws:// connection, no TLS on top of the socket */
+    int wake_fd;                    /* UDP socket on loopback, a datagram to it ends a poll */
+    bool wake_shared;               /* wake_fd is another transport's, whoever selects on it drains it */
+    volatile bool aborted;          /* ws_transport_shutdown() was called, until the next close */
+    struct sockaddr_in wake_addr;
+    bool configured;                /* conf, rng and certificates are set up, once */
+    bool ssl_ready;                 /* ssl context is set up for the current connection */
+    const char *cert_pem;
+    int cert_len;
+    const char *client_cert_pem;
+    int client_cert_len;
+    const char *client_key_pem;
+    int client_key_len;
+    ws_transport_ssl_stats_t stats;
+} transport_ssl_t;
+
+static int ssl_configure(transport_ssl_t *ssl);
+static void ssl_wake_init(transport_ssl_t *ssl);
+static int ssl_tcp_connect(transport_ssl_t *ssl, const char *host, int port, int timeout_ms);
+static int ssl_connect_wait(transport_ssl_t *ssl, const struct sockaddr *addr, socklen_t addr_len, int timeout_ms);
+static void ssl_ms_to_timeval(int timeout_ms, struct timeval *tv);
+static int ssl_connect(esp_transport_handle_t t, const char *host, int port, int timeout_ms);
+static int ssl_read(esp_transport_handle_t t, char *buffer, int len, int timeout_ms);
+static int ssl_write(esp_transport_handle_t t, const char *buffer, int len, int timeout_ms);
+static int ssl_poll_read(esp_transport_handle_t t, int timeout_ms);
+static int ssl_poll_write(esp_transport_handle_t t, int timeout_ms);
+static int ssl_close(esp_transport_handle_t t);
+static int ssl_destroy(esp_transport_handle_t t);
+
+static esp_transport_handle_t ws_transport_create(bool plain)
+{
+    esp_transport_handle_t t = esp_transport_init();
+    if (t == NULL) {
+        return NULL;
+    }
+    transport_ssl_t *ssl = calloc(1, sizeof(transport_ssl_t));
+    if (ssl == NULL) {
+        esp_transport_destroy(t);
+        return NULL;
+    }
+    mbedtls_ssl_config_init(&ssl->conf);
+    mbedtls_entropy_init(&ssl->entropy);
+    mbedtls_ctr_drbg_init(&ssl->ctr_drbg);
+    mbedtls_x509_crt_init(&ssl->cacert);
+    mbedtls_x509_crt_init(&ssl->clientcert);
+    mbedtls_pk_init(&ssl->clientkey);
+    mbedtls_net_init(&ssl->fd);
+    mbedtls_ssl_session_init(&ssl->session);
+    ssl->plain = plain;
+    ssl_wake_init(ssl);
+
+    esp_transport_set_context_data(t, ssl);
+    esp_transport_set_func(t, ssl_connect, ssl_read, ssl_write, ssl_close, ssl_poll_read, ssl_poll_write, ssl_destroy);
+    return t;
+}
+
+esp_transport_handle_t ws_transport_ssl_init()
+{
+    return ws_transport_create(false);
+}
+
+esp_transport_handle_t ws_transport_tcp_init()
+{
+    return ws_transport_create(true);
+}
+
+// pem data is referenced, not copied, and must stay valid. len excludes the NUL
+void ws_transport_ssl_set_cert_data(esp_transport_handle_t t, const char *data, int len)
+{
+    transport_ssl_t *ssl = esp_transport_get_context_data(t);
+    ssl->cert_pem = data;
+    ssl->cert_len = len + 1;
+}
+
+void ws_transport_ssl_set_client_cert_data(esp_transport_handle_t t, const char *data, int len)
+{
+    transport_ssl_t *ssl = esp_transport_get_context_data(t);
+    ssl->client_cert_pem = data;
+    ssl->client_cert_len = len + 1;
+}
+
+void ws_transport_ssl_set_client_key_data(esp_transport_handle_t t, const char *data, int len)
+{
+    transport_ssl_t *ssl = esp_transport_get_context_data(t);
+    ssl->client_key_pem = data;
+    ssl->client_key_len = len + 1;
+}
+
+void ws_transport_ssl_clear_session(esp_transport_handle_t t)
+{
+    transport_ssl_t *ssl = esp_transport_get_context_data(t);
+    mbedtls_ssl_session_free(&ssl->session);
+    mbedtls_ssl_session_init(&ssl->session);
+    ssl->has_session = false;
+}
+
+void ws_transport_ssl_get_stats(esp_transport_handle_t t, ws_transport_ssl_stats_t *stats)
+{
+    transport_ssl_t *ssl = esp_transport_get_context_data(t);
+    memcpy(stats, &ssl->stats, sizeof(ws_transport_ssl_stats_t));
+}
+
+// the socket stays open, the task using it still closes the transport as usual. A connect
+// in progress, or one about to start, fails at once
+void ws_transport_shutdown(esp_transport_handle_t t)
+{
+    transport_ssl_t *ssl = esp_transport_get_context_data(t);
+    int fd = ssl->fd.fd;
+
+    ssl->aborted = true;
+    if (fd >= 0) {
+        shutdown(fd, SHUT_RDWR);
+    }
+    ws_transport_wake(t);
+}
+
+int ws_transport_get_fd(esp_transport_handle_t t)
+{
+    transport_ssl_t *ssl = esp_transport_get_context_data(t);
+    return ssl->fd.fd;
+}
+
+int ws_transport_get_wake_fd(esp_transport_handle_t t)
+{
+    transport_ssl_t *ssl = esp_transport_get_context_data(t);
+    return ssl->wake_fd;
+}
+
+void ws_transport_share_wake(esp_transport_handle_t t, esp_transport_handle_t owner)
+{
+    transport_ssl_t *ssl = esp_transport_get_context_data(t);
+    transport_ssl_t *from = esp_transport_get_context_data(owner);
+
+    if (ssl->wake_fd >= 0 && !ssl->wake_shared) {
+        close(ssl->wake_fd);
+    }
+    ssl->wake_fd = from->wake_fd;
+    ssl->wake_addr = from->wake_addr;
+    ssl->wake_shared = true;
+}
+
+void ws_transport_wake(esp_transport_handle_t t)
+{
+    transport_ssl_t *ssl = esp_transport_get_context_data(t);
+
+    if (ssl->wake_fd >= 0) {
+        sendto(ssl->wake_fd, "", 1, 0, (struct sockaddr *)&ssl->wake_addr, sizeof(ssl->wake_addr));
+    }
+}
+
+// like esp_http_server's control socket, lwip has nothing lighter that select() can wait on
+static void ssl_wake_init(transport_ssl_t *ssl)
+{
+    socklen_t addr_len = sizeof(ssl->wake_addr);
+
+    ssl->wake_addr.sin_family = AF_INET;
+    ssl->wake_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ssl->wake_addr.sin_port = 0;
+    ssl->wake_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (ssl->wake_fd < 0) {
+        ESP_LOGW(TAG, "No wake socket, queued frames wait for the next poll timeout");
+        return;
+    }
+    if (bind(ssl->wake_fd, (struct sockaddr *)&ssl->wake_addr, sizeof(ssl->wake_addr)) != 0
+        || getsockname(ssl->wake_fd, (struct sockaddr *)&ssl->wake_addr, &addr_len) != 0) {
+        ESP_LOGW(TAG, "Failed to bind wake socket, errno %d", errno);
+        close(ssl->wake_fd);
+        ssl->wake_fd = -1;
+    }
+}
+
+static int ssl_configure(transport_ssl_t *ssl)
+{
+    int ret;
+
+    if ((ret = mbedtls_ctr_drbg_seed(&ssl->ctr_drbg, mbedtls_entropy_func, &ssl->entropy, NULL, 0)) != 0) {
+        ESP_LOGE(TAG, "mbedtls_ctr_drbg_seed returned -0x%x", -ret);
+        return -1;
+    }
+    if ((ret = mbedtls_ssl_config_defaults(&ssl->conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT)) != 0) {
+        ESP_LOGE(TAG, "mbedtls_ssl_config_defaults returned -0x%x", -ret);
+        return -1;
+    }
+    if (ssl->cert_pem) {
+        if ((ret = mbedtls_x509_crt_parse(&ssl->cacert, (const unsigned char *)ssl->cert_pem, ssl->cert_len)) < 0) {
+            ESP_LOGE(TAG, "mbedtls_x509_crt_parse returned -0x%x", -ret);
+            return -1;
+        }
+        mbedtls_ssl_conf_authmode(&ssl->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+        mbedtls_ssl_conf_ca_chain(&ssl->conf, &ssl->cacert, NULL);
+    } else {
+        mbedtls_ssl_conf_authmode(&ssl->conf, MBEDTLS_SSL_VERIFY_NONE);
+    }
+    if (ssl->client_cert_pem && ssl->client_key_pem) {
+        if ((ret = mbedtls_x509_crt_parse(&ssl->clientcert, (const unsigned char *)ssl->client_cert_pem, ssl->client_cert_len)) < 0) {
+            ESP_LOGE(TAG, "mbedtls_x509_crt_parse returned -0x%x", -ret);
+            return -1;
+        }
+        if ((ret = mbedtls_pk_parse_key(&ssl->clientkey, (const unsigned char *)ssl->client_key_pem, ssl->client_key_len, NULL, 0)) != 0) {
+            ESP_LOGE(TAG, "mbedtls_pk_parse_key returned -0x%x", -ret);
+            return -1;
+        }
+        if ((ret = mbedtls_ssl_conf_own_cert(&ssl->conf, &ssl->clientcert, &ssl->clientkey)) != 0) {
+            ESP_LOGE(TAG, "mbedtls_ssl_conf_own_cert returned -0x%x", -ret);
+            return -1;
+        }
+    }
+    mbedtls_ssl_conf_rng(&ssl->conf, mbedtls_ctr_drbg_random, &ssl->ctr_drbg);
+#ifdef MBEDTLS_SSL_SESSION_TICKETS
+    mbedtls_ssl_conf_session_tickets(&ssl->conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+    ssl->configured = true;
+    return 0;
+}
+
+static void ssl_ms_to_timeval(int timeout_ms, struct timeval *tv)
+{
+    tv->tv_sec = timeout_ms / 1000;
+    tv->tv_usec = (timeout_ms % 1000) * 1000;
+}
+
+static int ssl_tcp_connect(transport_ssl_t *ssl, const char *host, int port, int timeout_ms)
+{
+    struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *res;
+    struct timeval tv;
+    char port_str[8];
+
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    if (getaddrinfo(host, port_str, &hints, &res) != 0 || res == NULL) {
+        ESP_LOGE(TAG, "DNS lookup failed for %s", host);
+        return -1;
+    }
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd < 0) {
+        ESP_LOGE(TAG, "Failed to create socket");
+        freeaddrinfo(res);
+        return -1;
+    }
+    // published right away, ws_transport_shutdown() may need it before connect returns
+    ssl->fd.fd = fd;
+    // bounds handshake and blocking record reads
+    ssl_ms_to_timeval(timeout_ms, &tv);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    int ret = ssl_connect_wait(ssl, res->ai_addr, res->ai_addrlen, timeout_ms);
+    freeaddrinfo(res);
+    if (ret != 0) {
+        ESP_LOGE(TAG, "Failed to connect to %s:%d, %s", host, port, ssl->aborted ? "shut down" : strerror(ret));
+        ssl->fd.fd = -1;
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Non-blocking connect, waiting in select() on the socket and the wake socket so that
+ * ws_transport_shutdown() ends it early. A shared wake socket isn't ours to drain, the
+ * wait is cut into slices of SSL_ABORT_POLL_MS instead. Returns 0 or an errno.
+ */
+static int ssl_connect_wait(transport_ssl_t *ssl, const struct sockaddr *addr, socklen_t addr_len, int timeout_ms)
+{
+    int fd = ssl->fd.fd;
+    int flags = fcntl(fd, F_GETFL, 0);
+    int err = 0;
+
+    if (ssl->aborted) {
+        return ECONNABORTED;
+    }
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    if (connect(fd, addr, addr_len) != 0) {
+        err = errno;
+    }
+    int64_t deadline_us = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+    while (err == EINPROGRESS) {
+        struct timeval tv;
+        fd_set readset, writeset;
+        int max_fd = fd;
+
+        int64_t left_us = deadline_us - esp_timer_get_time();
+        if (left_us <= 0) {
+            err = ETIMEDOUT;
+            break;
+        }
+        FD_ZERO(&readset);
+        FD_ZERO(&writeset);
+        FD_SET(fd, &writeset);
+        int wait_ms = (int)((left_us + 999) / 1000);
+        if (ssl->wake_fd >= 0 && !ssl->wake_shared) {
+            FD_SET(ssl->wake_fd, &readset);
+            max_fd = ssl->wake_fd > max_fd ? ssl->wake_fd : max_fd;
+        } else if (wait_ms > SSL_ABORT_POLL_MS) {
+            wait_ms = SSL_ABORT_POLL_MS;
+        }
+        ssl_ms_to_timeval(wait_ms, &tv);
+        if (select(max_fd + 1, &readset, &writeset, NULL, &tv) < 0) {
+            err = errno;
+            break;
+        }
+        if (ssl->wake_fd >= 0 && !ssl->wake_shared && FD_ISSET(ssl->wake_fd, &readset)) {
+            char drain[8];
+            while (recv(ssl->wake_fd, drain, sizeof(drain), MSG_DONTWAIT) > 0) {
+            }
+        }
+        if (ssl->aborted) {
+            err = ECONNABORTED;
+            break;
+        }
+        if (FD_ISSET(fd, &writeset)) {
+            socklen_t len = sizeof(err);
+            if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0) {
+                err = errno;
+            }
+        }
+    }
+    fcntl(fd, F_SETFL, flags);
+    return err;
+}
+
+static int ssl_connect(esp_transport_handle_t t, const char *host, int port, int timeout_ms)
+{
+    transport_ssl_t *ssl = esp_transport_get_context_data(t);
+    int ret;
+
+    if (ssl->plain) {
+        return ssl_tcp_connect(ssl, host, port, timeout_ms);
+    }
+    if (!ssl->configured && ssl_configure(ssl) != 0) {
+        return -1;
+    }
+    if (ssl_tcp_connect(ssl, host, port, timeout_ms) != 0) {
+        return -1;
+    }
+
+    mbedtls_ssl_init(&ssl->ssl);
+    ssl->ssl_ready = true;
+    if ((ret = mbedtls_ssl_setup(&ssl->ssl, &ssl->conf)) != 0) {
+        ESP_LOGE(TAG, "mbedtls_ssl_setup returned -0x%x", -ret);
+        goto _connect_failed;
+    }
+    if ((ret = mbedtls_ssl_set_hostname(&ssl->ssl, host)) != 0) {
+        ESP_LOGE(TAG, "mbedtls_ssl_set_hostname returned -0x%x", -ret);
+        goto _connect_failed;
+    }
+    mbedtls_ssl_set_bio(&ssl->ssl, &ssl->fd, mbedtls_net_send, mbedtls_net_recv, NULL);
+    if (ssl->has_session && (ret = mbedtls_ssl_set_session(&ssl->ssl, &ssl->session)) != 0) {
+        ESP_LOGW(TAG, "mbedtls_ssl_set_session returned -0x%x, full handshake", -ret);
+    }
+
+    int64_t start = esp_timer_get_time();
+    while ((ret = mbedtls_ssl_handshake(&ssl->ssl)) != 0) {
+        if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+            ESP_LOGE(TAG, "mbedtls_ssl_handshake returned -0x%x", -ret);
+            // don't offer a session that may be what the server choked on
+            ws_transport_ssl_clear_session(t);
+            goto _connect_failed;
+        }
+    }
+    int64_t handshake_us = esp_timer_get_time() - start;
+
+    // a resumed session carries the cached master secret over, a full handshake derives a
+    // new one. The session ID can't tell: with a ticket the server may echo any ID
+    bool resumed = ssl->has_session
+                   && memcmp(ssl->ssl.session->master, ssl->session.master, sizeof(ssl->session.master)) == 0;
+    ssl->stats.handshakes++;
+    if (resumed) {
+        ssl->stats.resumed++;
+    }
+    ssl->stats.last_handshake_us = handshake_us;
+    ssl->stats.handshake_us += handshake_us;
+    ESP_LOGI(TAG, "handshake %d ms, %s (%d of %d resumed)", (int)(handshake_us / 1000),
+             resumed ? "resumed" : "full", ssl->stats.resumed, ssl->stats.handshakes);
+
+    // keep this session, including any ticket the server sent, for the next connect
+    ws_transport_ssl_clear_session(t);
+    ssl->has_session = mbedtls_ssl_get_session(&ssl->ssl, &ssl->session) == 0;
+    return 0;
+
+_connect_failed:
+    ssl_close(t);
+    return -1;
+}
+
+static int ssl_poll_read(esp_transport_handle_t t, int timeout_ms)
+{
+    transport_ssl_t *ssl = esp_transport_get_context_data(t);
+    struct timeval timeout;
+    fd_set readset;
+
+    if (ssl->ssl_ready && mbedtls_ssl_get_bytes_avail(&ssl->ssl) > 0) {
+        return 1;
+    }
+    FD_ZERO(&readset);
+    FD_SET(ssl->fd.fd, &readset);
+    int max_fd = ssl->fd.fd;
+    if (ssl->wake_fd >= 0 && !ssl->wake_shared) {
+        FD_SET(ssl->wake_fd, &readset);
+        max_fd = ssl->wake_fd > max_fd ? ssl->wake_fd : max_fd;
+    }
+    ssl_ms_to_timeval(timeout_ms, &timeout);
+    int ret = select(max_fd + 1, &readset, NULL, NULL, &timeout);
+    if (ret <= 0) {
+        return ret;
+    }
+    // woken: nothing to read, the caller gets back to its queue
+    if (ssl->wake_fd >= 0 && !ssl->wake_shared && FD_ISSET(ssl->wake_fd, &readset)) {
+        char drain[8];
+        while (recv(ssl->wake_fd, drain, sizeof(drain), MSG_DONTWAIT) > 0) {
+        }
+    }
+    return FD_ISSET(ssl->fd.fd, &readset) ? 1 : 0;
+}
+
+static int ssl_poll_write(esp_transport_handle_t t, int timeout_ms)
+{
+    transport_ssl_t *ssl = esp_transport_get_context_data(t);
+    struct timeval timeout;
+    fd_set writeset;
+
+    FD_ZERO(&writeset);
+    FD_SET(ssl->fd.fd, &writeset);
+    ssl_ms_to_timeval(timeout_ms, &timeout);
+    return select(ssl->fd.fd + 1, NULL, &writeset, NULL, &timeout);
+}
+
+// returns 0 when nothing arrived within timeout_ms, < 0 when the connection is gone
+static int ssl_read(esp_transport_handle_t t, char *buffer, int len, int timeout_ms)
+{
+    transport_ssl_t *ssl = esp_transport_get_context_data(t);
+    int ret;
+
+    if (ssl->plain) {
+        if ((ret = ssl_poll_read(t, timeout_ms)) <= 0) {
+            return ret;
+        }
+        ret = recv(ssl->fd.fd, buffer, len, 0);
+        if (ret == 0) {
+            ESP_LOGD(TAG, "Connection closed by peer");
+            return -1;
+        }
+        if (ret < 0) {
+            ESP_LOGE(TAG, "recv failed, errno %d", errno);
+        }
+        return ret;
+    }
+    if (mbedtls_ssl_get_bytes_avail(&ssl->ssl) <= 0) {
+        if ((ret = ssl_poll_read(t, timeout_ms)) <= 0) {
+            return ret;
+        }
+    }
+    ret = mbedtls_ssl_read(&ssl->ssl, (unsigned char *)buffer, len);
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+        return 0;
+    }
+    if (ret == 0 || ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+        ESP_LOGD(TAG, "Connection closed by peer");
+        return -1;
+    }
+    if (ret < 0) {
+        ESP_LOGE(TAG, "mbedtls_ssl_read returned -0x%x", -ret);
+    }
+    return ret;
+}
+
+static int ssl_write(esp_transport_handle_t t, const char *buffer, int len, int timeout_ms)
+{
+    transport_ssl_t *ssl = esp_transport_get_context_data(t);
+    int ret;
+
+    if ((ret = ssl_poll_write(t, timeout_ms)) <= 0) {
+        ESP_LOGW(TAG, "Poll timeout or error, errno %d", errno);
+        return ret;
+    }
+    if (ssl->plain) {
+        ret = send(ssl->fd.fd, buffer, len, 0);
+        if (ret < 0) {
+            ESP_LOGE(TAG, "send failed, errno %d", errno);
+        }
+        return ret;
+    }
+    ret = mbedtls_ssl_write(&ssl->ssl, (const unsigned char *)buffer, len);
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+        return 0;
+    }
+    if (ret < 0) {
+        ESP_LOGE(TAG, "mbedtls_ssl_write returned -0x%x", -ret);
+    }
+    return ret;
+}
+
+// closes the connection only, configuration and the cached session are kept
+static int ssl_close(esp_transport_handle_t t)
+{
+    transport_ssl_t *ssl = esp_transport_get_context_data(t);
+
+    if (ssl->ssl_ready) {
+        if (ssl->fd.fd >= 0) {
+            mbedtls_ssl_close_notify(&ssl->ssl);
+        }
+        mbedtls_ssl_free(&ssl->ssl);
+        ssl->ssl_ready = false;
+    }
+    mbedtls_net_free(&ssl->fd);
+    ssl->aborted = false;
+    return 0;
+}
+
+static int ssl_destroy(esp_transport_handle_t t)
+{
+    transport_ssl_t *ssl = esp_transport_get_context_data(t);
+
+    ssl_close(t);
+    if (ssl->wake_fd >= 0 && !ssl->wake_shared) {
+        close(ssl->wake_fd);
+    }
+    mbedtls_ssl_session_free(&ssl->session);
+    mbedtls_pk_free(&ssl->clientkey);
+    mbedtls_x509_crt_free(&ssl->clientcert);
+    mbedtls_x509_crt_free(&ssl->cacert);
+    mbedtls_ctr_drbg_free(&ssl->ctr_drbg);
+    mbedtls_entropy_free(&ssl->entropy);
+    mbedtls_ssl_config_free(&ssl->conf);
+    free(ssl);
+    return 0;
+}
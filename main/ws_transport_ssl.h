@@ -0,0 +1,58 @@
+#ifndef _WS_TRANSPORT_SSL_H_
+#define _WS_TRANSPORT_SSL_H_
+
+#include <stdint.h>
+#include "esp_transport.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ws_transport_ssl_stats {
+    uint32_t handshakes;            // successful handshakes
+    uint32_t resumed;               // of those, resumed from the cached session
+    int64_t last_handshake_us;      // duration of the last handshake
+    int64_t handshake_us;           // total time spent in handshakes
+} ws_transport_ssl_stats_t;
+
+/*
+ * TLS transport on top of mbedtls that keeps the session of the last connection and
+ * offers it (session ticket or session ID) on the next connect, so a reconnect costs an
+ * abbreviated handshake instead of a full one. Certificates are parsed once, not on
+ * every connect.
+ */
+esp_transport_handle_t ws_transport_ssl_init();
+/* the same socket handling without TLS, for ws:// */
+esp_transport_handle_t ws_transport_tcp_init();
+
+/* on either transport: */
+
+/* shut the socket down from another task, a connect, read or poll blocked on it returns at once */
+void ws_transport_shutdown(esp_transport_handle_t t);
+/* socket of the current connection for select(), -1 if there is none */
+int ws_transport_get_fd(esp_transport_handle_t t);
+/* make a poll blocked in another task return early, reading nothing */
+void ws_transport_wake(esp_transport_handle_t t);
+/* socket to select() on as well, ws_transport_wake() makes it readable */
+int ws_transport_get_wake_fd(esp_transport_handle_t t);
+/*
+ * use owner's wake socket instead of one of its own, owner has to outlive t. Reads and
+ * connects on t then leave it alone, whoever selects on it drains it
+ */
+void ws_transport_share_wake(esp_transport_handle_t t, esp_transport_handle_t owner);
+
+/* TLS only: */
+
+void ws_transport_ssl_set_cert_data(esp_transport_handle_t t, const char *data, int len);
+void ws_transport_ssl_set_client_cert_data(esp_transport_handle_t t, const char *data, int len);
+void ws_transport_ssl_set_client_key_data(esp_transport_handle_t t, const char *data, int len);
+
+/* forget the cached session, the next connect does a full handshake */
+void ws_transport_ssl_clear_session(esp_transport_handle_t t);
+void ws_transport_ssl_get_stats(esp_transport_handle_t t, ws_transport_ssl_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
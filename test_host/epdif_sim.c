@@ -0,0 +1,446 @@
+#include "epdif.h"
+#include "epdif_sim.h"
+
+#include "esp_log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// controller commands, same as epd2in9.c
+#define DRIVER_OUTPUT_CONTROL                       0x01
+#define BOOSTER_SOFT_START_CONTROL                  0x0C
+#define GATE_SCAN_START_POSITION                    0x0F
+#define DEEP_SLEEP_MODE                             0x10
+#define DATA_ENTRY_MODE_SETTING                     0x11
+#define SW_RESET                                    0x12
+#define TEMPERATURE_SENSOR_CONTROL                  0x1A
+#define MASTER_ACTIVATION                           0x20
+#define DISPLAY_UPDATE_CONTROL_1                    0x21
+#define DISPLAY_UPDATE_CONTROL_2                    0x22
+#define WRITE_RAM                                   0x24
+#define WRITE_VCOM_REGISTER                         0x2C
+#define WRITE_LUT_REGISTER                          0x32
+#define SET_DUMMY_LINE_PERIOD                       0x3A
+#define SET_GATE_TIME                               0x3B
+#define BORDER_WAVEFORM_CONTROL                     0x3C
+#define SET_RAM_X_ADDRESS_START_END_POSITION        0x44
+#define SET_RAM_Y_ADDRESS_START_END_POSITION        0x45
+#define SET_RAM_X_ADDRESS_COUNTER                   0x4E
+#define SET_RAM_Y_ADDRESS_COUNTER                   0x4F
+#define TERMINATE_FRAME_READ_WRITE                  0xFF
+
+#define ENTRY_X_INCREMENT   0x01
+#define ENTRY_Y_INCREMENT   0x02
+#define ENTRY_Y_FIRST       0x04    // AM: counter moves in Y direction first
+#define UPDATE_DISPLAY      0x04    // DISPLAY_UPDATE_CONTROL_2: drive the panel with the LUT
+
+#define SIM_LUT_SIZE 30
+#define SIM_CLOCK_SPEED_HZ (40*1000*1000)
+#define SIM_MAX_PARAMS SIM_LUT_SIZE
+
+static const char *TAG = "EPD-SIM";
+
+static epdif_stats_t epd_stats;
+static epd_sim_stats_t sim_stats;
+static epd_sim_state_t sim;
+static int sim_clock_hz = SIM_CLOCK_SPEED_HZ;
+static uint32_t sim_width;
+static uint32_t sim_height;
+static int sim_row_bytes;
+static uint8_t *sim_ram;
+static uint8_t *sim_panel;
+static int64_t sim_now_us;
+static int64_t sim_busy_until_us;
+
+// command being decoded and its parameters so far
+static int sim_cmd = -1;
+static uint8_t sim_params[SIM_MAX_PARAMS];
+static int sim_nparams;
+static bool sim_ram_overflow;
+
+#define sim_error(format, ...) do {                 \
+        sim_stats.errors++;                         \
+        ESP_LOGE(TAG, format, ##__VA_ARGS__);       \
+    } while (0)
+
+// parameters each command takes, -1 if it is not one the driver should send
+static int sim_param_count(int cmd) {
+    switch (cmd) {
+        case DRIVER_OUTPUT_CONTROL: return 3;
+        case BOOSTER_SOFT_START_CONTROL: return 3;
+        case GATE_SCAN_START_POSITION: return 2;
+        case DEEP_SLEEP_MODE: return 0;         // optional A0 is accepted too
+        case DATA_ENTRY_MODE_SETTING: return 1;
+        case SW_RESET: return 0;
+        case TEMPERATURE_SENSOR_CONTROL: return 2;
+        case MASTER_ACTIVATION: return 0;
+        case DISPLAY_UPDATE_CONTROL_1: return 1;
+        case DISPLAY_UPDATE_CONTROL_2: return 1;
+        case WRITE_RAM: return 0;               // followed by any amount of RAM data
+        case WRITE_VCOM_REGISTER: return 1;
+        case WRITE_LUT_REGISTER: return SIM_LUT_SIZE;
+        case SET_DUMMY_LINE_PERIOD: return 1;
+        case SET_GATE_TIME: return 1;
+        case BORDER_WAVEFORM_CONTROL: return 1;
+        case SET_RAM_X_ADDRESS_START_END_POSITION: return 2;
+        case SET_RAM_Y_ADDRESS_START_END_POSITION: return 4;
+        case SET_RAM_X_ADDRESS_COUNTER: return 1;
+        case SET_RAM_Y_ADDRESS_COUNTER: return 2;
+        case TERMINATE_FRAME_READ_WRITE: return 0;
+    }
+    return -1;
+}
+
+// register values after a hardware or software reset, RAM is kept
+static void sim_reset_registers() {
+    memset(&sim, 0, sizeof(sim));
+    sim.x_end = sim_row_bytes - 1;
+    sim.y_end = sim_height - 1;
+    sim.entry_mode = ENTRY_X_INCREMENT | ENTRY_Y_INCREMENT;
+    sim.gate_lines = sim_height;
+    sim.dummy_lines = 0x16;
+    sim.gate_time = 0x08;
+    sim.temperature = 25;
+    sim_busy_until_us = 0;
+    sim_cmd = -1;
+}
+
+static bool sim_busy() {
+    return sim_now_us < sim_busy_until_us;
+}
+
+/*
+ * one frame scans every gate line plus the dummy lines. the line time is an
+ * approximation of the gate time table: 30us + 4us per step, 62us for the
+ * 0x08 the driver uses, which gives the ~50 Hz frame rate of the panel.
+ */
+static int64_t sim_frame_us() {
+    return (int64_t)(sim.gate_lines + sim.dummy_lines) * (30 + 4 * sim.gate_time);
+}
+
+// phase lengths are the nibbles of the last 10 LUT bytes, in frames
+static int sim_lut_frames() {
+    int frames = 0;
+    for (int i = 20; i < SIM_LUT_SIZE; i++) {
+        frames += (sim.lut[i] >> 4) + (sim.lut[i] & 0x0F);
+    }
+    return frames;
+}
+
+static void sim_refresh() {
+    if (!(sim.update_control & UPDATE_DISPLAY)) {
+        return;
+    }
+    if (!sim.lut_loaded) {
+        sim_error("refresh without a LUT");
+        return;
+    }
+    int frames = sim_lut_frames();
+    int64_t busy_us = frames * sim_frame_us();
+    memcpy(sim_panel, sim_ram, sim_row_bytes * sim_height);
+    sim_busy_until_us = sim_now_us + busy_us;
+    sim_stats.refreshes++;
+    sim_stats.frames += frames;
+    sim_stats.last_refresh_us = busy_us;
+    ESP_LOGI(TAG, "refresh: %d frames, %d ms, %d C", frames, (int)(busy_us / 1000), sim.temperature);
+}
+
+static void sim_execute() {
+    const uint8_t *p = sim_params;
+    switch (sim_cmd) {
+        case DRIVER_OUTPUT_CONTROL:
+            sim.gate_lines = (p[0] | ((p[1] & 0x01) << 8)) + 1;
+            if (sim.gate_lines != sim_height) {
+                sim_error("%d gate lines on a %d line panel", sim.gate_lines, (int)sim_height);
+            }
+            break;
+        case DEEP_SLEEP_MODE:
+            sim.asleep = true;
+            break;
+        case DATA_ENTRY_MODE_SETTING:
+            sim.entry_mode = p[0] & 0x07;
+            break;
+        case SW_RESET:
+            sim_reset_registers();
+            break;
+        case TEMPERATURE_SENSOR_CONTROL:
+            sim.temperature = (int8_t)p[0];
+            break;
+        case MASTER_ACTIVATION:
+            sim_refresh();
+            break;
+        case DISPLAY_UPDATE_CONTROL_2:
+            sim.update_control = p[0];
+            break;
+        case WRITE_RAM:
+            sim_ram_overflow = false;
+            break;
+        case WRITE_LUT_REGISTER:
+            memcpy(sim.lut, p, SIM_LUT_SIZE);
+            sim.lut_loaded = true;
+            break;
+        case SET_DUMMY_LINE_PERIOD:
+            sim.dummy_lines = p[0] & 0x7F;
+            break;
+        case SET_GATE_TIME:
+            sim.gate_time = p[0] & 0x0F;
+            break;
+        case SET_RAM_X_ADDRESS_START_END_POSITION:
+            sim.x_start = p[0] & 0x3F;
+            sim.x_end = p[1] & 0x3F;
+            if (sim.x_start >= sim_row_bytes || sim.x_end >= sim_row_bytes) {
+                sim_error("X window %d..%d outside the %d byte rows", sim.x_start, sim.x_end, sim_row_bytes);
+            }
+            break;
+        case SET_RAM_Y_ADDRESS_START_END_POSITION:
+            sim.y_start = p[0] | ((p[1] & 0x01) << 8);
+            sim.y_end = p[2] | ((p[3] & 0x01) << 8);
+            if (sim.y_start >= sim_height || sim.y_end >= sim_height) {
+                sim_error("Y window %d..%d outside the %d lines", sim.y_start, sim.y_end, (int)sim_height);
+            }
+            break;
+        case SET_RAM_X_ADDRESS_COUNTER:
+            sim.x = p[0] & 0x3F;
+            break;
+        case SET_RAM_Y_ADDRESS_COUNTER:
+            sim.y = p[0] | ((p[1] & 0x01) << 8);
+            break;
+        default:
+            // booster, VCOM, border, update control 1, terminate: no effect on the model
+            break;
+    }
+}
+
+// a command ends when the next one starts, check it got all its parameters
+static void sim_end_command() {
+    if (sim_cmd >= 0 && sim_nparams < sim_param_count(sim_cmd)) {
+        sim_error("cmd 0x%02X got %d of %d parameters", sim_cmd, sim_nparams, sim_param_count(sim_cmd));
+    }
+    sim_cmd = -1;
+}
+
+static void sim_command(uint8_t cmd) {
+    sim_end_command();
+    if (sim.asleep) {
+        sim_error("cmd 0x%02X in deep sleep, needs a hardware reset first", cmd);
+        return;
+    }
+    // terminate is how the driver closes a refresh script, before it waits for BUSY
+    if (sim_busy() && cmd != TERMINATE_FRAME_READ_WRITE) {
+        sim_error("cmd 0x%02X while BUSY", cmd);
+    }
+    if (sim_param_count(cmd) < 0) {
+        sim_error("unknown cmd 0x%02X", cmd);
+        return;
+    }
+    sim_cmd = cmd;
+    sim_nparams = 0;
+    if (sim_param_count(cmd) == 0) {
+        sim_execute();
+    }
+}
+
+// next address in the data entry direction, wrapping at the window edges
+static void sim_advance(int *first, int first_start, int first_end, bool first_inc,
+                        int *second, int second_start, int second_end, bool second_inc) {
+    *first += first_inc ? 1 : -1;
+    if (first_inc ? *first <= first_end : *first >= first_end) {
+        return;
+    }
+    *first = first_start;
+    *second += second_inc ? 1 : -1;
+    if (second_inc ? *second <= second_end : *second >= second_end) {
+        return;
+    }
+    *second = second_start;
+}
+
+static void sim_write_ram(uint8_t data) {
+    bool x_inc = sim.entry_mode & ENTRY_X_INCREMENT;
+    bool y_inc = sim.entry_mode & ENTRY_Y_INCREMENT;
+
+    if (sim.x < 0 || sim.x >= sim_row_bytes || sim.y < 0 || sim.y >= sim_height) {
+        if (!sim_ram_overflow) {
+            sim_error("RAM write at %d,%d outside the panel", sim.x, sim.y);
+        }
+        sim_ram_overflow = true;
+    } else {
+        sim_ram[sim.y * sim_row_bytes + sim.x] = data;
+        sim_stats.ram_bytes++;
+    }
+
+    if (sim.entry_mode & ENTRY_Y_FIRST) {
+        sim_advance(&sim.y, sim.y_start, sim.y_end, y_inc, &sim.x, sim.x_start, sim.x_end, x_inc);
+    } else {
+        sim_advance(&sim.x, sim.x_start, sim.x_end, x_inc, &sim.y, sim.y_start, sim.y_end, y_inc);
+    }
+}
+
+static void sim_data(const uint8_t *data, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        if (sim.asleep) {
+            // data after DEEP_SLEEP_MODE is its A0 parameter, or lost
+            if (sim_cmd != DEEP_SLEEP_MODE) {
+                sim_error("data in deep sleep");
+            }
+            sim_cmd = -1;
+            continue;
+        }
+        if (sim_cmd < 0) {
+            sim_error("data 0x%02X without a command", data[i]);
+            continue;
+        }
+        if (sim_cmd == WRITE_RAM) {
+            sim_write_ram(data[i]);
+            continue;
+        }
+        if (sim_nparams >= sim_param_count(sim_cmd)) {
+            sim_error("cmd 0x%02X: extra parameter 0x%02X", sim_cmd, data[i]);
+            continue;
+        }
+        sim_params[sim_nparams++] = data[i];
+        if (sim_nparams == sim_param_count(sim_cmd)) {
+            sim_execute();
+        }
+    }
+}
+
+// time the bytes take on the wire at the current clock
+static void sim_transfer(uint32_t len) {
+    int64_t us = (int64_t)len * 8 * 1000000 / sim_clock_hz;
+    epd_stats.bytes += len;
+    epd_stats.transactions++;
+    epd_stats.spi_us += us;
+    sim_now_us += us;
+}
+
+void epdif_init(epdif_pin_config_t *pin_cfg, uint32_t width, uint32_t height) {
+    free(sim_ram);
+    free(sim_panel);
+    sim_width = width;
+    sim_height = height;
+    sim_row_bytes = width / 8;
+    sim_ram = calloc(sim_row_bytes, height);
+    sim_panel = calloc(sim_row_bytes, height);
+    // power up content of the panel is unknown, white is as good as any
+    memset(sim_panel, 0xFF, sim_row_bytes * height);
+    sim_now_us = 0;
+    memset(&sim_stats, 0, sizeof(sim_stats));
+    memset(&epd_stats, 0, sizeof(epd_stats));
+    sim_reset_registers();
+    printf("SIM: %dx%d panel, %d kHz\r\n", (int)width, (int)height, sim_clock_hz / 1000);
+}
+
+int epdif_get_clock_speed() {
+    return sim_clock_hz;
+}
+
+esp_err_t epdif_set_clock_speed(int clock_speed_hz) {
+    if (clock_speed_hz <= 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    sim_clock_hz = clock_speed_hz;
+    return ESP_OK;
+}
+
+esp_err_t epdif_save_clock_speed() {
+    return ESP_OK;
+}
+
+void epdif_get_stats(epdif_stats_t *stats) {
+    memcpy(stats, &epd_stats, sizeof(epdif_stats_t));
+}
+
+void epdif_reset_stats() {
+    memset(&epd_stats, 0, sizeof(epdif_stats_t));
+}
+
+void epdif_log_stats() {
+    ESP_LOGI(TAG, "spi: %d bytes, %d transactions, %d ms; busy: %d ms; clock %d kHz",
+             (int)epd_stats.bytes, (int)epd_stats.transactions,
+             (int)(epd_stats.spi_us / 1000), (int)(epd_stats.busy_us / 1000),
+             sim_clock_hz / 1000);
+}
+
+void epdif_reset() {
+    sim_end_command();
+    epdif_delay_ms(200);
+    sim_reset_registers();
+    epdif_delay_ms(200);
+}
+
+void epdif_delay_ms(uint32_t delaytime) {
+    sim_now_us += (int64_t)delaytime * 1000;
+}
+
+void epdif_wait_until_idle() {
+    if (sim_busy()) {
+        epd_stats.busy_us += sim_busy_until_us - sim_now_us;
+        sim_now_us = sim_busy_until_us;
+    }
+}
+
+void epdif_send_command(uint8_t cmd) {
+    sim_transfer(1);
+    sim_command(cmd);
+}
+
+void epdif_send_byte_data(uint8_t data) {
+    sim_transfer(1);
+    sim_data(&data, 1);
+}
+
+void epdif_send_data(const uint8_t *data, uint32_t len) {
+    if (len == 0) return;
+    sim_transfer(len);
+    sim_data(data, len);
+}
+
+void epdif_send_script(const uint8_t *script, uint32_t len) {
+    uint32_t pos = 0;
+    while (pos + 2 <= len) {
+        uint8_t nparams = script[pos + 1];
+        if (pos + 2 + nparams > len) {
+            sim_error("truncated script at %d", (int)pos);
+            break;
+        }
+        epdif_send_command(script[pos]);
+        epdif_send_data(&script[pos + 2], nparams);
+        pos += 2 + nparams;
+    }
+}
+
+int64_t epd_sim_time_us() {
+    return sim_now_us;
+}
+
+const epd_sim_state_t* epd_sim_state() {
+    return &sim;
+}
+
+void epd_sim_get_stats(epd_sim_stats_t *stats) {
+    memcpy(stats, &sim_stats, sizeof(epd_sim_stats_t));
+}
+
+const uint8_t* epd_sim_ram() {
+    return sim_ram;
+}
+
+const uint8_t* epd_sim_panel() {
+    return sim_panel;
+}
+
+int epd_sim_dump_pbm(const char *path) {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        ESP_LOGE(TAG, "can't write %s", path);
+        return -1;
+    }
+    fprintf(f, "P4\n%d %d\n", (int)sim_width, (int)sim_height);
+    // RAM bits are 1 for white, PBM bits are 1 for black
+    for (int i = 0; i < sim_row_bytes * sim_height; i++) {
+        fputc(~sim_panel[i] & 0xFF, f);
+    }
+    return fclose(f) == 0 ? 0 : -1;
+}
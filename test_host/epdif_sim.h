@@ -0,0 +1,50 @@
+#ifndef _EPDIF_SIM_H_
+#define _EPDIF_SIM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * host build of epdif: the command stream is decoded by a simulated IL3820
+ * controller instead of going out on SPI. time is simulated too, SPI
+ * transfers take bytes * 8 / clock and a refresh keeps BUSY up for the
+ * frames its LUT asks for, so epdif_get_stats() reports what the panel
+ * would have cost.
+ */
+
+typedef struct epd_sim_state {
+    int x_start, x_end;         // RAM X window, in bytes
+    int y_start, y_end;         // RAM Y window, in lines
+    int x, y;                   // address counters
+    uint8_t entry_mode;         // DATA_ENTRY_MODE_SETTING
+    uint8_t update_control;     // DISPLAY_UPDATE_CONTROL_2
+    int gate_lines;             // DRIVER_OUTPUT_CONTROL
+    int dummy_lines;
+    int gate_time;
+    int temperature;            // TEMPERATURE_SENSOR_CONTROL, integer degrees
+    uint8_t lut[30];
+    bool lut_loaded;
+    bool asleep;
+} epd_sim_state_t;
+
+typedef struct epd_sim_stats {
+    uint32_t refreshes;         // MASTER_ACTIVATION with the display enabled
+    uint32_t frames;            // LUT frames they drove
+    int64_t last_refresh_us;    // BUSY time of the last one
+    uint32_t ram_bytes;         // bytes written into RAM
+    uint32_t errors;            // protocol misuse, each one is logged
+} epd_sim_stats_t;
+
+/* simulated time since epdif_init() */
+int64_t epd_sim_time_us();
+const epd_sim_state_t* epd_sim_state();
+void epd_sim_get_stats(epd_sim_stats_t* stats);
+
+/* controller RAM and what the panel shows, 1 bit per pixel, rows of width / 8 bytes */
+const uint8_t* epd_sim_ram();
+const uint8_t* epd_sim_panel();
+
+/* write the panel as a PBM (P4) image, returns 0 or -1 */
+int epd_sim_dump_pbm(const char* path);
+
+#endif
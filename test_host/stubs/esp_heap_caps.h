@@ -0,0 +1,17 @@
+/* host build: there is only one kind of memory */
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define MALLOC_CAP_32BIT    (1<<1)
+#define MALLOC_CAP_8BIT     (1<<2)
+#define MALLOC_CAP_DMA      (1<<3)
+#define MALLOC_CAP_SPIRAM   (1<<10)
+#define MALLOC_CAP_INTERNAL (1<<11)
+
+static inline void *heap_caps_malloc(size_t size, uint32_t caps)
+{
+    (void)caps;
+    return malloc(size);
+}
@@ -0,0 +1,34 @@
+/* host build: ESP_LOGx print to stdout, filtered by CONFIG_LOG_DEFAULT_LEVEL */
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include "sdkconfig.h"
+
+typedef enum {
+    ESP_LOG_NONE,
+    ESP_LOG_ERROR,
+    ESP_LOG_WARN,
+    ESP_LOG_INFO,
+    ESP_LOG_DEBUG,
+    ESP_LOG_VERBOSE
+} esp_log_level_t;
+
+#ifndef LOG_LOCAL_LEVEL
+#define LOG_LOCAL_LEVEL CONFIG_LOG_DEFAULT_LEVEL
+#endif
+
+#define ESP_LOG_LEVEL_LOCAL(level, letter, tag, format, ...) do {          \
+        if (LOG_LOCAL_LEVEL >= level) {                                     \
+            printf(letter " (%s) " format "\n", tag, ##__VA_ARGS__);        \
+        }                                                                   \
+    } while (0)
+
+#define ESP_LOGE(tag, format, ...) ESP_LOG_LEVEL_LOCAL(ESP_LOG_ERROR, "E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) ESP_LOG_LEVEL_LOCAL(ESP_LOG_WARN, "W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) ESP_LOG_LEVEL_LOCAL(ESP_LOG_INFO, "I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) ESP_LOG_LEVEL_LOCAL(ESP_LOG_DEBUG, "D", tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) ESP_LOG_LEVEL_LOCAL(ESP_LOG_VERBOSE, "V", tag, format, ##__VA_ARGS__)
+
+#define ESP_LOG_BUFFER_HEX(tag, buffer, buff_len) do { (void)(buffer); (void)(buff_len); } while (0)
+#define ESP_LOG_BUFFER_HEX_LEVEL(tag, buffer, buff_len, level) do { (void)(buffer); (void)(buff_len); } while (0)
@@ -0,0 +1,13 @@
+/* host build: the part of esp_system.h the tested code uses */
+#pragma once
+
+#include <stdint.h>
+#include <sys/random.h>
+#include "esp_err.h"
+
+static inline uint32_t esp_random(void)
+{
+    uint32_t r = 0;
+    getrandom(&r, sizeof(r), 0);
+    return r;
+}
@@ -0,0 +1,157 @@
+/*
+ * host build: esp_transport dispatches to the functions a transport registered, the
+ * sockets underneath are the host's own, so ws_transport_ssl.c runs unchanged.
+ */
+#include "esp_transport.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_TRANSPORTS 4
+
+struct esp_transport_item_t {
+    int port;
+    void *data;
+    connect_func _connect;
+    io_read_func _read;
+    io_func _write;
+    trans_func _close;
+    poll_func _poll_read;
+    poll_func _poll_write;
+    trans_func _destroy;
+    char scheme[8];
+};
+
+struct esp_transport_list_t {
+    esp_transport_handle_t items[MAX_TRANSPORTS];
+    int count;
+};
+
+esp_transport_list_handle_t esp_transport_list_init(void)
+{
+    return calloc(1, sizeof(struct esp_transport_list_t));
+}
+
+esp_err_t esp_transport_list_destroy(esp_transport_list_handle_t list)
+{
+    if (list == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (int i = 0; i < list->count; i++) {
+        esp_transport_destroy(list->items[i]);
+    }
+    free(list);
+    return ESP_OK;
+}
+
+esp_err_t esp_transport_list_add(esp_transport_list_handle_t list, esp_transport_handle_t t, const char *scheme)
+{
+    if (list == NULL || t == NULL || list->count == MAX_TRANSPORTS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    strncpy(t->scheme, scheme, sizeof(t->scheme) - 1);
+    list->items[list->count++] = t;
+    return ESP_OK;
+}
+
+esp_transport_handle_t esp_transport_list_get_transport(esp_transport_list_handle_t list, const char *scheme)
+{
+    for (int i = 0; list && i < list->count; i++) {
+        if (scheme == NULL || strcmp(list->items[i]->scheme, scheme) == 0) {
+            return list->items[i];
+        }
+    }
+    return NULL;
+}
+
+esp_transport_handle_t esp_transport_init(void)
+{
+    return calloc(1, sizeof(struct esp_transport_item_t));
+}
+
+int esp_transport_destroy(esp_transport_handle_t t)
+{
+    if (t == NULL) {
+        return -1;
+    }
+    if (t->_destroy) {
+        t->_destroy(t);
+    }
+    free(t);
+    return 0;
+}
+
+int esp_transport_get_default_port(esp_transport_handle_t t)
+{
+    return t ? t->port : -1;
+}
+
+esp_err_t esp_transport_set_default_port(esp_transport_handle_t t, int port)
+{
+    if (t == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    t->port = port;
+    return ESP_OK;
+}
+
+int esp_transport_connect(esp_transport_handle_t t, const char *host, int port, int timeout_ms)
+{
+    return t && t->_connect ? t->_connect(t, host, port, timeout_ms) : -1;
+}
+
+int esp_transport_read(esp_transport_handle_t t, char *buffer, int len, int timeout_ms)
+{
+    return t && t->_read ? t->_read(t, buffer, len, timeout_ms) : -1;
+}
+
+int esp_transport_poll_read(esp_transport_handle_t t, int timeout_ms)
+{
+    return t && t->_poll_read ? t->_poll_read(t, timeout_ms) : -1;
+}
+
+int esp_transport_write(esp_transport_handle_t t, const char *buffer, int len, int timeout_ms)
+{
+    return t && t->_write ? t->_write(t, buffer, len, timeout_ms) : -1;
+}
+
+int esp_transport_poll_write(esp_transport_handle_t t, int timeout_ms)
+{
+    return t && t->_poll_write ? t->_poll_write(t, timeout_ms) : -1;
+}
+
+int esp_transport_close(esp_transport_handle_t t)
+{
+    return t && t->_close ? t->_close(t) : 0;
+}
+
+void *esp_transport_get_context_data(esp_transport_handle_t t)
+{
+    return t ? t->data : NULL;
+}
+
+esp_err_t esp_transport_set_context_data(esp_transport_handle_t t, void *data)
+{
+    if (t == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    t->data = data;
+    return ESP_OK;
+}
+
+esp_err_t esp_transport_set_func(esp_transport_handle_t t, connect_func _connect, io_read_func _read,
+                                 io_func _write, trans_func _close, poll_func _poll_read,
+                                 poll_func _poll_write, trans_func _destroy)
+{
+    if (t == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    t->_connect = _connect;
+    t->_read = _read;
+    t->_write = _write;
+    t->_close = _close;
+    t->_poll_read = _poll_read;
+    t->_poll_write = _poll_write;
+    t->_destroy = _destroy;
+    return ESP_OK;
+}
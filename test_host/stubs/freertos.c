@@ -0,0 +1,371 @@
+/*
+ * host build: the FreeRTOS calls the tested code makes, on pthreads. Every object is a
+ * mutex and a condition variable, timeouts are in ticks of one millisecond.
+ */
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
+#include "freertos/event_groups.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct rtos_task {
+    pthread_t thread;
+    TaskFunction_t code;
+    void *parameters;
+};
+
+struct rtos_sem {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int count;
+};
+
+struct rtos_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint8_t *items;
+    UBaseType_t length;
+    UBaseType_t item_size;
+    UBaseType_t head;
+    UBaseType_t count;
+};
+
+struct rtos_event_group {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    EventBits_t bits;
+};
+
+static pthread_key_t task_key;
+static pthread_once_t task_key_once = PTHREAD_ONCE_INIT;
+
+// handles outlive their threads, ws_on_network_task() style comparisons must never match a new one
+static void task_key_init(void)
+{
+    pthread_key_create(&task_key, NULL);
+}
+
+static void sync_init(pthread_mutex_t *lock, pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(lock, NULL);
+}
+
+static void deadline_after(TickType_t ticks, struct timespec *deadline)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += ticks / 1000;
+    deadline->tv_nsec += (long)(ticks % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+// lock held, false once the deadline has passed
+static bool cond_wait(pthread_cond_t *cond, pthread_mutex_t *lock, TickType_t ticks, const struct timespec *deadline)
+{
+    if (ticks == portMAX_DELAY) {
+        pthread_cond_wait(cond, lock);
+        return true;
+    }
+    return pthread_cond_timedwait(cond, lock, deadline) != ETIMEDOUT;
+}
+
+static void *task_main(void *arg)
+{
+    struct rtos_task *task = arg;
+    pthread_once(&task_key_once, task_key_init);
+    pthread_setspecific(task_key, task);
+    task->code(task->parameters);
+    return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t task_code, const char *name, uint32_t stack_depth,
+                       void *parameters, UBaseType_t priority, TaskHandle_t *created_task)
+{
+    struct rtos_task *task = calloc(1, sizeof(struct rtos_task));
+    pthread_attr_t attr;
+
+    if (task == NULL) {
+        return pdFAIL;
+    }
+    task->code = task_code;
+    task->parameters = parameters;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&task->thread, &attr, task_main, task) != 0) {
+        pthread_attr_destroy(&attr);
+        free(task);
+        return pdFAIL;
+    }
+    pthread_attr_destroy(&attr);
+    if (created_task) {
+        *created_task = task;
+    }
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    if (task == NULL) {
+        pthread_exit(NULL);
+    }
+    abort();    // deleting another task isn't supported
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    usleep((useconds_t)ticks * 1000);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (TickType_t)(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+// threads that weren't created by xTaskCreate get a handle on first use
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    pthread_once(&task_key_once, task_key_init);
+    struct rtos_task *task = pthread_getspecific(task_key);
+    if (task == NULL) {
+        task = calloc(1, sizeof(struct rtos_task));
+        task->thread = pthread_self();
+        pthread_setspecific(task_key, task);
+    }
+    return task;
+}
+
+static SemaphoreHandle_t semaphore_create(int count)
+{
+    struct rtos_sem *sem = calloc(1, sizeof(struct rtos_sem));
+    if (sem) {
+        sync_init(&sem->lock, &sem->cond);
+        sem->count = count;
+    }
+    return sem;
+}
+
+// no priority inheritance and not recursive, as the tested code never needs either
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return semaphore_create(1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return semaphore_create(0);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+    pthread_mutex_destroy(&sem->lock);
+    pthread_cond_destroy(&sem->cond);
+    free(sem);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    struct timespec deadline;
+    BaseType_t ret = pdTRUE;
+
+    deadline_after(ticks, &deadline);
+    pthread_mutex_lock(&sem->lock);
+    while (sem->count == 0) {
+        if (ticks == 0 || !cond_wait(&sem->cond, &sem->lock, ticks, &deadline)) {
+            ret = sem->count > 0 ? pdTRUE : pdFALSE;
+            break;
+        }
+    }
+    if (ret == pdTRUE) {
+        sem->count--;
+    }
+    pthread_mutex_unlock(&sem->lock);
+    return ret;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    BaseType_t ret = pdFALSE;
+
+    pthread_mutex_lock(&sem->lock);
+    if (sem->count == 0) {
+        sem->count = 1;
+        ret = pdTRUE;
+        pthread_cond_signal(&sem->cond);
+    }
+    pthread_mutex_unlock(&sem->lock);
+    return ret;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    struct rtos_queue *queue = calloc(1, sizeof(struct rtos_queue));
+    if (queue == NULL) {
+        return NULL;
+    }
+    queue->items = malloc(length * item_size);
+    if (queue->items == NULL) {
+        free(queue);
+        return NULL;
+    }
+    sync_init(&queue->lock, &queue->cond);
+    queue->length = length;
+    queue->item_size = item_size;
+    return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->cond);
+    free(queue->items);
+    free(queue);
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks)
+{
+    struct timespec deadline;
+
+    deadline_after(ticks, &deadline);
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->length) {
+        if (ticks == 0 || !cond_wait(&queue->cond, &queue->lock, ticks, &deadline)) {
+            if (queue->count == queue->length) {
+                pthread_mutex_unlock(&queue->lock);
+                return pdFALSE;
+            }
+        }
+    }
+    UBaseType_t tail = (queue->head + queue->count) % queue->length;
+    memcpy(queue->items + tail * queue->item_size, item, queue->item_size);
+    queue->count++;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks)
+{
+    struct timespec deadline;
+
+    deadline_after(ticks, &deadline);
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0) {
+        if (ticks == 0 || !cond_wait(&queue->cond, &queue->lock, ticks, &deadline)) {
+            if (queue->count == 0) {
+                pthread_mutex_unlock(&queue->lock);
+                return pdFALSE;
+            }
+        }
+    }
+    memcpy(item, queue->items + queue->head * queue->item_size, queue->item_size);
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+    return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    UBaseType_t count = queue->count;
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    UBaseType_t spaces = queue->length - queue->count;
+    pthread_mutex_unlock(&queue->lock);
+    return spaces;
+}
+
+EventGroupHandle_t xEventGroupCreate(void)
+{
+    struct rtos_event_group *group = calloc(1, sizeof(struct rtos_event_group));
+    if (group) {
+        sync_init(&group->lock, &group->cond);
+    }
+    return group;
+}
+
+void vEventGroupDelete(EventGroupHandle_t group)
+{
+    pthread_mutex_destroy(&group->lock);
+    pthread_cond_destroy(&group->cond);
+    free(group);
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits)
+{
+    pthread_mutex_lock(&group->lock);
+    group->bits |= bits;
+    EventBits_t ret = group->bits;
+    pthread_cond_broadcast(&group->cond);
+    pthread_mutex_unlock(&group->lock);
+    return ret;
+}
+
+// returns the bits before they were cleared, like FreeRTOS
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits)
+{
+    pthread_mutex_lock(&group->lock);
+    EventBits_t ret = group->bits;
+    group->bits &= ~bits;
+    pthread_mutex_unlock(&group->lock);
+    return ret;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group)
+{
+    pthread_mutex_lock(&group->lock);
+    EventBits_t ret = group->bits;
+    pthread_mutex_unlock(&group->lock);
+    return ret;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear_on_exit,
+                                BaseType_t wait_for_all, TickType_t ticks)
+{
+    struct timespec deadline;
+    EventBits_t ret;
+
+    deadline_after(ticks, &deadline);
+    pthread_mutex_lock(&group->lock);
+    for (;;) {
+        bool done = wait_for_all ? (group->bits & bits) == bits : (group->bits & bits) != 0;
+        if (done) {
+            ret = group->bits;
+            if (clear_on_exit) {
+                group->bits &= ~bits;
+            }
+            break;
+        }
+        if (ticks == 0 || !cond_wait(&group->cond, &group->lock, ticks, &deadline)) {
+            done = wait_for_all ? (group->bits & bits) == bits : (group->bits & bits) != 0;
+            if (!done) {
+                ret = group->bits;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&group->lock);
+    return ret;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "FreeRTOS.h"
+
+typedef struct rtos_task* TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+/* a detached thread, stack size and priority are ignored */
+BaseType_t xTaskCreate(TaskFunction_t task_code, const char *name, uint32_t stack_depth,
+                       void *parameters, UBaseType_t priority, TaskHandle_t *created_task);
+/* NULL only: ends the calling thread */
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount(void);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
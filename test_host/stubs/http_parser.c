@@ -0,0 +1,235 @@
+/*
+ * host build: enough of an HTTP/1.x response parser for the WebSocket upgrade, it stops
+ * behind the headers. Header fields and values are handed to the callbacks in pieces
+ * when they span calls, like the real one does.
+ */
+#include "http_parser.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+enum {
+    S_VERSION = 0,
+    S_STATUS_CODE,
+    S_REASON,
+    S_STATUS_LF,
+    S_HEADER_START,
+    S_FIELD,
+    S_VALUE_START,
+    S_VALUE,
+    S_VALUE_LF,
+    S_HEADERS_LF,
+    S_DONE,
+};
+
+#define F_UPGRADE               1
+#define F_CONNECTION_UPGRADE    2
+
+void http_parser_init(http_parser *parser, enum http_parser_type type)
+{
+    void *data = parser->data;
+    memset(parser, 0, sizeof(*parser));
+    parser->data = data;
+    parser->type = type;
+}
+
+void http_parser_settings_init(http_parser_settings *settings)
+{
+    memset(settings, 0, sizeof(*settings));
+}
+
+const char *http_errno_description(enum http_errno err)
+{
+    switch (err) {
+        case HPE_OK: return "success";
+        case HPE_CB_header_field: return "the on_header_field callback failed";
+        case HPE_CB_header_value: return "the on_header_value callback failed";
+        case HPE_CB_headers_complete: return "the on_headers_complete callback failed";
+        case HPE_INVALID_VERSION: return "invalid HTTP version";
+        case HPE_INVALID_STATUS: return "invalid HTTP status code";
+        case HPE_INVALID_HEADER_TOKEN: return "invalid character in header";
+        case HPE_LF_EXPECTED: return "LF character expected";
+    }
+    return "unknown error";
+}
+
+static void header_done(http_parser *parser)
+{
+    parser->value[parser->value_len] = 0;
+    if (parser->name_len == 7 && strncasecmp(parser->name, "upgrade", 7) == 0) {
+        parser->flags |= F_UPGRADE;
+    } else if (parser->name_len == 10 && strncasecmp(parser->name, "connection", 10) == 0) {
+        for (char *p = parser->value; *p; p++) {
+            if (strncasecmp(p, "upgrade", 7) == 0) {
+                parser->flags |= F_CONNECTION_UPGRADE;
+            }
+        }
+    }
+    parser->name_len = 0;
+    parser->value_len = 0;
+}
+
+#define FAIL(e) do { parser->http_errno = (e); return i; } while (0)
+#define CALLBACK(cb, start, e) do {                                                   \
+        if (settings->cb && start && (size_t)(data + i - start) > 0                  \
+            && settings->cb(parser, start, data + i - start) != 0) FAIL(e);           \
+    } while (0)
+
+size_t http_parser_execute(http_parser *parser, const http_parser_settings *settings, const char *data, size_t len)
+{
+    const char *field = parser->state == S_FIELD ? data : NULL;
+    const char *value = parser->state == S_VALUE ? data : NULL;
+    size_t i;
+
+    if (parser->http_errno != HPE_OK) {
+        return 0;
+    }
+    for (i = 0; i < len && parser->state != S_DONE; i++) {
+        char c = data[i];
+        switch (parser->state) {
+            case S_VERSION:
+                if (c == ' ') {
+                    parser->state = S_STATUS_CODE;
+                } else if (!(isalnum((unsigned char)c) || c == '/' || c == '.')) {
+                    FAIL(HPE_INVALID_VERSION);
+                }
+                break;
+            case S_STATUS_CODE:
+                if (isdigit((unsigned char)c)) {
+                    parser->status_code = parser->status_code * 10 + (c - '0');
+                    if (parser->status_code > 999) FAIL(HPE_INVALID_STATUS);
+                } else if (c == ' ') {
+                    parser->state = S_REASON;
+                } else if (c == '\r') {
+                    parser->state = S_STATUS_LF;
+                } else {
+                    FAIL(HPE_INVALID_STATUS);
+                }
+                break;
+            case S_REASON:
+                if (c == '\r') {
+                    parser->state = S_STATUS_LF;
+                }
+                break;
+            case S_STATUS_LF:
+            case S_VALUE_LF:
+                if (c != '\n') FAIL(HPE_LF_EXPECTED);
+                parser->state = S_HEADER_START;
+                break;
+            case S_HEADER_START:
+                if (c == '\r') {
+                    parser->state = S_HEADERS_LF;
+                    break;
+                }
+                if (c == ':' || isspace((unsigned char)c)) FAIL(HPE_INVALID_HEADER_TOKEN);
+                parser->state = S_FIELD;
+                field = data + i;
+                /* fall through */
+            case S_FIELD:
+                if (c == ':') {
+                    CALLBACK(on_header_field, field, HPE_CB_header_field);
+                    field = NULL;
+                    parser->state = S_VALUE_START;
+                } else if (c == '\r' || c == '\n') {
+                    FAIL(HPE_INVALID_HEADER_TOKEN);
+                } else if (parser->name_len < sizeof(parser->name)) {
+                    parser->name[parser->name_len++] = c;
+                }
+                break;
+            case S_VALUE_START:
+                if (c == ' ' || c == '\t') {
+                    break;
+                }
+                parser->state = S_VALUE;
+                value = data + i;
+                /* fall through */
+            case S_VALUE:
+                if (c == '\r') {
+                    CALLBACK(on_header_value, value, HPE_CB_header_value);
+                    value = NULL;
+                    header_done(parser);
+                    parser->state = S_VALUE_LF;
+                } else if (parser->value_len < sizeof(parser->value) - 1) {
+                    parser->value[parser->value_len++] = c;
+                }
+                break;
+            case S_HEADERS_LF:
+                if (c != '\n') FAIL(HPE_LF_EXPECTED);
+                parser->upgrade = (parser->flags & F_UPGRADE) && (parser->flags & F_CONNECTION_UPGRADE)
+                                  && parser->status_code == 101;
+                parser->state = S_DONE;
+                if (settings->on_headers_complete && settings->on_headers_complete(parser) != 0) {
+                    FAIL(HPE_CB_headers_complete);
+                }
+                break;
+        }
+    }
+    // pieces that continue in the next call
+    if (parser->state == S_FIELD) {
+        CALLBACK(on_header_field, field, HPE_CB_header_field);
+    } else if (parser->state == S_VALUE) {
+        CALLBACK(on_header_value, value, HPE_CB_header_value);
+    }
+    return i;
+}
+
+void http_parser_url_init(struct http_parser_url *u)
+{
+    memset(u, 0, sizeof(*u));
+}
+
+static void url_field(struct http_parser_url *u, int field, const char *buf, const char *start, const char *end)
+{
+    u->field_set |= 1 << field;
+    u->field_data[field].off = start - buf;
+    u->field_data[field].len = end - start;
+}
+
+// scheme://host[:port][/path][?query][#fragment], no userinfo or IPv6 literals
+int http_parser_parse_url(const char *buf, size_t buflen, int is_connect, struct http_parser_url *u)
+{
+    const char *end = buf + buflen;
+    const char *p = buf;
+
+    http_parser_url_init(u);
+    while (p < end && (isalnum((unsigned char)*p) || *p == '+' || *p == '-' || *p == '.')) p++;
+    if (p == buf || end - p < 3 || strncmp(p, "://", 3) != 0) {
+        return 1;
+    }
+    url_field(u, UF_SCHEMA, buf, buf, p);
+    p += 3;
+
+    const char *host = p;
+    while (p < end && *p != ':' && *p != '/' && *p != '?' && *p != '#') p++;
+    if (p == host) {
+        return 1;
+    }
+    url_field(u, UF_HOST, buf, host, p);
+    if (p < end && *p == ':') {
+        const char *port = ++p;
+        while (p < end && isdigit((unsigned char)*p)) p++;
+        if (p == port || p - port > 5 || atoi(port) > 65535) {
+            return 1;
+        }
+        url_field(u, UF_PORT, buf, port, p);
+        u->port = atoi(port);
+    }
+    if (p < end && *p == '/') {
+        const char *path = p;
+        while (p < end && *p != '?' && *p != '#') p++;
+        url_field(u, UF_PATH, buf, path, p);
+    }
+    if (p < end && *p == '?') {
+        const char *query = ++p;
+        while (p < end && *p != '#') p++;
+        url_field(u, UF_QUERY, buf, query, p);
+    }
+    if (p < end && *p == '#') {
+        p++;
+        url_field(u, UF_FRAGMENT, buf, p, end);
+        p = end;
+    }
+    return p == end ? 0 : 1;
+}
@@ -0,0 +1,82 @@
+/*
+ * host build: the part of nodejs/http_parser ws_client.c uses, see http_parser.c. URLs
+ * are split into schema, host, port and path, responses are parsed up to the end of the
+ * headers, which is as far as a WebSocket upgrade goes.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum http_parser_type { HTTP_REQUEST, HTTP_RESPONSE, HTTP_BOTH };
+
+enum http_errno {
+    HPE_OK,
+    HPE_CB_header_field,
+    HPE_CB_header_value,
+    HPE_CB_headers_complete,
+    HPE_INVALID_VERSION,
+    HPE_INVALID_STATUS,
+    HPE_INVALID_HEADER_TOKEN,
+    HPE_LF_EXPECTED,
+};
+
+typedef struct http_parser {
+    unsigned int type : 2;
+    unsigned int state : 8;
+    unsigned int flags : 8;
+    unsigned int status_code : 16;
+    unsigned int http_errno : 7;
+    unsigned int upgrade : 1;
+    void *data;
+    /* private: the header being parsed, enough of it to spot Upgrade and Connection */
+    char name[16];
+    char value[64];
+    uint8_t name_len;
+    uint8_t value_len;
+} http_parser;
+
+typedef int (*http_data_cb)(http_parser *, const char *at, size_t length);
+typedef int (*http_cb)(http_parser *);
+
+typedef struct {
+    http_cb on_message_begin;
+    http_data_cb on_url;
+    http_data_cb on_status;
+    http_data_cb on_header_field;
+    http_data_cb on_header_value;
+    http_cb on_headers_complete;
+    http_data_cb on_body;
+    http_cb on_message_complete;
+    http_cb on_chunk_header;
+    http_cb on_chunk_complete;
+} http_parser_settings;
+
+enum http_parser_url_fields {
+    UF_SCHEMA = 0,
+    UF_HOST = 1,
+    UF_PORT = 2,
+    UF_PATH = 3,
+    UF_QUERY = 4,
+    UF_FRAGMENT = 5,
+    UF_USERINFO = 6,
+    UF_MAX = 7
+};
+
+struct http_parser_url {
+    uint16_t field_set;
+    uint16_t port;
+    struct {
+        uint16_t off;
+        uint16_t len;
+    } field_data[UF_MAX];
+};
+
+#define HTTP_PARSER_ERRNO(p) ((enum http_errno)(p)->http_errno)
+
+void http_parser_init(http_parser *parser, enum http_parser_type type);
+void http_parser_settings_init(http_parser_settings *settings);
+size_t http_parser_execute(http_parser *parser, const http_parser_settings *settings, const char *data, size_t len);
+const char *http_errno_description(enum http_errno err);
+void http_parser_url_init(struct http_parser_url *u);
+int http_parser_parse_url(const char *buf, size_t buflen, int is_connect, struct http_parser_url *u);
@@ -0,0 +1,4 @@
+/* host build: lwip's resolver API is the POSIX one */
+#pragma once
+
+#include <netdb.h>
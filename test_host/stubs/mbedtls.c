@@ -0,0 +1,293 @@
+/*
+ * host build: SHA-1 and base64 for the WebSocket handshake are real, TLS is not there
+ * and every handshake fails.
+ */
+#include "mbedtls/base64.h"
+#include "mbedtls/sha1.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/net_sockets.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1_block(uint32_t h[5], const unsigned char *p)
+{
+    uint32_t w[80];
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 80; i++) {
+        w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+    for (int i = 0; i < 80; i++) {
+        uint32_t f, k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        uint32_t t = ROL(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = ROL(b, 30);
+        b = a;
+        a = t;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
+
+int mbedtls_sha1_ret(const unsigned char *input, size_t ilen, unsigned char output[20])
+{
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    unsigned char tail[128] = { 0 };
+    size_t full = ilen & ~(size_t)63;
+    size_t rest = ilen - full;
+
+    for (size_t i = 0; i < full; i += 64) {
+        sha1_block(h, input + i);
+    }
+    memcpy(tail, input + full, rest);
+    tail[rest] = 0x80;
+    size_t tail_len = rest < 56 ? 64 : 128;
+    uint64_t bits = (uint64_t)ilen * 8;
+    for (int i = 0; i < 8; i++) {
+        tail[tail_len - 1 - i] = bits >> (8 * i);
+    }
+    for (size_t i = 0; i < tail_len; i += 64) {
+        sha1_block(h, tail + i);
+    }
+    for (int i = 0; i < 5; i++) {
+        output[4 * i] = h[i] >> 24;
+        output[4 * i + 1] = h[i] >> 16;
+        output[4 * i + 2] = h[i] >> 8;
+        output[4 * i + 3] = h[i];
+    }
+    return 0;
+}
+
+int mbedtls_base64_encode(unsigned char *dst, size_t dlen, size_t *olen, const unsigned char *src, size_t slen)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t n = (slen + 2) / 3 * 4;
+
+    if (dlen < n + 1) {
+        *olen = n + 1;
+        return MBEDTLS_ERR_BASE64_BUFFER_TOO_SMALL;
+    }
+    unsigned char *p = dst;
+    for (size_t i = 0; i < slen; i += 3) {
+        uint32_t v = (uint32_t)src[i] << 16;
+        if (i + 1 < slen) v |= (uint32_t)src[i + 1] << 8;
+        if (i + 2 < slen) v |= src[i + 2];
+        *p++ = alphabet[(v >> 18) & 0x3F];
+        *p++ = alphabet[(v >> 12) & 0x3F];
+        *p++ = i + 1 < slen ? alphabet[(v >> 6) & 0x3F] : '=';
+        *p++ = i + 2 < slen ? alphabet[v & 0x3F] : '=';
+    }
+    *p = 0;
+    *olen = n;
+    return 0;
+}
+
+void mbedtls_net_init(mbedtls_net_context *ctx)
+{
+    ctx->fd = -1;
+}
+
+void mbedtls_net_free(mbedtls_net_context *ctx)
+{
+    if (ctx->fd >= 0) {
+        close(ctx->fd);
+    }
+    ctx->fd = -1;
+}
+
+int mbedtls_net_send(void *ctx, const unsigned char *buf, size_t len)
+{
+    return MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE;
+}
+
+int mbedtls_net_recv(void *ctx, unsigned char *buf, size_t len)
+{
+    return MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE;
+}
+
+void mbedtls_ssl_init(mbedtls_ssl_context *ssl)
+{
+    memset(ssl, 0, sizeof(*ssl));
+}
+
+void mbedtls_ssl_free(mbedtls_ssl_context *ssl)
+{
+}
+
+int mbedtls_ssl_setup(mbedtls_ssl_context *ssl, const mbedtls_ssl_config *conf)
+{
+    return 0;
+}
+
+int mbedtls_ssl_set_hostname(mbedtls_ssl_context *ssl, const char *hostname)
+{
+    return 0;
+}
+
+void mbedtls_ssl_set_bio(mbedtls_ssl_context *ssl, void *p_bio, mbedtls_ssl_send_t *f_send,
+                         mbedtls_ssl_recv_t *f_recv, mbedtls_ssl_recv_timeout_t *f_recv_timeout)
+{
+}
+
+int mbedtls_ssl_set_session(mbedtls_ssl_context *ssl, const mbedtls_ssl_session *session)
+{
+    return 0;
+}
+
+int mbedtls_ssl_get_session(const mbedtls_ssl_context *ssl, mbedtls_ssl_session *session)
+{
+    return MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE;
+}
+
+void mbedtls_ssl_session_init(mbedtls_ssl_session *session)
+{
+    memset(session, 0, sizeof(*session));
+}
+
+void mbedtls_ssl_session_free(mbedtls_ssl_session *session)
+{
+}
+
+int mbedtls_ssl_handshake(mbedtls_ssl_context *ssl)
+{
+    return MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE;
+}
+
+size_t mbedtls_ssl_get_bytes_avail(const mbedtls_ssl_context *ssl)
+{
+    return 0;
+}
+
+int mbedtls_ssl_read(mbedtls_ssl_context *ssl, unsigned char *buf, size_t len)
+{
+    return MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE;
+}
+
+int mbedtls_ssl_write(mbedtls_ssl_context *ssl, const unsigned char *buf, size_t len)
+{
+    return MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE;
+}
+
+int mbedtls_ssl_close_notify(mbedtls_ssl_context *ssl)
+{
+    return 0;
+}
+
+void mbedtls_ssl_config_init(mbedtls_ssl_config *conf)
+{
+}
+
+void mbedtls_ssl_config_free(mbedtls_ssl_config *conf)
+{
+}
+
+int mbedtls_ssl_config_defaults(mbedtls_ssl_config *conf, int endpoint, int transport, int preset)
+{
+    return 0;
+}
+
+void mbedtls_ssl_conf_authmode(mbedtls_ssl_config *conf, int authmode)
+{
+}
+
+void mbedtls_ssl_conf_ca_chain(mbedtls_ssl_config *conf, mbedtls_x509_crt *ca_chain, void *ca_crl)
+{
+}
+
+int mbedtls_ssl_conf_own_cert(mbedtls_ssl_config *conf, mbedtls_x509_crt *own_cert, mbedtls_pk_context *pk_key)
+{
+    return 0;
+}
+
+void mbedtls_ssl_conf_rng(mbedtls_ssl_config *conf, int (*f_rng)(void *, unsigned char *, size_t), void *p_rng)
+{
+}
+
+void mbedtls_ssl_conf_session_tickets(mbedtls_ssl_config *conf, int use_tickets)
+{
+}
+
+void mbedtls_entropy_init(mbedtls_entropy_context *ctx)
+{
+}
+
+void mbedtls_entropy_free(mbedtls_entropy_context *ctx)
+{
+}
+
+int mbedtls_entropy_func(void *data, unsigned char *output, size_t len)
+{
+    return 0;
+}
+
+void mbedtls_ctr_drbg_init(mbedtls_ctr_drbg_context *ctx)
+{
+}
+
+void mbedtls_ctr_drbg_free(mbedtls_ctr_drbg_context *ctx)
+{
+}
+
+int mbedtls_ctr_drbg_seed(mbedtls_ctr_drbg_context *ctx, int (*f_entropy)(void *, unsigned char *, size_t),
+                          void *p_entropy, const unsigned char *custom, size_t len)
+{
+    return 0;
+}
+
+int mbedtls_ctr_drbg_random(void *p_rng, unsigned char *output, size_t output_len)
+{
+    return 0;
+}
+
+void mbedtls_x509_crt_init(mbedtls_x509_crt *crt)
+{
+}
+
+void mbedtls_x509_crt_free(mbedtls_x509_crt *crt)
+{
+}
+
+int mbedtls_x509_crt_parse(mbedtls_x509_crt *chain, const unsigned char *buf, size_t buflen)
+{
+    return 0;
+}
+
+void mbedtls_pk_init(mbedtls_pk_context *ctx)
+{
+}
+
+void mbedtls_pk_free(mbedtls_pk_context *ctx)
+{
+}
+
+int mbedtls_pk_parse_key(mbedtls_pk_context *ctx, const unsigned char *key, size_t keylen,
+                         const unsigned char *pwd, size_t pwdlen)
+{
+    return 0;
+}
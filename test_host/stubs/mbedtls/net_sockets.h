@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stddef.h>
+
+typedef struct { int fd; } mbedtls_net_context;
+
+void mbedtls_net_init(mbedtls_net_context *ctx);
+void mbedtls_net_free(mbedtls_net_context *ctx);
+int mbedtls_net_send(void *ctx, const unsigned char *buf, size_t len);
+int mbedtls_net_recv(void *ctx, unsigned char *buf, size_t len);
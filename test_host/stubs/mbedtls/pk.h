@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stddef.h>
+
+typedef struct { int unused; } mbedtls_pk_context;
+
+void mbedtls_pk_init(mbedtls_pk_context *ctx);
+void mbedtls_pk_free(mbedtls_pk_context *ctx);
+int mbedtls_pk_parse_key(mbedtls_pk_context *ctx, const unsigned char *key, size_t keylen,
+                         const unsigned char *pwd, size_t pwdlen);
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stddef.h>
+
+typedef struct { int unused; } mbedtls_x509_crt;
+
+void mbedtls_x509_crt_init(mbedtls_x509_crt *crt);
+void mbedtls_x509_crt_free(mbedtls_x509_crt *crt);
+int mbedtls_x509_crt_parse(mbedtls_x509_crt *chain, const unsigned char *buf, size_t buflen);
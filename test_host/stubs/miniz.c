@@ -0,0 +1,63 @@
+#include "rom/miniz.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static voidpf arena_alloc(voidpf opaque, uInt items, uInt size)
+{
+    tinfl_decompressor *r = opaque;
+    size_t len = ((size_t)items * size + 15) & ~(size_t)15;
+    if (r->arena_used + len > sizeof(r->arena)) {
+        return Z_NULL;
+    }
+    voidpf p = r->arena + r->arena_used;
+    r->arena_used += len;
+    return p;
+}
+
+static void arena_free(voidpf opaque, voidpf address)
+{
+}
+
+void tinfl_host_init(tinfl_decompressor *r)
+{
+    memset(&r->z, 0, sizeof(r->z));
+    r->arena_used = 0;
+    r->z.zalloc = arena_alloc;
+    r->z.zfree = arena_free;
+    r->z.opaque = r;
+    if (inflateInit2(&r->z, -15) != Z_OK) {
+        abort();
+    }
+}
+
+tinfl_status tinfl_decompress(tinfl_decompressor *r, const uint8_t *pIn_buf_next, size_t *pIn_buf_size,
+                              uint8_t *pOut_buf_start, uint8_t *pOut_buf_next, size_t *pOut_buf_size,
+                              const uint32_t decomp_flags)
+{
+    if (decomp_flags & (TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF)) {
+        return TINFL_STATUS_BAD_PARAM;
+    }
+    r->z.next_in = (Bytef *)pIn_buf_next;
+    r->z.avail_in = *pIn_buf_size;
+    r->z.next_out = pOut_buf_next;
+    r->z.avail_out = *pOut_buf_size;
+
+    int ret = inflate(&r->z, Z_SYNC_FLUSH);
+    *pIn_buf_size -= r->z.avail_in;
+    *pOut_buf_size -= r->z.avail_out;
+
+    if (ret == Z_STREAM_END) {
+        return TINFL_STATUS_DONE;
+    }
+    if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        return TINFL_STATUS_FAILED;
+    }
+    if (r->z.avail_out == 0) {
+        return TINFL_STATUS_HAS_MORE_OUTPUT;
+    }
+    if (r->z.avail_in == 0) {
+        return (decomp_flags & TINFL_FLAG_HAS_MORE_INPUT) ? TINFL_STATUS_NEEDS_MORE_INPUT : TINFL_STATUS_FAILED;
+    }
+    return TINFL_STATUS_FAILED;
+}
@@ -0,0 +1,44 @@
+#ifndef _ROM_MINIZ_H_
+#define _ROM_MINIZ_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+
+/*
+ * host build: the tinfl calls of the ROM miniz, on zlib's raw inflate. The output
+ * buffer is used the wrapping way (TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF unset)
+ * only, zlib keeps its own window so the caller's ring is just where output lands.
+ */
+
+typedef enum {
+    TINFL_STATUS_BAD_PARAM = -3,
+    TINFL_STATUS_ADLER32_MISMATCH = -2,
+    TINFL_STATUS_FAILED = -1,
+    TINFL_STATUS_DONE = 0,
+    TINFL_STATUS_NEEDS_MORE_INPUT = 1,
+    TINFL_STATUS_HAS_MORE_OUTPUT = 2
+} tinfl_status;
+
+enum {
+    TINFL_FLAG_PARSE_ZLIB_HEADER = 1,
+    TINFL_FLAG_HAS_MORE_INPUT = 2,
+    TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF = 4,
+    TINFL_FLAG_COMPUTE_ADLER32 = 8
+};
+
+/* zlib allocates from the arena, so dropping the decompressor leaks nothing */
+typedef struct {
+    z_stream z;
+    size_t arena_used;
+    uint8_t arena[48 * 1024];
+} tinfl_decompressor;
+
+void tinfl_host_init(tinfl_decompressor *r);
+#define tinfl_init(r) tinfl_host_init(r)
+
+tinfl_status tinfl_decompress(tinfl_decompressor *r, const uint8_t *pIn_buf_next, size_t *pIn_buf_size,
+                              uint8_t *pOut_buf_start, uint8_t *pOut_buf_next, size_t *pOut_buf_size,
+                              const uint32_t decomp_flags);
+
+#endif
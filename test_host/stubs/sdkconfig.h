@@ -0,0 +1,7 @@
+/* host build configuration, stands in for the generated build/include/sdkconfig.h */
+#pragma once
+
+#define CONFIG_LOG_DEFAULT_LEVEL 2
+#define CONFIG_ESP_HTTP_CLIENT_ENABLE_HTTPS 1
+#define CONFIG_WS_CLIENT_TRACE 1
+#define CONFIG_WS_CLIENT_TRACE_ENTRIES 64
@@ -0,0 +1,179 @@
+/*
+ * runs the epd2in9 driver against the simulated controller: every refresh must
+ * show exactly the frame that was sent, with the BUSY time its LUT asks for.
+ *   test_epd [panel.pbm]
+ */
+#include "epd2in9.h"
+#include "epdif.h"
+#include "epdif_sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FRAME_BYTES ((EPD_WIDTH / 8) * EPD_HEIGHT)
+
+static int failures;
+
+#define CHECK(cond, ...) do {                                           \
+        if (!(cond)) {                                                  \
+            failures++;                                                 \
+            printf("FAIL %s:%d: %s: ", __FILE__, __LINE__, #cond);      \
+            printf(__VA_ARGS__);                                        \
+            printf("\n");                                               \
+        }                                                               \
+    } while (0)
+
+// frame time of the driver's init script: (296 gate + 26 dummy lines) * 62us
+#define FRAME_US ((EPD_HEIGHT + 0x1A) * 62)
+#define FULL_FRAMES 79
+#define PARTIAL_FRAMES 20
+
+static void fill_pattern(uint8_t *frame) {
+    // 8x8 checkerboard with a diagonal, so a wrong row or byte order shows
+    for (int y = 0; y < EPD_HEIGHT; y++) {
+        for (int x = 0; x < EPD_WIDTH / 8; x++) {
+            uint8_t v = ((x + y / 8) & 1) ? 0xFF : 0x00;
+            if (y % (EPD_WIDTH / 8 * 8) / 8 == x) {
+                v ^= 0x80 >> (y % 8);
+            }
+            frame[y * (EPD_WIDTH / 8) + x] = v;
+        }
+    }
+}
+
+// one UI action: what went over SPI and how long the panel kept BUSY up
+static void report(const char *action, const epdif_stats_t *before, int64_t start_us) {
+    epdif_stats_t after;
+    epdif_get_stats(&after);
+    printf("%-24s %6d bytes %4d transactions  spi %4d ms  busy %5d ms  total %5d ms\n", action,
+           (int)(after.bytes - before->bytes), (int)(after.transactions - before->transactions),
+           (int)((after.spi_us - before->spi_us) / 1000), (int)((after.busy_us - before->busy_us) / 1000),
+           (int)((epd_sim_time_us() - start_us) / 1000));
+}
+
+static void test_full_update(uint8_t *frame) {
+    epdif_stats_t before;
+    epd_sim_stats_t stats;
+    int64_t start = epd_sim_time_us();
+    epdif_get_stats(&before);
+
+    epd_set_temperature(EPD_TEMPERATURE_DEFAULT);
+    epd_init(EPD_2IN9_LUT_UPDATE_FULL);
+    const epd_sim_state_t *state = epd_sim_state();
+    CHECK(state->entry_mode == 0x03, "entry mode 0x%02X", state->entry_mode);
+    CHECK(state->gate_lines == EPD_HEIGHT, "%d gate lines", state->gate_lines);
+    CHECK(state->lut_loaded, "no LUT");
+    CHECK(state->temperature == EPD_TEMPERATURE_DEFAULT, "temperature %d", state->temperature);
+
+    fill_pattern(frame);
+    epd_set_frame_memory(frame);
+    CHECK(memcmp(epd_sim_ram(), frame, FRAME_BYTES) == 0, "RAM differs from the frame");
+    // the counters wrapped around the full window back to the start
+    CHECK(state->x == 0 && state->y == 0, "counters at %d,%d", state->x, state->y);
+
+    epd_display_frame();
+    epd_sim_get_stats(&stats);
+    CHECK(memcmp(epd_sim_panel(), frame, FRAME_BYTES) == 0, "panel differs from the frame");
+    CHECK(stats.refreshes == 1, "%d refreshes", (int)stats.refreshes);
+    CHECK(stats.last_refresh_us == (int64_t)FULL_FRAMES * FRAME_US, "full refresh %d us",
+          (int)stats.last_refresh_us);
+    report("full update", &before, start);
+}
+
+static void test_partial_update(uint8_t *frame) {
+    epdif_stats_t before;
+    epd_sim_stats_t stats;
+    int64_t start = epd_sim_time_us();
+    epdif_get_stats(&before);
+
+    // a 40x20 block at 16,100 like the clock area, the rest of the panel stays
+    uint8_t image[5 * 20];
+    for (int i = 0; i < sizeof(image); i++) {
+        image[i] = i;
+    }
+    epd_init(EPD_2IN9_LUT_UPDATE_PART);
+    epd_set_image_memory(image, 16, 100, 40, 20);
+    epd_display_frame();
+    for (int y = 0; y < 20; y++) {
+        memcpy(&frame[(100 + y) * (EPD_WIDTH / 8) + 2], &image[y * 5], 5);
+    }
+    CHECK(memcmp(epd_sim_panel(), frame, FRAME_BYTES) == 0, "panel differs after a partial update");
+
+    epd_sim_get_stats(&stats);
+    CHECK(stats.last_refresh_us == (int64_t)PARTIAL_FRAMES * FRAME_US, "partial refresh %d us",
+          (int)stats.last_refresh_us);
+    report("partial update 40x20", &before, start);
+
+    // clipped at the right edge: rows go out one by one, only their visible part
+    epdif_get_stats(&before);
+    start = epd_sim_time_us();
+    epd_set_image_memory(image, 104, 0, 40, 20);
+    epd_display_frame();
+    for (int y = 0; y < 20; y++) {
+        memcpy(&frame[y * (EPD_WIDTH / 8) + 13], &image[y * 5], 3);
+    }
+    CHECK(memcmp(epd_sim_panel(), frame, FRAME_BYTES) == 0, "panel differs after a clipped update");
+    report("partial update clipped", &before, start);
+}
+
+// the waveform bands: colder is slower, warmer is faster
+static void test_temperature() {
+    int64_t refresh[3];
+    const int temperatures[3] = { 0, EPD_TEMPERATURE_DEFAULT, 35 };
+    epd_sim_stats_t stats;
+
+    for (int i = 0; i < 3; i++) {
+        epd_set_temperature(temperatures[i]);
+        epd_init(EPD_2IN9_LUT_UPDATE_FULL);
+        CHECK(epd_sim_state()->temperature == temperatures[i], "controller got %d C", epd_sim_state()->temperature);
+        epd_display_frame();
+        epd_sim_get_stats(&stats);
+        refresh[i] = stats.last_refresh_us;
+        printf("full refresh at %2d C: %d ms\n", temperatures[i], (int)(refresh[i] / 1000));
+    }
+    CHECK(refresh[0] > refresh[1] && refresh[1] > refresh[2], "%d, %d, %d ms",
+          (int)(refresh[0] / 1000), (int)(refresh[1] / 1000), (int)(refresh[2] / 1000));
+    epd_set_temperature(EPD_TEMPERATURE_DEFAULT);
+}
+
+static void test_sleep() {
+    epd_sim_stats_t stats;
+    epd_sleep();
+    CHECK(epd_sim_state()->asleep, "not asleep");
+    // the next epd_init() resets the controller, which wakes it
+    epd_init(EPD_2IN9_LUT_UPDATE_PART);
+    CHECK(!epd_sim_state()->asleep, "still asleep");
+    epd_sim_get_stats(&stats);
+    CHECK(stats.errors == 0, "%d protocol errors", (int)stats.errors);
+}
+
+// refresh timing must not depend on the SPI clock, as epd_calibrate_spi_clock() expects
+static void test_calibrate() {
+    int hz = epd_calibrate_spi_clock();
+    CHECK(hz == 40 * 1000 * 1000, "calibrated to %d kHz", hz / 1000);
+}
+
+int main(int argc, char **argv) {
+    epdif_pin_config_t pin_cfg = { 0 };
+    uint8_t *frame = malloc(FRAME_BYTES);
+    epd_sim_stats_t stats;
+
+    epdif_init(&pin_cfg, EPD_WIDTH, EPD_HEIGHT);
+    test_full_update(frame);
+    test_partial_update(frame);
+    if (argc > 1 && epd_sim_dump_pbm(argv[1]) == 0) {
+        printf("panel written to %s\n", argv[1]);
+    }
+    test_temperature();
+    test_sleep();
+    test_calibrate();
+
+    epd_sim_get_stats(&stats);
+    CHECK(stats.errors == 0, "%d protocol errors", (int)stats.errors);
+    epdif_log_stats();
+    free(frame);
+
+    printf("%s: %d failures\n", argv[0], failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,270 @@
+/*
+ * json_scan() and json_unescape() on PushBullet messages, the way pushbullet_mirror_msg()
+ * uses them, and against cJSON, which it replaced, on a recorded stream.
+ *   test_json_scan [recorded stream, one message per line] [bench]
+ * bench times both on the stream's pushes and counts cJSON's allocations. cJSON is the
+ * one from ESP-IDF, built in when the Makefile finds it (CJSON_DIR), skipped otherwise.
+ */
+#include "json_scan.h"
+#include "esp_timer.h"
+
+#ifdef HAVE_CJSON
+#include "cJSON.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int failures;
+
+#define CHECK(cond, ...) do {                                           \
+        if (!(cond)) {                                                  \
+            failures++;                                                 \
+            printf("FAIL %s:%d: %s: ", __FILE__, __LINE__, #cond);      \
+            printf(__VA_ARGS__);                                        \
+            printf("\n");                                               \
+        }                                                               \
+    } while (0)
+
+#define MESSAGE_SIZE (128*3+1)      /* ui_data.message */
+#define MAX_LINES 256
+#define BENCH_ROUNDS 20000
+
+typedef enum {
+    PUSH_IGNORED,
+    PUSH_DISMISSAL,
+    PUSH_MIRROR,
+} push_kind_t;
+
+static char *lines[MAX_LINES];
+static int line_lens[MAX_LINES];
+static int line_count;
+
+// pushbullet_mirror_msg() without the UI
+static push_kind_t scan_push(const char *json, int len, char *message, int size)
+{
+    enum { TYPE, PUSH_TYPE, PUSH_BODY };
+    json_scan_field_t fields[] = {
+        [TYPE] = { .path = "type" },
+        [PUSH_TYPE] = { .path = "push.type" },
+        [PUSH_BODY] = { .path = "push.body" },
+    };
+    if (json_scan(json, len, fields, sizeof(fields) / sizeof(fields[0])) < 0) return PUSH_IGNORED;
+    if (!json_scan_equals(&fields[TYPE], "push")) return PUSH_IGNORED;
+    if (json_scan_equals(&fields[PUSH_TYPE], "dismissal")) return PUSH_DISMISSAL;
+    if (!json_scan_equals(&fields[PUSH_TYPE], "mirror")) return PUSH_IGNORED;
+    if (!fields[PUSH_BODY].is_string) return PUSH_IGNORED;
+
+    json_unescape(fields[PUSH_BODY].value, fields[PUSH_BODY].len, message, size);
+    return PUSH_MIRROR;
+}
+
+#ifdef HAVE_CJSON
+static int cjson_allocs;
+
+static void *counting_malloc(size_t size)
+{
+    cjson_allocs++;
+    return malloc(size);
+}
+
+// what pushbullet_mirror_msg() did before json_scan, the whole body copied out
+static push_kind_t cjson_push(const char *json, char *message, int size)
+{
+    push_kind_t kind = PUSH_IGNORED;
+    cJSON *root = cJSON_Parse(json);
+    if (!root) return PUSH_IGNORED;
+
+    cJSON *type = cJSON_GetObjectItemCaseSensitive(root, "type");
+    cJSON *push = cJSON_GetObjectItemCaseSensitive(root, "push");
+    if (cJSON_IsString(type) && strcmp(type->valuestring, "push") == 0 && push) {
+        cJSON *push_type = cJSON_GetObjectItemCaseSensitive(push, "type");
+        cJSON *body = cJSON_GetObjectItemCaseSensitive(push, "body");
+        if (cJSON_IsString(push_type) && strcmp(push_type->valuestring, "dismissal") == 0) {
+            kind = PUSH_DISMISSAL;
+        } else if (cJSON_IsString(push_type) && strcmp(push_type->valuestring, "mirror") == 0 && cJSON_IsString(body)) {
+            snprintf(message, size, "%s", body->valuestring);
+            kind = PUSH_MIRROR;
+        }
+    }
+    cJSON_Delete(root);
+    return kind;
+}
+#endif
+
+static void check_push(const char *json, push_kind_t kind, const char *body)
+{
+    char message[MESSAGE_SIZE];
+
+    push_kind_t got = scan_push(json, strlen(json), message, sizeof(message));
+    CHECK(got == kind, "%s: kind %d, expected %d", json, got, kind);
+    if (kind == PUSH_MIRROR && got == kind) {
+        CHECK(strcmp(message, body) == 0, "%s: body \"%s\"", json, message);
+    }
+}
+
+static void test_pushes()
+{
+    check_push("{\"type\": \"nop\"}", PUSH_IGNORED, NULL);
+    check_push("{\"type\": \"push\", \"push\": {\"type\": \"mirror\", \"title\": \"Mom\", \"body\": \"Dinner at 7?\"}}",
+               PUSH_MIRROR, "Dinner at 7?");
+    // order of the keys doesn't matter, neither does the same key name at another level
+    check_push("{\"push\": {\"body\": \"first\", \"type\": \"mirror\"}, \"type\": \"push\"}", PUSH_MIRROR, "first");
+    check_push("{\"type\": \"push\", \"push\": {\"type\": \"dismissal\", \"notification_id\": \"0\"}}", PUSH_DISMISSAL, NULL);
+    // keys inside arrays are never matched
+    check_push("{\"type\": \"push\", \"push\": {\"actions\": [{\"type\": \"mirror\", \"body\": \"no\"}], \"type\": \"note\"}}",
+               PUSH_IGNORED, NULL);
+    check_push("{\"type\": \"push\", \"push\": {\"type\": \"mirror\", \"body\": null}}", PUSH_IGNORED, NULL);
+    check_push("{\"type\": \"push\", \"push\": {\"type\": \"mirror\", \"body\": \"x\"", PUSH_MIRROR, "x");
+    check_push("{\"type\": \"push\", \"push\": {\"type\": \"mirr", PUSH_IGNORED, NULL);
+    check_push("[\"type\", \"push\"]", PUSH_IGNORED, NULL);
+    check_push("{\"type\": \"push\", \"push\": {\"type\": \"mirror\", \"body\": \"\\u660e\\u5929\\u89c1\\uff0c\\n\\\"q\\\" \\\\o/ \\ud83d\\ude00\"}}",
+               PUSH_MIRROR, "\xE6\x98\x8E\xE5\xA4\xA9\xE8\xA7\x81\xEF\xBC\x8C\n\"q\" \\o/ \xF0\x9F\x98\x80");
+}
+
+static void test_unescape()
+{
+    char buff[64];
+    int len;
+
+    // in place, the way a body can be decoded where it is
+    strcpy(buff, "a\\tb\\u00e9\\/c");
+    len = json_unescape(buff, strlen(buff), buff, sizeof(buff));
+    CHECK(len == 7 && strcmp(buff, "a\tb\xC3\xA9/c") == 0, "in place: %d \"%s\"", len, buff);
+
+    // cut before a character that doesn't fit, never inside it
+    len = json_unescape("ab\\u660e", 8, buff, 5);
+    CHECK(len == 2 && strcmp(buff, "ab") == 0, "cut escape: %d \"%s\"", len, buff);
+    len = json_unescape("ab\xE6\x98\x8E", 5, buff, 5);
+    CHECK(len == 2 && strcmp(buff, "ab") == 0, "cut UTF-8: %d \"%s\"", len, buff);
+    len = json_unescape("ab\xE6\x98\x8E", 5, buff, 6);
+    CHECK(len == 5 && memcmp(buff, "ab\xE6\x98\x8E", 6) == 0, "exact fit: %d", len);
+
+    // a lone surrogate and a bad escape
+    len = json_unescape("\\ud83dx", 7, buff, sizeof(buff));
+    CHECK(len == 4 && strcmp(buff, "\xEF\xBF\xBDx") == 0, "lone surrogate: %d", len);
+    len = json_unescape("\\uzzzz", 6, buff, sizeof(buff));
+    CHECK(strcmp(buff, "uzzzz") == 0, "bad escape: \"%s\"", buff);
+}
+
+// the recorded pushes through both, json_scan must read what cJSON reads
+static void test_recorded()
+{
+    char message[MESSAGE_SIZE];
+    int pushes = 0;
+
+    for (int i = 0; i < line_count; i++) {
+        push_kind_t kind = scan_push(lines[i], line_lens[i], message, sizeof(message));
+        pushes += kind != PUSH_IGNORED;
+#ifdef HAVE_CJSON
+        char expect[MESSAGE_SIZE];
+        push_kind_t expect_kind = cjson_push(lines[i], expect, sizeof(expect));
+        CHECK(kind == expect_kind, "line %d: kind %d, cJSON %d", i + 1, kind, expect_kind);
+        if (kind == PUSH_MIRROR && expect_kind == PUSH_MIRROR) {
+            CHECK(strcmp(message, expect) == 0, "line %d: \"%s\", cJSON \"%s\"", i + 1, message, expect);
+        }
+#endif
+    }
+    printf("recorded stream: %d messages, %d pushes\n", line_count, pushes);
+}
+
+static void bench()
+{
+    static char message[MESSAGE_SIZE];
+    static char copy[64 * 1024];
+    int push_lines[MAX_LINES];
+    int pushes = 0;
+    size_t bytes = 0;
+    unsigned sink = 0;
+
+    // nops and tickles are dropped before pushbullet_mirror_msg()
+    for (int i = 0; i < line_count; i++) {
+        if (strstr(lines[i], "\"push\": {")) {
+            push_lines[pushes++] = i;
+            bytes += line_lens[i];
+        }
+    }
+    if (pushes == 0) {
+        printf("bench: no pushes in the stream\n");
+        return;
+    }
+
+    int64_t start = esp_timer_get_time();
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        for (int i = 0; i < pushes; i++) {
+            // the body is decoded in place, start from the message as received every time
+            int n = push_lines[i];
+            memcpy(copy, lines[n], line_lens[n] + 1);
+            sink += scan_push(copy, line_lens[n], message, sizeof(message)) + message[0];
+        }
+    }
+    int64_t scan_us = esp_timer_get_time() - start;
+    int messages = BENCH_ROUNDS * pushes;
+    printf("json_scan: %.0f ns/message, %.0f MB/s, 0 allocations\n", scan_us * 1000.0 / messages,
+           bytes * (double)BENCH_ROUNDS / scan_us);
+
+#ifdef HAVE_CJSON
+    cJSON_Hooks hooks = { .malloc_fn = counting_malloc, .free_fn = free };
+    cJSON_InitHooks(&hooks);
+    cjson_allocs = 0;
+    start = esp_timer_get_time();
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        for (int i = 0; i < pushes; i++) {
+            int n = push_lines[i];
+            memcpy(copy, lines[n], line_lens[n] + 1);
+            sink += cjson_push(copy, message, sizeof(message)) + message[0];
+        }
+    }
+    int64_t cjson_us = esp_timer_get_time() - start;
+    printf("cJSON:     %.0f ns/message, %.0f MB/s, %.1f allocations/message, json_scan %.1fx faster\n",
+           cjson_us * 1000.0 / messages, bytes * (double)BENCH_ROUNDS / cjson_us, (double)cjson_allocs / messages,
+           (double)cjson_us / scan_us);
+#else
+    printf("cJSON not built in, set IDF_PATH or CJSON_DIR to compare\n");
+#endif
+    printf("(%d pushes of %zu bytes on average, checksum %u)\n", pushes, bytes / pushes, sink);
+}
+
+static void load_lines(const char *path)
+{
+    static char data[64 * 1024];
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    size_t len = fread(data, 1, sizeof(data) - 1, f);
+    fclose(f);
+    data[len] = 0;
+    for (char *p = data; *p && line_count < MAX_LINES;) {
+        char *end = strchr(p, '\n');
+        if (end) {
+            *end = 0;
+        }
+        if (*p) {
+            lines[line_count] = p;
+            line_lens[line_count++] = strlen(p);
+        }
+        if (end == NULL) {
+            break;
+        }
+        p = end + 1;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    load_lines(argc > 1 ? argv[1] : "data/pushbullet_stream.txt");
+
+    if (argc > 2 && strcmp(argv[2], "bench") == 0) {
+        bench();
+        return 0;
+    }
+    test_pushes();
+    test_unescape();
+    test_recorded();
+
+    printf("%d failures\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,863 @@
+/*
+ * ws_client.c against the scripted server in ws_server.c over loopback: a recorded
+ * PushBullet stream replayed plain and compressed, fragments with PINGs between them,
+ * oversized frames, slow drip delivery, frames behind the upgrade response, the CLOSE
+ * handshake, stop during connect and a group short of pool blocks.
+ *   test_ws_client [recorded stream, one message per line]
+ * Prints frames/s, bytes copied per frame and reconnect latency along the way.
+ */
+#include "ws_client.h"
+#include "ws_server.h"
+#include "esp_timer.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static int failures;
+
+#define CHECK(cond, ...) do {                                           \
+        if (!(cond)) {                                                  \
+            failures++;                                                 \
+            printf("FAIL %s:%d: %s: ", __FILE__, __LINE__, #cond);      \
+            printf(__VA_ARGS__);                                        \
+            printf("\n");                                               \
+        }                                                               \
+    } while (0)
+
+#define MAX_LINES 256
+#define REPLAY_ROUNDS 500
+#define WAIT_MS 5000
+
+static char *lines[MAX_LINES];
+static int line_lens[MAX_LINES];
+static int line_count;
+
+// what the event handler saw, written from the ws or dispatch task
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int connected;
+    int disconnected;
+    int messages;
+    int chunks;
+    bool replay;                /* compare messages with the recorded stream */
+    int mismatches;
+    int handler_ms;             /* a slow handler */
+    uint8_t *last;
+    int last_len;
+    bool last_truncated;
+    uint8_t *stream;            /* WS_EVENT_DATA chunks appended */
+    int stream_len;
+    int close_code;
+    char close_reason[126];
+    bool stray_data;            /* an event that has no data came with some */
+    int64_t first_us;
+    int64_t last_us;
+    int64_t max_latency_us;     /* of "t=<us>" messages */
+} recorder_t;
+
+static void recorder_init(recorder_t *rec)
+{
+    memset(rec, 0, sizeof(*rec));
+    pthread_mutex_init(&rec->lock, NULL);
+    pthread_cond_init(&rec->cond, NULL);
+}
+
+static void recorder_free(recorder_t *rec)
+{
+    free(rec->last);
+    free(rec->stream);
+    pthread_mutex_destroy(&rec->lock);
+    pthread_cond_destroy(&rec->cond);
+}
+
+static esp_err_t recorder_event(ws_event_t *event)
+{
+    recorder_t *rec = event->user_context;
+    int64_t now = esp_timer_get_time();
+
+    pthread_mutex_lock(&rec->lock);
+    switch (event->event_id) {
+        case WS_EVENT_CONNECTED:
+            rec->connected++;
+            rec->stray_data |= event->data != NULL || event->data_len != 0;
+            break;
+        case WS_EVENT_DISCONNECTED:
+            rec->disconnected++;
+            rec->close_code = event->close_code;
+            snprintf(rec->close_reason, sizeof(rec->close_reason), "%.*s", event->data_len, (char *)event->data);
+            break;
+        case WS_EVENT_DATA:
+            rec->chunks++;
+            rec->stream = realloc(rec->stream, rec->stream_len + event->data_len);
+            memcpy(rec->stream + rec->stream_len, event->data, event->data_len);
+            rec->stream_len += event->data_len;
+            break;
+        case WS_EVENT_DATA_FIN:
+            if (rec->replay) {
+                int i = rec->messages % line_count;
+                if (event->data_len != line_lens[i] || memcmp(event->data, lines[i], line_lens[i]) != 0) {
+                    rec->mismatches++;
+                }
+            } else {
+                free(rec->last);
+                rec->last = malloc(event->data_len + 1);
+                memcpy(rec->last, event->data, event->data_len + 1);
+                rec->last_len = event->data_len;
+                rec->last_truncated = event->truncated;
+            }
+            if (event->data_len > 2 && memcmp(event->data, "t=", 2) == 0) {
+                int64_t latency = now - strtoll((char *)event->data + 2, NULL, 10);
+                if (latency > rec->max_latency_us) {
+                    rec->max_latency_us = latency;
+                }
+            }
+            if (rec->messages == 0) {
+                rec->first_us = now;
+            }
+            rec->last_us = now;
+            rec->messages++;
+            break;
+        default:
+            break;
+    }
+    pthread_cond_broadcast(&rec->cond);
+    pthread_mutex_unlock(&rec->lock);
+    if (rec->handler_ms > 0 && event->event_id == WS_EVENT_DATA_FIN) {
+        usleep(rec->handler_ms * 1000);
+    }
+    return ESP_OK;
+}
+
+// until *counter reaches n, false on timeout
+static bool recorder_wait(recorder_t *rec, const int *counter, int n, int timeout_ms)
+{
+    struct timespec deadline;
+    bool reached;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&rec->lock);
+    while (*counter < n && pthread_cond_timedwait(&rec->cond, &rec->lock, &deadline) == 0) {
+    }
+    reached = *counter >= n;
+    pthread_mutex_unlock(&rec->lock);
+    return reached;
+}
+
+static ws_client_handle_t start_client(ws_server_t *server, ws_client_config_t *config, recorder_t *rec)
+{
+    char uri[64];
+
+    ws_server_uri(server, uri, sizeof(uri));
+    config->uri = uri;
+    config->event_handle = recorder_event;
+    config->user_context = rec;
+    config->ping_interval_ms = -1;
+    ws_client_handle_t client = ws_client_init(config);
+    if (client == NULL || ws_client_start(client) != ESP_OK) {
+        printf("client for %s failed to start\n", uri);
+        exit(1);
+    }
+    return client;
+}
+
+// destroy stops it first
+static void stop_client(ws_client_handle_t client)
+{
+    ws_client_destroy(client);
+}
+
+static void fill_text(char *p, int len, unsigned seed)
+{
+    static const char words[] = "{\"type\": \"push\", \"body\": \"low entropy, compresses well\"} ";
+    for (int i = 0; i < len; i++) {
+        p[i] = words[(i + seed) % (sizeof(words) - 1)];
+    }
+}
+
+static void fill_random(char *p, int len, unsigned seed)
+{
+    for (int i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        p[i] = seed >> 16;
+    }
+}
+
+/* the recorded stream, REPLAY_ROUNDS times in one write, as fast as the client takes it */
+
+static bool replay_script(ws_conn_t *conn, void *arg)
+{
+    int *stop_code = arg;
+    uint8_t *all = NULL;
+    size_t all_len = 0;
+
+    if (ws_server_handshake(conn) < 0) {
+        return false;
+    }
+    for (int round = 0; round < REPLAY_ROUNDS; round++) {
+        for (int i = 0; i < line_count; i++) {
+            uint8_t *frame;
+            int len = ws_server_message(conn, 1 /* TEXT */, lines[i], line_lens[i], &frame);
+            all = realloc(all, all_len + len);
+            memcpy(all + all_len, frame, len);
+            all_len += len;
+            free(frame);
+        }
+    }
+    ws_server_send(conn, all, all_len);
+    free(all);
+    *stop_code = ws_server_finish(conn, WAIT_MS);
+    return false;
+}
+
+static void test_replay(bool deflate)
+{
+    ws_server_t server = { .deflate = deflate };
+    int stop_code = 0;
+    recorder_t rec;
+    ws_client_stats_t stats;
+    int total = REPLAY_ROUNDS * line_count;
+
+    recorder_init(&rec);
+    rec.replay = true;
+    ws_server_start(&server, replay_script, &stop_code);
+    ws_client_config_t config = { .permessage_deflate = deflate };
+    ws_client_handle_t client = start_client(&server, &config, &rec);
+
+    CHECK(recorder_wait(&rec, &rec.messages, total, 4 * WAIT_MS), "%d of %d messages", rec.messages, total);
+    CHECK(rec.mismatches == 0, "%d messages differ from the recording", rec.mismatches);
+    ws_client_get_stats(client, &stats);
+    double seconds = (rec.last_us - rec.first_us) / 1e6;
+    printf("replay%s: %d messages in %.3f s, %.0f frames/s, %.2f bytes copied/frame", deflate ? " deflate" : "",
+           rec.messages, seconds, seconds > 0 ? (rec.messages - 1) / seconds : 0,
+           stats.frames ? (double)stats.copied_bytes / stats.frames : 0);
+    if (deflate) {
+        printf(", %llu bytes inflated from %llu", (unsigned long long)stats.deflate_out_bytes,
+               (unsigned long long)stats.deflate_in_bytes);
+        CHECK(stats.deflate_messages == total, "%u compressed messages", (unsigned)stats.deflate_messages);
+    }
+    printf("\n");
+    stop_client(client);
+    ws_server_join(&server);
+    // the ws task sends the CLOSE for ws_client_stop()
+    CHECK(stop_code == 1000, "CLOSE %d on stop", stop_code);
+    recorder_free(&rec);
+}
+
+/* a message in three fragments with PINGs between them, the PONGs must echo them */
+
+typedef struct {
+    int pongs;
+    bool pongs_ok;
+} fragments_t;
+
+static bool fragments_script(ws_conn_t *conn, void *arg)
+{
+    fragments_t *result = arg;
+    uint8_t payload[125];
+    int opcode;
+
+    if (ws_server_handshake(conn) < 0) {
+        return false;
+    }
+    ws_server_send_frame(conn, false, 1 /* TEXT */, "Hel", 3);
+    ws_server_send_frame(conn, true, 9 /* PING */, "p1", 2);
+    ws_server_send_frame(conn, false, 0 /* CONTINUATION */, "lo, ", 4);
+    ws_server_send_frame(conn, true, 9, "p2", 2);
+    ws_server_send_frame(conn, true, 0, "world", 5);
+    result->pongs_ok = true;
+    for (int i = 1; i <= 2; i++) {
+        char expect[3] = { 'p', '0' + i, 0 };
+        int len = ws_server_read_frame(conn, &opcode, payload, sizeof(payload), WAIT_MS);
+        result->pongs += len >= 0 && opcode == 10 /* PONG */;
+        result->pongs_ok &= len == 2 && memcmp(payload, expect, 2) == 0;
+    }
+    ws_server_finish(conn, WAIT_MS);
+    return false;
+}
+
+static void test_fragments()
+{
+    ws_server_t server = { 0 };
+    fragments_t result = { 0 };
+    recorder_t rec;
+
+    recorder_init(&rec);
+    ws_server_start(&server, fragments_script, &result);
+    ws_client_config_t config = { 0 };
+    ws_client_handle_t client = start_client(&server, &config, &rec);
+
+    CHECK(recorder_wait(&rec, &rec.messages, 1, WAIT_MS), "message not assembled");
+    CHECK(rec.last_len == 12 && memcmp(rec.last, "Hello, world", 12) == 0, "got %.*s", rec.last_len, rec.last);
+    stop_client(client);
+    ws_server_join(&server);
+    CHECK(result.pongs == 2 && result.pongs_ok, "%d PONGs, payload %s", result.pongs, result.pongs_ok ? "ok" : "wrong");
+    recorder_free(&rec);
+}
+
+/* everything one byte per write: upgrade response, fragments, PINGs and the stream */
+
+static bool drip_script(ws_conn_t *conn, void *arg)
+{
+    fragments_t *result = arg;
+
+    conn->drip = 1;
+    conn->drip_us = 20;
+    fragments_script(conn, result);
+    return false;
+}
+
+static bool drip_replay_script(ws_conn_t *conn, void *arg)
+{
+    conn->drip = 1;
+    if (ws_server_handshake(conn) < 0) {
+        return false;
+    }
+    for (int i = 0; i < line_count; i++) {
+        ws_server_send_message(conn, 1 /* TEXT */, lines[i], line_lens[i]);
+    }
+    ws_server_finish(conn, WAIT_MS);
+    return false;
+}
+
+static void test_slow_drip()
+{
+    ws_server_t server = { 0 };
+    fragments_t result = { 0 };
+    recorder_t rec;
+
+    recorder_init(&rec);
+    ws_server_start(&server, drip_script, &result);
+    ws_client_config_t config = { 0 };
+    ws_client_handle_t client = start_client(&server, &config, &rec);
+    CHECK(recorder_wait(&rec, &rec.messages, 1, WAIT_MS), "dripped message not assembled");
+    CHECK(rec.last_len == 12 && memcmp(rec.last, "Hello, world", 12) == 0, "got %.*s", rec.last_len, rec.last);
+    stop_client(client);
+    ws_server_join(&server);
+    CHECK(result.pongs == 2 && result.pongs_ok, "%d PONGs to dripped PINGs", result.pongs);
+    recorder_free(&rec);
+
+    ws_server_t replay_server = { 0 };
+    ws_client_stats_t stats;
+    recorder_init(&rec);
+    rec.replay = true;
+    ws_server_start(&replay_server, drip_replay_script, NULL);
+    client = start_client(&replay_server, &config, &rec);
+    CHECK(recorder_wait(&rec, &rec.messages, line_count, 4 * WAIT_MS), "%d of %d dripped messages", rec.messages, line_count);
+    CHECK(rec.mismatches == 0, "%d dripped messages differ", rec.mismatches);
+    ws_client_get_stats(client, &stats);
+    printf("slow drip: %u frames, %.2f bytes copied/frame\n", (unsigned)stats.frames,
+           stats.frames ? (double)stats.copied_bytes / stats.frames : 0);
+    stop_client(client);
+    ws_server_join(&replay_server);
+    recorder_free(&rec);
+}
+
+/*
+ * a frame larger than buffer_size: without streaming the client fails the connection and
+ * reconnects, with it the frame and a fragmented message arrive as chunks
+ */
+
+#define BIG_LEN 3000
+#define BIG_FRAGMENT 1500
+
+typedef struct {
+    char big[BIG_LEN + 2 * BIG_FRAGMENT + 1000];
+    int close_code;
+} oversized_t;
+
+static bool oversized_script(ws_conn_t *conn, void *arg)
+{
+    oversized_t *result = arg;
+    uint8_t payload[125];
+    int opcode;
+
+    if (ws_server_handshake(conn) < 0) {
+        return false;
+    }
+    if (conn->index == 0) {
+        ws_server_send_frame(conn, true, 2 /* BINARY */, result->big, BIG_LEN);
+        for (;;) {
+            int len = ws_server_read_frame(conn, &opcode, payload, sizeof(payload), WAIT_MS);
+            if (len < 0) {
+                return true;
+            }
+            if (opcode == 8 /* CLOSE */) {
+                result->close_code = len >= 2 ? payload[0] << 8 | payload[1] : 1005;
+                return true;
+            }
+        }
+    }
+    ws_server_send_message(conn, 1 /* TEXT */, "after", 5);
+    ws_server_finish(conn, WAIT_MS);
+    return false;
+}
+
+static bool stream_script(ws_conn_t *conn, void *arg)
+{
+    oversized_t *result = arg;
+    const char *p = result->big + BIG_LEN;
+
+    if (ws_server_handshake(conn) < 0) {
+        return false;
+    }
+    ws_server_send_frame(conn, true, 2 /* BINARY */, result->big, BIG_LEN);
+    ws_server_send_frame(conn, false, 2, p, BIG_FRAGMENT);
+    ws_server_send_frame(conn, false, 0 /* CONTINUATION */, p + BIG_FRAGMENT, BIG_FRAGMENT);
+    ws_server_send_frame(conn, true, 0, p + 2 * BIG_FRAGMENT, 1000);
+    ws_server_send_message(conn, 1 /* TEXT */, "after", 5);
+    ws_server_finish(conn, WAIT_MS);
+    return false;
+}
+
+static void test_oversized()
+{
+    static oversized_t result;
+    ws_server_t server = { 0 };
+    ws_client_stats_t stats;
+    recorder_t rec;
+
+    fill_random(result.big, sizeof(result.big), 41);
+    recorder_init(&rec);
+    ws_server_start(&server, oversized_script, &result);
+    ws_client_config_t config = { .buffer_size = 1024 };
+    ws_client_handle_t client = start_client(&server, &config, &rec);
+    CHECK(recorder_wait(&rec, &rec.messages, 1, 2 * WAIT_MS), "no message after the reconnect");
+    CHECK(rec.last_len == 5 && memcmp(rec.last, "after", 5) == 0, "got %.*s", rec.last_len, rec.last);
+    CHECK(rec.connected == 2 && rec.disconnected == 1, "%d connects, %d disconnects", rec.connected, rec.disconnected);
+    ws_client_get_stats(client, &stats);
+    CHECK(stats.reconnects == 1, "%u reconnects", (unsigned)stats.reconnects);
+    printf("oversized frame: CLOSE %d, reconnect latency %.2f ms\n", result.close_code, stats.last_reconnect_us / 1000.0);
+    stop_client(client);
+    ws_server_join(&server);
+    CHECK(result.close_code == 1009, "CLOSE %d", result.close_code);
+    recorder_free(&rec);
+
+    ws_server_t stream_server = { 0 };
+    int stream_len = BIG_LEN + 2 * BIG_FRAGMENT + 1000;
+    recorder_init(&rec);
+    ws_server_start(&stream_server, stream_script, &result);
+    config.stream_large_messages = true;
+    client = start_client(&stream_server, &config, &rec);
+    CHECK(recorder_wait(&rec, &rec.messages, 1, WAIT_MS), "no message after the streamed ones");
+    CHECK(rec.last_len == 5 && memcmp(rec.last, "after", 5) == 0, "got %.*s", rec.last_len, rec.last);
+    CHECK(rec.stream_len == stream_len && memcmp(rec.stream, result.big, stream_len) == 0, "streamed %d of %d bytes%s",
+          rec.stream_len, stream_len, rec.stream_len == stream_len ? ", differing" : "");
+    CHECK(rec.connected == 1, "%d connects while streaming", rec.connected);
+    stop_client(client);
+    ws_server_join(&stream_server);
+    recorder_free(&rec);
+}
+
+/* frames in the same write as the upgrade response, longer than what's left of its buffer */
+
+#define PENDING_BIG 1800
+
+static bool pending_script(ws_conn_t *conn, void *arg)
+{
+    const char *big = arg;
+    char response[512];
+    int len = ws_server_accept(conn, response, sizeof(response));
+    if (len < 0) {
+        return false;
+    }
+    uint8_t *all = malloc(len);
+    size_t all_len = len;
+    memcpy(all, response, len);
+    for (int i = 0; i <= line_count; i++) {
+        uint8_t *frame;
+        int frame_len = i < line_count ? ws_server_message(conn, 1 /* TEXT */, lines[i], line_lens[i], &frame)
+                                       : ws_server_message(conn, 1, big, PENDING_BIG, &frame);
+        all = realloc(all, all_len + frame_len);
+        memcpy(all + all_len, frame, frame_len);
+        all_len += frame_len;
+        free(frame);
+    }
+    ws_server_send(conn, all, all_len);
+    free(all);
+    ws_server_finish(conn, WAIT_MS);
+    return false;
+}
+
+static void test_pending(bool deflate)
+{
+    static char big[PENDING_BIG];
+    ws_server_t server = { .deflate = deflate };
+    recorder_t rec;
+
+    fill_text(big, sizeof(big), 43);
+    recorder_init(&rec);
+    ws_server_start(&server, pending_script, big);
+    ws_client_config_t config = { .buffer_size = 2048, .permessage_deflate = deflate };
+    ws_client_handle_t client = start_client(&server, &config, &rec);
+    CHECK(recorder_wait(&rec, &rec.messages, line_count + 1, WAIT_MS), "%d of %d messages behind the upgrade%s",
+          rec.messages, line_count + 1, deflate ? ", deflate" : "");
+    CHECK(rec.last_len == PENDING_BIG && memcmp(rec.last, big, PENDING_BIG) == 0, "last message %d bytes%s",
+          rec.last_len, deflate ? ", deflate" : "");
+    stop_client(client);
+    ws_server_join(&server);
+    recorder_free(&rec);
+}
+
+/*
+ * compressed messages that inflate to most of buffer_size from a few bytes of input, one
+ * that inflates beyond it and is truncated, and ones after it that still inflate right
+ */
+
+#define INFLATE_FITS 3500
+#define INFLATE_TOO_BIG 6000
+
+static bool inflate_script(ws_conn_t *conn, void *arg)
+{
+    const char *text = arg;
+
+    if (ws_server_handshake(conn) < 0 || !conn->deflate) {
+        return false;
+    }
+    ws_server_send_message(conn, 1 /* TEXT */, text, INFLATE_FITS);
+    ws_server_send_message(conn, 1, text, INFLATE_TOO_BIG);
+    ws_server_send_message(conn, 1, lines[0], line_lens[0]);
+    ws_server_send_message(conn, 1, text + 7, INFLATE_FITS);
+    ws_server_finish(conn, WAIT_MS);
+    return false;
+}
+
+static void test_inflate()
+{
+    static char text[INFLATE_TOO_BIG + 7];
+    ws_server_t server = { .deflate = true };
+    ws_client_stats_t stats;
+    recorder_t rec;
+
+    fill_text(text, sizeof(text), 47);
+    recorder_init(&rec);
+    ws_server_start(&server, inflate_script, text);
+    ws_client_config_t config = { .buffer_size = 4096, .permessage_deflate = true, .dispatch_queue_size = 1 };
+    rec.handler_ms = 1;
+    ws_client_handle_t client = start_client(&server, &config, &rec);
+
+    CHECK(recorder_wait(&rec, &rec.messages, 1, WAIT_MS), "no inflated message");
+    CHECK(rec.last_len == INFLATE_FITS && !rec.last_truncated && memcmp(rec.last, text, INFLATE_FITS) == 0,
+          "%d of %d bytes inflated%s", rec.last_len, INFLATE_FITS, rec.last_truncated ? ", truncated" : "");
+    CHECK(recorder_wait(&rec, &rec.messages, 2, WAIT_MS), "oversized inflated message lost");
+    // frames that arrived with the upgrade response may still hold the end of the buffer
+    CHECK(rec.last_truncated && rec.last_len > INFLATE_FITS && rec.last_len <= 4095 && memcmp(rec.last, text, rec.last_len) == 0,
+          "%d bytes%s", rec.last_len, rec.last_truncated ? " truncated" : ", not flagged truncated");
+    CHECK(recorder_wait(&rec, &rec.messages, 4, WAIT_MS), "%d messages after the truncated one", rec.messages - 2);
+    CHECK(rec.last_len == INFLATE_FITS && memcmp(rec.last, text + 7, INFLATE_FITS) == 0, "window broken after truncation");
+    ws_client_get_stats(client, &stats);
+    CHECK(stats.truncated_messages == 1, "%u truncated", (unsigned)stats.truncated_messages);
+    CHECK(stats.deflate_messages == 4, "%u compressed", (unsigned)stats.deflate_messages);
+    stop_client(client);
+    ws_server_join(&server);
+    recorder_free(&rec);
+}
+
+/*
+ * the first response leaves server_max_window_bits out, the server may then use a window
+ * bigger than the one offered and the client must not connect. The second one has it
+ */
+
+static bool window_bits_script(ws_conn_t *conn, void *arg)
+{
+    int *first_read = arg;
+    uint8_t payload[125];
+    int opcode;
+
+    conn->omit_window_bits = conn->index == 0;
+    if (ws_server_handshake(conn) < 0 || !conn->deflate) {
+        return false;
+    }
+    if (conn->index == 0) {
+        ws_server_send_message(conn, 1 /* TEXT */, "wide window", 11);
+        // the client hangs up without a frame
+        *first_read = ws_server_read_frame(conn, &opcode, payload, sizeof(payload), WAIT_MS);
+        return true;
+    }
+    ws_server_send_message(conn, 1, "limited", 7);
+    ws_server_finish(conn, WAIT_MS);
+    return false;
+}
+
+static void test_inflate_window_bits()
+{
+    ws_server_t server = { .deflate = true };
+    int first_read = 0;
+    recorder_t rec;
+
+    recorder_init(&rec);
+    ws_server_start(&server, window_bits_script, &first_read);
+    ws_client_config_t config = { .permessage_deflate = true };
+    ws_client_handle_t client = start_client(&server, &config, &rec);
+    CHECK(recorder_wait(&rec, &rec.messages, 1, 2 * WAIT_MS), "no message after the reconnect");
+    CHECK(rec.last_len == 7 && memcmp(rec.last, "limited", 7) == 0, "got %.*s", rec.last_len, rec.last);
+    CHECK(rec.connected == 1, "%d connects", rec.connected);
+    stop_client(client);
+    ws_server_join(&server);
+    CHECK(first_read == -1, "client sent %d bytes on the unlimited window", first_read);
+    recorder_free(&rec);
+}
+
+/* the server closes with a reason, it reaches a slow dispatch handler intact */
+
+static bool close_script(ws_conn_t *conn, void *arg)
+{
+    int *reply = arg;
+    uint8_t payload[125];
+    int opcode, len;
+
+    if (ws_server_handshake(conn) < 0) {
+        return false;
+    }
+    ws_server_send_message(conn, 1 /* TEXT */, "bye soon", 8);
+    ws_server_send_close(conn, 1001, "going away");
+    while ((len = ws_server_read_frame(conn, &opcode, payload, sizeof(payload), WAIT_MS)) >= 0) {
+        if (opcode == 8 /* CLOSE */) {
+            *reply = len >= 2 ? payload[0] << 8 | payload[1] : 1005;
+            break;
+        }
+    }
+    return false;
+}
+
+static void test_close()
+{
+    ws_server_t server = { 0 };
+    int reply = 0;
+    recorder_t rec;
+
+    recorder_init(&rec);
+    rec.handler_ms = 50;
+    ws_server_start(&server, close_script, &reply);
+    ws_client_config_t config = { .dispatch_queue_size = 4, .disable_auto_reconnect = true };
+    ws_client_handle_t client = start_client(&server, &config, &rec);
+    CHECK(recorder_wait(&rec, &rec.disconnected, 1, WAIT_MS), "no disconnect");
+    CHECK(rec.close_code == 1001 && strcmp(rec.close_reason, "going away") == 0, "CLOSE %d \"%s\"", rec.close_code,
+          rec.close_reason);
+    CHECK(!rec.stray_data, "WS_EVENT_CONNECTED with data");
+    ws_server_join(&server);
+    CHECK(reply == 1001, "client answered CLOSE with %d", reply);
+    stop_client(client);
+    recorder_free(&rec);
+}
+
+/* a server that never accepts: stop must not wait out the connect */
+
+static void test_stop_connecting(bool in_group)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t addr_len = sizeof(addr);
+    int fillers[8];
+    recorder_t rec;
+
+    // backlog full: further SYNs are dropped and connects stay in progress
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    listen(fd, 0);
+    getsockname(fd, (struct sockaddr *)&addr, &addr_len);
+    for (int i = 0; i < 8; i++) {
+        fillers[i] = socket(AF_INET, SOCK_STREAM, 0);
+        fcntl(fillers[i], F_SETFL, O_NONBLOCK);
+        connect(fillers[i], (struct sockaddr *)&addr, sizeof(addr));
+    }
+    usleep(100 * 1000);
+
+    ws_server_t server = { .port = ntohs(addr.sin_port) };
+    ws_client_group_config_t group_config = { 0 };
+    ws_client_group_handle_t group = in_group ? ws_client_group_init(&group_config) : NULL;
+    recorder_init(&rec);
+    ws_client_config_t config = { .group = group };
+    ws_client_handle_t client = start_client(&server, &config, &rec);
+    usleep(200 * 1000);
+    int64_t start = esp_timer_get_time();
+    ws_client_stop(client);
+    int64_t stop_us = esp_timer_get_time() - start;
+    printf("stop while connecting%s: %.2f ms\n", in_group ? " in a group" : "", stop_us / 1000.0);
+    CHECK(stop_us < 500 * 1000, "stop took %lld ms", (long long)stop_us / 1000);
+    CHECK(rec.connected == 0, "connected to a server that doesn't accept");
+    ws_client_destroy(client);
+    if (group) {
+        ws_client_group_destroy(group);
+    }
+    for (int i = 0; i < 8; i++) {
+        close(fillers[i]);
+    }
+    close(fd);
+    recorder_free(&rec);
+}
+
+/*
+ * two clients in a group with a small pool: one has a slow dispatch handler and runs out
+ * of blocks, and is stopped against a server that never answers its CLOSE. The other's
+ * messages must keep arriving on time all the while.
+ */
+
+#define GROUP_SLOW_MESSAGES 12
+#define GROUP_SLOW_LEN 1500        /* 3 blocks, the pool runs dry before the queue fills */
+#define GROUP_TICKS 300
+#define GROUP_TICK_MS 10
+
+// arg: length of the messages
+static bool group_slow_script(ws_conn_t *conn, void *arg)
+{
+    static char text[GROUP_SLOW_LEN];
+    int len = *(int *)arg;
+    uint8_t payload[125];
+    int opcode;
+
+    if (ws_server_handshake(conn) < 0) {
+        return false;
+    }
+    fill_text(text, len, 53);
+    for (int i = 0; i < GROUP_SLOW_MESSAGES; i++) {
+        ws_server_send_message(conn, 1 /* TEXT */, text, len);
+    }
+    // swallow the CLOSE without answering, until the client gives up and closes
+    while (ws_server_read_frame(conn, &opcode, payload, sizeof(payload), 3 * WAIT_MS) >= 0) {
+    }
+    return false;
+}
+
+// arg: how long the client's answer to the ticks took to get here from ws_client_send()
+static bool group_ticks_script(ws_conn_t *conn, void *arg)
+{
+    int64_t *send_us = arg;
+    uint8_t payload[125];
+    char tick[32];
+    int opcode;
+
+    if (ws_server_handshake(conn) < 0) {
+        return false;
+    }
+    for (int i = 0; i < GROUP_TICKS; i++) {
+        int len = snprintf(tick, sizeof(tick), "t=%lld", (long long)esp_timer_get_time());
+        ws_server_send_message(conn, 1 /* TEXT */, tick, len);
+        usleep(GROUP_TICK_MS * 1000);
+    }
+    int len = ws_server_read_frame(conn, &opcode, payload, sizeof(payload) - 1, WAIT_MS);
+    if (len > 2 && opcode == 1 /* TEXT */) {
+        payload[len] = 0;
+        *send_us = esp_timer_get_time() - atoll((char *)payload + 2);
+    }
+    ws_server_finish(conn, WAIT_MS);
+    return false;
+}
+
+/*
+ * A slow handler next to a client that gets a tick every 10 ms, both in one group. With
+ * big messages the slow client runs the pool dry, with small ones in a big pool it fills
+ * its dispatch queue. Either way the ticks must keep coming on time, and a message sent
+ * from another task must go out without waiting for the group task's select() to time out.
+ */
+static void test_group(int slow_len, int pool_blocks)
+{
+    ws_server_t slow_server = { 0 }, ticks_server = { 0 };
+    recorder_t slow, ticks;
+    ws_client_stats_t stats;
+    int64_t send_us = -1;
+    char answer[32];
+
+    ws_client_group_config_t group_config = { .pool_block_size = 512, .pool_block_count = pool_blocks };
+    ws_client_group_handle_t group = ws_client_group_init(&group_config);
+    CHECK(group != NULL, "no group");
+    if (group == NULL) {
+        return;
+    }
+    recorder_init(&slow);
+    recorder_init(&ticks);
+    slow.handler_ms = 100;
+    ws_server_start(&slow_server, group_slow_script, &slow_len);
+    ws_server_start(&ticks_server, group_ticks_script, &send_us);
+    ws_client_config_t slow_config = { .buffer_size = 2048, .dispatch_queue_size = 2, .group = group };
+    ws_client_config_t ticks_config = { .buffer_size = 512, .group = group };
+    ws_client_handle_t slow_client = start_client(&slow_server, &slow_config, &slow);
+    ws_client_handle_t ticks_client = start_client(&ticks_server, &ticks_config, &ticks);
+
+    CHECK(recorder_wait(&slow, &slow.messages, GROUP_SLOW_MESSAGES, 2 * WAIT_MS), "%d of %d messages of %d bytes",
+          slow.messages, GROUP_SLOW_MESSAGES, slow_len);
+    ws_client_get_stats(slow_client, &stats);
+    CHECK(stats.dropped_messages == 0, "%d messages dropped", (int)stats.dropped_messages);
+    int64_t start = esp_timer_get_time();
+    ws_client_stop(slow_client);
+    int64_t stop_us = esp_timer_get_time() - start;
+    CHECK(recorder_wait(&ticks, &ticks.messages, GROUP_TICKS, 2 * WAIT_MS), "%d of %d ticks", ticks.messages, GROUP_TICKS);
+    printf("group, %d byte messages to a slow handler: stop without CLOSE answer %.0f ms, worst tick latency %.2f ms\n",
+           slow_len, stop_us / 1000.0, ticks.max_latency_us / 1000.0);
+    CHECK(ticks.max_latency_us < 50 * 1000, "a tick took %.2f ms", ticks.max_latency_us / 1000.0);
+    int len = snprintf(answer, sizeof(answer), "t=%lld", (long long)esp_timer_get_time());
+    CHECK(ws_client_send(ticks_client, 1 /* TEXT */, answer, len, WAIT_MS) == ESP_OK, "send failed");
+    stop_client(ticks_client);
+    ws_client_destroy(slow_client);
+    ws_server_join(&slow_server);
+    ws_server_join(&ticks_server);
+    CHECK(send_us >= 0 && send_us < 50 * 1000, "sent message took %.2f ms", send_us / 1000.0);
+    ws_client_group_destroy(group);
+    recorder_free(&slow);
+    recorder_free(&ticks);
+}
+
+static void load_lines(const char *path)
+{
+    static char data[64 * 1024];
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    size_t len = fread(data, 1, sizeof(data) - 1, f);
+    fclose(f);
+    data[len] = 0;
+    for (char *p = data; *p && line_count < MAX_LINES;) {
+        char *end = strchr(p, '\n');
+        if (end) {
+            *end = 0;
+        }
+        if (*p) {
+            lines[line_count] = p;
+            line_lens[line_count++] = strlen(p);
+        }
+        if (end == NULL) {
+            break;
+        }
+        p = end + 1;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    // a client that fails its connection mustn't take the server down with it
+    signal(SIGPIPE, SIG_IGN);
+    load_lines(argc > 1 ? argv[1] : "data/pushbullet_stream.txt");
+
+    test_replay(false);
+    test_replay(true);
+    test_fragments();
+    test_slow_drip();
+    test_oversized();
+    test_pending(false);
+    test_pending(true);
+    test_inflate();
+    test_inflate_window_bits();
+    test_close();
+    test_stop_connecting(false);
+    test_stop_connecting(true);
+    test_group(GROUP_SLOW_LEN, 8);
+    test_group(100, 40);
+
+    printf("%d failures\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,156 @@
+/*
+ * ws_mask_copy() against the byte-by-byte definition, for every dst and src alignment,
+ * mask offset and the lengths around the word size, in place and into another buffer.
+ *   test_ws_mask [bench]
+ * bench compares its speed with the plain loop.
+ */
+#include "../main/ws_client.c"
+
+#include <stdlib.h>
+
+static int failures;
+
+#define CHECK(cond, ...) do {                                           \
+        if (!(cond)) {                                                  \
+            failures++;                                                 \
+            printf("FAIL %s:%d: %s: ", __FILE__, __LINE__, #cond);      \
+            printf(__VA_ARGS__);                                        \
+            printf("\n");                                               \
+        }                                                               \
+    } while (0)
+
+#define WORD ((int)sizeof(uintptr_t))
+#define GUARD 16
+#define CANARY 0xA5
+
+static const uint8_t test_mask[4] = { 0x12, 0x9C, 0xE7, 0x3F };
+
+static void mask_bytewise(uint8_t *dst, const uint8_t *src, int len, const uint8_t mask[4], int offset)
+{
+    for (int i = 0; i < len; i++) {
+        dst[i] = src[i] ^ mask[(offset + i) & 3];
+    }
+}
+
+static void fill(uint8_t *p, int len, unsigned seed)
+{
+    for (int i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        p[i] = seed >> 16;
+    }
+}
+
+// nothing outside dst[0..len) may change
+static bool guards_intact(const uint8_t *dst, int len)
+{
+    for (int i = 1; i <= GUARD; i++) {
+        if (dst[-i] != CANARY || dst[len - 1 + i] != CANARY) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void check_case(int dst_align, int src_align, int offset, int len, bool in_place)
+{
+    static uint8_t src_buf[4096 + 2 * GUARD + 16] __attribute__((aligned(16)));
+    static uint8_t dst_buf[4096 + 2 * GUARD + 16] __attribute__((aligned(16)));
+    static uint8_t expect[4096];
+    uint8_t *dst = dst_buf + GUARD + dst_align;
+    const uint8_t *src = in_place ? dst : src_buf + GUARD + src_align;
+
+    memset(dst_buf, CANARY, sizeof(dst_buf));
+    fill(in_place ? dst : src_buf + GUARD + src_align, len, len * 131 + offset);
+    mask_bytewise(expect, src, len, test_mask, offset);
+
+    ws_mask_copy(dst, src, len, test_mask, offset);
+    CHECK(memcmp(dst, expect, len) == 0, "dst %d src %d offset %d len %d%s", dst_align, src_align, offset,
+          len, in_place ? " in place" : "");
+    CHECK(guards_intact(dst, len), "wrote outside dst %d offset %d len %d%s", dst_align, offset, len,
+          in_place ? " in place" : "");
+}
+
+static void test_alignments()
+{
+    static const int long_lens[] = { 127, 128, 129, 1000, 1023, 4096 };
+    int cases = 0;
+
+    for (int dst_align = 0; dst_align < WORD; dst_align++) {
+        for (int offset = 0; offset < 4; offset++) {
+            for (int len = 0; len <= 4 * WORD + 3; len++) {
+                check_case(dst_align, 0, offset, len, true);
+                for (int src_align = 0; src_align < WORD; src_align++) {
+                    check_case(dst_align, src_align, offset, len, false);
+                }
+                cases += WORD + 1;
+            }
+            for (int k = 0; k < sizeof(long_lens) / sizeof(long_lens[0]); k++) {
+                check_case(dst_align, 0, offset, long_lens[k], true);
+                for (int src_align = 0; src_align < WORD; src_align++) {
+                    check_case(dst_align, src_align, offset, long_lens[k], false);
+                }
+                cases += WORD + 1;
+            }
+        }
+    }
+    printf("ws_mask_copy: %d cases\n", cases);
+}
+
+// a payload masked chunk by chunk, as ws_parser_unmask() and the send path do it
+static void test_chunked()
+{
+    uint8_t payload[777], expect[777], out[777];
+
+    fill(payload, sizeof(payload), 7);
+    mask_bytewise(expect, payload, sizeof(payload), test_mask, 0);
+    for (int chunk = 1; chunk <= 19; chunk += 3) {
+        memcpy(out, payload, sizeof(out));
+        for (int pos = 0; pos < sizeof(out); pos += chunk) {
+            int len = sizeof(out) - pos < chunk ? sizeof(out) - pos : chunk;
+            ws_mask_copy(out + pos, out + pos, len, test_mask, pos & 3);
+        }
+        CHECK(memcmp(out, expect, sizeof(out)) == 0, "chunks of %d", chunk);
+    }
+}
+
+static void bench_one(const char *name, void (*fn)(uint8_t *, const uint8_t *, int, const uint8_t *, int),
+                      uint8_t *dst, const uint8_t *src, int len)
+{
+    int64_t total = 256LL * 1024 * 1024;
+    int rounds = total / len;
+    int64_t start = esp_timer_get_time();
+    for (int r = 0; r < rounds; r++) {
+        fn(dst, src, len, test_mask, r & 3);
+        __asm__ volatile("" : : "r"(dst) : "memory");
+    }
+    int64_t us = esp_timer_get_time() - start;
+    printf("  %-10s %6d bytes  %8.1f MB/s\n", name, len, (double)rounds * len / (us ? us : 1));
+}
+
+static void bench()
+{
+    static const int sizes[] = { 16, 125, 1024, 16384 };
+    uint8_t *src = malloc(16384 + 8);
+    uint8_t *dst = malloc(16384 + 8);
+
+    fill(src, 16384 + 8, 1);
+    printf("ws_mask_copy vs byte-wise, src one byte off alignment:\n");
+    for (int k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+        bench_one("word", ws_mask_copy, dst, src + 1, sizes[k]);
+        bench_one("bytewise", mask_bytewise, dst, src + 1, sizes[k]);
+    }
+    free(src);
+    free(dst);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        bench();
+        return 0;
+    }
+    test_alignments();
+    test_chunked();
+    printf("%s: %d failures\n", argv[0], failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,344 @@
+/*
+ * host build: scripted WebSocket server for the client tests, see ws_server.h
+ */
+#include "ws_server.h"
+#include "mbedtls/base64.h"
+#include "mbedtls/sha1.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define WS_SERVER_ACCEPT_TIMEOUT_MS 10000
+
+static void *ws_server_main(void *arg)
+{
+    ws_server_t *server = arg;
+    bool more = true;
+
+    for (int index = 0; more; index++) {
+        struct pollfd pfd = { .fd = server->fd, .events = POLLIN };
+        if (poll(&pfd, 1, WS_SERVER_ACCEPT_TIMEOUT_MS) <= 0) {
+            printf("ws_server: no connection %d within %d ms\n", index, WS_SERVER_ACCEPT_TIMEOUT_MS);
+            break;
+        }
+        ws_conn_t conn = { .server = server, .index = index };
+        conn.fd = accept(server->fd, NULL, NULL);
+        if (conn.fd < 0) {
+            break;
+        }
+        int one = 1;
+        setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        more = server->script(&conn, server->arg);
+        if (conn.deflate) {
+            deflateEnd(&conn.zs);
+        }
+        close(conn.fd);
+    }
+    close(server->fd);
+    server->fd = -1;
+    return NULL;
+}
+
+int ws_server_start(ws_server_t *server, ws_server_script_t script, void *arg)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t addr_len = sizeof(addr);
+    int one = 1;
+
+    server->script = script;
+    server->arg = arg;
+    server->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server->fd < 0) {
+        return -1;
+    }
+    setsockopt(server->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(server->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(server->fd, 4) != 0 ||
+        getsockname(server->fd, (struct sockaddr *)&addr, &addr_len) != 0) {
+        close(server->fd);
+        return -1;
+    }
+    server->port = ntohs(addr.sin_port);
+    if (pthread_create(&server->thread, NULL, ws_server_main, server) != 0) {
+        close(server->fd);
+        return -1;
+    }
+    return 0;
+}
+
+void ws_server_join(ws_server_t *server)
+{
+    pthread_join(server->thread, NULL);
+}
+
+void ws_server_uri(const ws_server_t *server, char *uri, int size)
+{
+    snprintf(uri, size, "ws://127.0.0.1:%d/stream", server->port);
+}
+
+static int read_full(int fd, void *buff, int len, int timeout_ms)
+{
+    int got = 0;
+
+    while (got < len) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (poll(&pfd, 1, timeout_ms) <= 0) {
+            return -1;
+        }
+        int n = recv(fd, (char *)buff + got, len - got, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        got += n;
+    }
+    return got;
+}
+
+// value of a request header, NUL terminated into value
+static bool header_value(const char *request, const char *name, char *value, int size)
+{
+    int name_len = strlen(name);
+
+    for (const char *line = strstr(request, "\r\n"); line; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (strncasecmp(line, name, name_len) != 0 || line[name_len] != ':') {
+            continue;
+        }
+        const char *p = line + name_len + 1;
+        while (*p == ' ') p++;
+        const char *end = strstr(p, "\r\n");
+        int len = end ? end - p : strlen(p);
+        if (len >= size) {
+            return false;
+        }
+        memcpy(value, p, len);
+        value[len] = 0;
+        return true;
+    }
+    return false;
+}
+
+int ws_server_accept(ws_conn_t *conn, char *response, int size)
+{
+    static const char magic[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    char request[2048];
+    char key[64], text[128], offer[128], extensions[128] = "";
+    unsigned char sha1[20], accept_key[32];
+    size_t accept_len;
+    int len = 0;
+
+    while (len < 4 || memcmp(request + len - 4, "\r\n\r\n", 4) != 0) {
+        if (len == sizeof(request) - 1 || read_full(conn->fd, request + len, 1, 5000) != 1) {
+            return -1;
+        }
+        len++;
+    }
+    request[len] = 0;
+    if (!header_value(request, "Sec-WebSocket-Key", key, sizeof(key))) {
+        return -1;
+    }
+    snprintf(text, sizeof(text), "%s%s", key, magic);
+    mbedtls_sha1_ret((unsigned char *)text, strlen(text), sha1);
+    mbedtls_base64_encode(accept_key, sizeof(accept_key), &accept_len, sha1, sizeof(sha1));
+
+    if (conn->server->deflate && header_value(request, "Sec-WebSocket-Extensions", offer, sizeof(offer)) &&
+        strncmp(offer, "permessage-deflate", strlen("permessage-deflate")) == 0) {
+        const char *bits = strstr(offer, "server_max_window_bits=");
+        conn->window_bits = bits && !conn->omit_window_bits ? atoi(bits + strlen("server_max_window_bits=")) : 15;
+        // zlib's raw deflate can't do 8
+        if (conn->window_bits < 9) {
+            return -1;
+        }
+        if (deflateInit2(&conn->zs, Z_BEST_COMPRESSION, Z_DEFLATED, -conn->window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return -1;
+        }
+        conn->deflate = true;
+        if (conn->omit_window_bits) {
+            snprintf(extensions, sizeof(extensions), "Sec-WebSocket-Extensions: permessage-deflate\r\n");
+        } else {
+            snprintf(extensions, sizeof(extensions), "Sec-WebSocket-Extensions: permessage-deflate; server_max_window_bits=%d\r\n",
+                     conn->window_bits);
+        }
+    }
+
+    len = snprintf(response, size,
+                   "HTTP/1.1 101 Switching Protocols\r\n"
+                   "Upgrade: websocket\r\n"
+                   "Connection: Upgrade\r\n"
+                   "Sec-WebSocket-Accept: %s\r\n"
+                   "Sec-WebSocket-Protocol: mqtt\r\n"
+                   "%s\r\n",
+                   accept_key, extensions);
+    return len < size ? len : -1;
+}
+
+int ws_server_handshake(ws_conn_t *conn)
+{
+    char response[512];
+    int len = ws_server_accept(conn, response, sizeof(response));
+
+    return len < 0 ? -1 : ws_server_send(conn, response, len);
+}
+
+int ws_server_frame(uint8_t *dst, bool fin, bool rsv1, int opcode, const void *payload, int len)
+{
+    int header_len = 2;
+
+    dst[0] = (fin ? 0x80 : 0) | (rsv1 ? 0x40 : 0) | (opcode & 0x0F);
+    if (len < 126) {
+        dst[1] = len;
+    } else if (len <= 0xFFFF) {
+        dst[1] = 126;
+        dst[2] = len >> 8;
+        dst[3] = len;
+        header_len = 4;
+    } else {
+        dst[1] = 127;
+        for (int i = 0; i < 8; i++) {
+            dst[2 + i] = i < 4 ? 0 : (uint32_t)len >> (8 * (7 - i));
+        }
+        header_len = 10;
+    }
+    memcpy(dst + header_len, payload, len);
+    return header_len + len;
+}
+
+int ws_server_message(ws_conn_t *conn, int opcode, const void *payload, int len, uint8_t **frame)
+{
+    if (!conn->deflate) {
+        *frame = malloc(len + 10);
+        return *frame ? ws_server_frame(*frame, true, false, opcode, payload, len) : -1;
+    }
+
+    // compressed with the window carried over from the messages before
+    int bound = deflateBound(&conn->zs, len) + 16;
+    uint8_t *deflated = malloc(bound);
+    if (deflated == NULL) {
+        return -1;
+    }
+    conn->zs.next_in = (Bytef *)payload;
+    conn->zs.avail_in = len;
+    conn->zs.next_out = deflated;
+    conn->zs.avail_out = bound;
+    if (deflate(&conn->zs, Z_SYNC_FLUSH) != Z_OK || conn->zs.avail_in != 0) {
+        free(deflated);
+        return -1;
+    }
+    // RFC 7692 7.2.1: the sync flush's empty stored block is left off
+    int deflated_len = bound - conn->zs.avail_out - 4;
+    *frame = malloc(deflated_len + 10);
+    int frame_len = *frame ? ws_server_frame(*frame, true, true, opcode, deflated, deflated_len) : -1;
+    free(deflated);
+    return frame_len;
+}
+
+int ws_server_send(ws_conn_t *conn, const void *data, int len)
+{
+    const uint8_t *p = data;
+    int sent = 0;
+
+    while (sent < len) {
+        int chunk = conn->drip > 0 && conn->drip < len - sent ? conn->drip : len - sent;
+        int n = send(conn->fd, p + sent, chunk, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return -1;
+        }
+        sent += n;
+        if (conn->drip > 0 && conn->drip_us > 0) {
+            usleep(conn->drip_us);
+        }
+    }
+    return sent;
+}
+
+int ws_server_send_frame(ws_conn_t *conn, bool fin, int opcode, const void *payload, int len)
+{
+    uint8_t *frame = malloc(len + 10);
+    if (frame == NULL) {
+        return -1;
+    }
+    int ret = ws_server_send(conn, frame, ws_server_frame(frame, fin, false, opcode, payload, len));
+    free(frame);
+    return ret;
+}
+
+int ws_server_send_message(ws_conn_t *conn, int opcode, const void *payload, int len)
+{
+    uint8_t *frame;
+    int frame_len = ws_server_message(conn, opcode, payload, len, &frame);
+    if (frame_len < 0) {
+        return -1;
+    }
+    int ret = ws_server_send(conn, frame, frame_len);
+    free(frame);
+    return ret;
+}
+
+int ws_server_read_frame(ws_conn_t *conn, int *opcode, uint8_t *payload, int size, int timeout_ms)
+{
+    uint8_t header[2], ext[8], mask[4];
+    uint64_t len;
+
+    if (read_full(conn->fd, header, 2, timeout_ms) != 2) {
+        return -1;
+    }
+    *opcode = header[0] & 0x0F;
+    len = header[1] & 0x7F;
+    if (len == 126 || len == 127) {
+        int ext_len = len == 126 ? 2 : 8;
+        if (read_full(conn->fd, ext, ext_len, timeout_ms) != ext_len) {
+            return -1;
+        }
+        len = 0;
+        for (int i = 0; i < ext_len; i++) {
+            len = len << 8 | ext[i];
+        }
+    }
+    // RFC 6455 5.1: whatever a client sends is masked
+    if (!(header[1] & 0x80) || len > size) {
+        printf("ws_server: %s client frame, opcode %d length %llu\n", header[1] & 0x80 ? "oversized" : "unmasked",
+               *opcode, (unsigned long long)len);
+        return -1;
+    }
+    if (read_full(conn->fd, mask, 4, timeout_ms) != 4 || read_full(conn->fd, payload, len, timeout_ms) != (int)len) {
+        return -1;
+    }
+    for (uint64_t i = 0; i < len; i++) {
+        payload[i] ^= mask[i & 3];
+    }
+    return len;
+}
+
+int ws_server_send_close(ws_conn_t *conn, int code, const char *reason)
+{
+    uint8_t payload[125] = { code >> 8, code & 0xFF };
+    int reason_len = reason ? strlen(reason) : 0;
+
+    memcpy(payload + 2, reason, reason_len);
+    return ws_server_send_frame(conn, true, 8 /* CLOSE */, payload, 2 + reason_len);
+}
+
+int ws_server_finish(ws_conn_t *conn, int timeout_ms)
+{
+    uint8_t payload[125];
+    int opcode;
+
+    for (;;) {
+        int len = ws_server_read_frame(conn, &opcode, payload, sizeof(payload), timeout_ms);
+        if (len < 0) {
+            return -1;
+        }
+        if (opcode == 8 /* CLOSE */) {
+            ws_server_send_frame(conn, true, 8, payload, len);
+            return len >= 2 ? payload[0] << 8 | payload[1] : 1005;
+        }
+    }
+}
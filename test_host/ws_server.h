@@ -0,0 +1,67 @@
+#ifndef _WS_SERVER_H_
+#define _WS_SERVER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <zlib.h>
+
+/*
+ * host build: a WebSocket server on 127.0.0.1 that plays a script against the client
+ * under test. Every accepted connection is handed to the script in the server thread,
+ * the helpers below do the upgrade and put frames on the wire, byte by byte if asked to.
+ */
+
+typedef struct ws_server ws_server_t;
+
+typedef struct ws_conn {
+    ws_server_t *server;
+    int fd;
+    int index;                  /* connections accepted before this one */
+    bool deflate;               /* permessage-deflate was offered and accepted */
+    int window_bits;
+    bool omit_window_bits;      /* set before the handshake: accept permessage-deflate without server_max_window_bits */
+    z_stream zs;
+    int drip;                   /* > 0: write this many bytes at a time */
+    int drip_us;                /* and sleep this long between them */
+} ws_conn_t;
+
+/* returns false to stop accepting */
+typedef bool (*ws_server_script_t)(ws_conn_t *conn, void *arg);
+
+struct ws_server {
+    int fd;
+    int port;
+    bool deflate;               /* accept permessage-deflate */
+    ws_server_script_t script;
+    void *arg;
+    pthread_t thread;
+};
+
+int ws_server_start(ws_server_t *server, ws_server_script_t script, void *arg);
+void ws_server_join(ws_server_t *server);
+/* ws://127.0.0.1:port/stream into uri */
+void ws_server_uri(const ws_server_t *server, char *uri, int size);
+
+/*
+ * read the upgrade request and put the 101 response into response, returns its length.
+ * Frames appended to it go out in the same write, they reach the client with the response
+ */
+int ws_server_accept(ws_conn_t *conn, char *response, int size);
+/* accept and send the response */
+int ws_server_handshake(ws_conn_t *conn);
+/* an unmasked frame into dst, which has room for len + 10, returns its length */
+int ws_server_frame(uint8_t *dst, bool fin, bool rsv1, int opcode, const void *payload, int len);
+/* a message compressed if the connection has permessage-deflate, into malloc'ed *frame */
+int ws_server_message(ws_conn_t *conn, int opcode, const void *payload, int len, uint8_t **frame);
+int ws_server_send(ws_conn_t *conn, const void *data, int len);
+int ws_server_send_frame(ws_conn_t *conn, bool fin, int opcode, const void *payload, int len);
+int ws_server_send_message(ws_conn_t *conn, int opcode, const void *payload, int len);
+/* next frame from the client, unmasked into payload. Its length, -1 on error or timeout */
+int ws_server_read_frame(ws_conn_t *conn, int *opcode, uint8_t *payload, int size, int timeout_ms);
+/* CLOSE with a status code and reason */
+int ws_server_send_close(ws_conn_t *conn, int code, const char *reason);
+/* read until the client's CLOSE and answer it, returns its status code or -1 */
+int ws_server_finish(ws_conn_t *conn, int timeout_ms);
+
+#endif